@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "aio.h"
+
+/* A single io_uring shared by every thread, driven through the raw
+ * system calls.  The rings are only touched with aio_lock held.  At
+ * most depth operations are in flight at once, which is no more than
+ * the submission ring holds, so neither ring can overflow.  Threads
+ * that need a completion take turns sleeping in io_uring_enter; the
+ * one that does reaps everything that has finished and wakes the rest.
+ * Short transfers are resubmitted for the remainder. */
+
+struct aio_request
+{
+  struct aio_file* file;
+  int fd;
+  int write;
+  unsigned char* base;
+  unsigned char* buf;
+  unsigned long length;
+  unsigned long offset;
+};
+
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_done = PTHREAD_COND_INITIALIZER;
+static int ring_fd;
+static unsigned depth;
+static unsigned inflight;
+static unsigned unsubmitted;
+static int reaping;
+
+static unsigned* sq_tail;
+static unsigned* sq_mask;
+static unsigned* sq_array;
+static struct io_uring_sqe* sqes;
+static unsigned* cq_head;
+static unsigned* cq_tail;
+static unsigned* cq_mask;
+static struct io_uring_cqe* cqes;
+
+static int ring_enter(unsigned submit, unsigned complete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, ring_fd, submit, complete, flags, 0, 0);
+}
+
+/* Whether the kernel has the read and write operations, which came
+ * after io_uring itself.  Kernels too old to be probed lack them. */
+static int probe_ops(void)
+{
+  struct io_uring_probe* probe;
+  size_t size;
+  int ok;
+
+  size = sizeof *probe + 256 * sizeof probe->ops[0];
+  if ((probe = calloc(1, size)) == 0)
+    return 0;
+  ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+	       probe, 256) == 0
+    && probe->ops_len > IORING_OP_WRITE
+    && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+    && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+/* Returns 0 if io_uring cannot be used, in which case nothing else here
+ * may be called. */
+int aio_start(unsigned queue_depth)
+{
+  struct io_uring_params p;
+  unsigned char* sq;
+  unsigned char* cq;
+  size_t sq_size;
+  size_t cq_size;
+
+  memset(&p, 0, sizeof p);
+  if ((ring_fd = syscall(__NR_io_uring_setup, queue_depth, &p)) < 0)
+    return 0;
+  if (!probe_ops())
+    goto fail;
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size)
+    sq_size = cq_size;
+  sq = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    ring_fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    cq = sq;
+  else if ((cq = mmap(0, cq_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE,
+		      ring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    goto fail;
+  sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+	      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	      ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    goto fail;
+
+  sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned*)(sq + p.sq_off.array);
+  cq_head = (unsigned*)(cq + p.cq_off.head);
+  cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  depth = (queue_depth < p.sq_entries) ? queue_depth : p.sq_entries;
+  return 1;
+
+ fail:
+  close(ring_fd);
+  return 0;
+}
+
+/* Must be called with aio_lock held. */
+static void submit(struct aio_request* r)
+{
+  struct io_uring_sqe* sqe;
+  unsigned tail;
+  unsigned index;
+  int n;
+
+  tail = *sq_tail;
+  index = tail & *sq_mask;
+  sqe = &sqes[index];
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = r->fd;
+  sqe->addr = (unsigned long)r->buf;
+  /* A single operation transfers at most 1GB. */
+  sqe->len = (r->length < 1UL << 30) ? r->length : 1UL << 30;
+  sqe->off = r->offset;
+  sqe->user_data = (unsigned long)r;
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  /* Anything the kernel does not take now is passed along the next
+   * time a thread enters it. */
+  ++unsubmitted;
+  if ((n = ring_enter(unsubmitted, 0, 0)) > 0)
+    unsubmitted -= n;
+}
+
+static void finish(struct aio_request* r, int error)
+{
+  if (error != 0 && r->file->error == 0)
+    r->file->error = error;
+  --r->file->pending;
+  if (r->write)
+    free(r->base);
+  free(r);
+  --inflight;
+}
+
+/* Must be called with aio_lock held. */
+static void reap(void)
+{
+  struct io_uring_cqe* cqe;
+  struct aio_request* r;
+  unsigned head;
+  int res;
+
+  head = *cq_head;
+  while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &cqes[head & *cq_mask];
+    r = (struct aio_request*)(unsigned long)cqe->user_data;
+    res = cqe->res;
+    __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+
+    if (res == -EINTR || res == -EAGAIN)
+      submit(r);
+    else if (res < 0)
+      finish(r, -res);
+    else if (res == 0)
+      /* The file ended early or the disk is full. */
+      finish(r, r->write ? ENOSPC : EIO);
+    else if ((unsigned long)res < r->length) {
+      r->buf += res;
+      r->length -= res;
+      r->offset += res;
+      submit(r);
+    }
+    else
+      finish(r, 0);
+  }
+}
+
+/* Wait for at least one operation to finish.  Must be called with
+ * aio_lock held. */
+static void wait_one(void)
+{
+  unsigned submit_count;
+  int n;
+
+  if (reaping) {
+    pthread_cond_wait(&aio_done, &aio_lock);
+    return;
+  }
+  reaping = 1;
+  submit_count = unsubmitted;
+  unsubmitted = 0;
+  pthread_mutex_unlock(&aio_lock);
+  n = ring_enter(submit_count, 1, IORING_ENTER_GETEVENTS);
+  pthread_mutex_lock(&aio_lock);
+  if (n < 0)
+    n = 0;
+  unsubmitted += submit_count - n;
+  reap();
+  reaping = 0;
+  pthread_cond_broadcast(&aio_done);
+}
+
+static void queue(struct aio_file* file,
+		  int fd,
+		  int write,
+		  unsigned char* buf,
+		  unsigned long length,
+		  unsigned long offset)
+{
+  struct aio_request* r;
+
+  if ((r = malloc(sizeof *r)) == 0) {
+    pthread_mutex_lock(&aio_lock);
+    if (file->error == 0)
+      file->error = ENOMEM;
+    pthread_mutex_unlock(&aio_lock);
+    if (write)
+      free(buf);
+    return;
+  }
+  r->file = file;
+  r->fd = fd;
+  r->write = write;
+  r->base = r->buf = buf;
+  r->length = length;
+  r->offset = offset;
+
+  pthread_mutex_lock(&aio_lock);
+  while (inflight >= depth)
+    wait_one();
+  ++inflight;
+  ++file->pending;
+  submit(r);
+  pthread_mutex_unlock(&aio_lock);
+}
+
+void aio_read(struct aio_file* file,
+	      int fd,
+	      unsigned char* buf,
+	      unsigned long length,
+	      unsigned long offset)
+{
+  if (length > 0)
+    queue(file, fd, 0, buf, length, offset);
+}
+
+/* The buffer is handed over and freed once it has been written. */
+void aio_write(struct aio_file* file,
+	       int fd,
+	       unsigned char* buf,
+	       unsigned long length,
+	       unsigned long offset)
+{
+  if (length > 0)
+    queue(file, fd, 1, buf, length, offset);
+  else
+    free(buf);
+}
+
+/* Returns 0 with errno set if any of the operations failed. */
+int aio_wait(struct aio_file* file)
+{
+  int error;
+
+  pthread_mutex_lock(&aio_lock);
+  while (file->pending > 0)
+    wait_one();
+  error = file->error;
+  pthread_mutex_unlock(&aio_lock);
+  if (error != 0) {
+    errno = error;
+    return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,27 @@
+#ifndef AIO__H__
+#define AIO__H__
+
+/* Reads and writes that proceed in the background through io_uring.
+ * Each operation belongs to a file, and waiting on the file waits for
+ * all of its operations. */
+
+struct aio_file
+{
+  unsigned long pending;
+  int error;
+};
+
+extern int aio_start(unsigned depth);
+extern void aio_read(struct aio_file* file,
+		     int fd,
+		     unsigned char* buf,
+		     unsigned long length,
+		     unsigned long offset);
+extern void aio_write(struct aio_file* file,
+		      int fd,
+		      unsigned char* buf,
+		      unsigned long length,
+		      unsigned long offset);
+extern int aio_wait(struct aio_file* file);
+
+#endif
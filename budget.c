@@ -0,0 +1,41 @@
+#include "budget.h"
+
+/* A byte budget shared between concurrent conversions.  A limit of
+ * zero means unlimited.  A request larger than the whole budget is
+ * still admitted once nothing else is using it, so a single oversized
+ * file cannot deadlock the program. */
+
+void budget_init(struct budget* b, unsigned long limit)
+{
+  pthread_mutex_init(&b->lock, 0);
+  pthread_cond_init(&b->cond, 0);
+  b->limit = limit;
+  b->used = 0;
+}
+
+/* Block until the requested number of bytes fits in the budget. */
+void budget_acquire(struct budget* b, unsigned long bytes)
+{
+  pthread_mutex_lock(&b->lock);
+  if (b->limit > 0)
+    while (b->used > 0 && b->used + bytes > b->limit)
+      pthread_cond_wait(&b->cond, &b->lock);
+  b->used += bytes;
+  pthread_mutex_unlock(&b->lock);
+}
+
+/* Account for memory that is already in use and cannot wait. */
+void budget_charge(struct budget* b, unsigned long bytes)
+{
+  pthread_mutex_lock(&b->lock);
+  b->used += bytes;
+  pthread_mutex_unlock(&b->lock);
+}
+
+void budget_release(struct budget* b, unsigned long bytes)
+{
+  pthread_mutex_lock(&b->lock);
+  b->used = (bytes < b->used) ? b->used - bytes : 0;
+  pthread_cond_broadcast(&b->cond);
+  pthread_mutex_unlock(&b->lock);
+}
@@ -0,0 +1,19 @@
+#ifndef BUDGET__H__
+#define BUDGET__H__
+
+#include <pthread.h>
+
+struct budget
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned long limit;
+  unsigned long used;
+};
+
+extern void budget_init(struct budget* b, unsigned long limit);
+extern void budget_acquire(struct budget* b, unsigned long bytes);
+extern void budget_charge(struct budget* b, unsigned long bytes);
+extern void budget_release(struct budget* b, unsigned long bytes);
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+
+#include "cfa.h"
+#include "work.h"
+
+/* Each reduction halves both dimensions and keeps the CFA pattern:
+ * every 4x4 block of the source becomes a 2x2 block, each sample the
+ * average of the four source samples of the same color.  All the levels
+ * are built in one pass over the source, in bands of rows that reduce
+ * to whole blocks at every level. */
+
+#define BAND_ROWS (4 << CFA_MAX_LEVELS)
+
+struct band_job
+{
+  const struct cfa_image* src;
+  struct cfa_image* levels;
+  unsigned count;
+  uint32 row;
+};
+
+void cfa_reduced_size(uint32 width,
+		      uint32 height,
+		      unsigned level,
+		      uint32* level_width,
+		      uint32* level_height)
+{
+  for (; level > 0; --level) {
+    width = width / 4 * 2;
+    height = height / 4 * 2;
+  }
+  *level_width = width;
+  *level_height = height;
+}
+
+static void reduce_row(const uint16* a,
+		       const uint16* b,
+		       uint16* out,
+		       uint32 width)
+{
+  uint32 x;
+
+  for (x = 0; x < width; x += 2, a += 4, b += 4, out += 2) {
+    out[0] = (a[0] + a[2] + b[0] + b[2] + 2) >> 2;
+    out[1] = (a[1] + a[3] + b[1] + b[3] + 2) >> 2;
+  }
+}
+
+static void reduce_band(void* arg)
+{
+  const struct band_job* job = arg;
+  const struct cfa_image* src = job->src;
+  struct cfa_image* dst;
+  uint32 start = job->row;
+  uint32 end = job->row + BAND_ROWS;
+  uint32 in;
+  uint32 row;
+  unsigned level;
+
+  for (level = 0; level < job->count; ++level, src = dst) {
+    dst = &job->levels[level];
+    start /= 2;
+    end /= 2;
+    if (end > dst->height)
+      end = dst->height;
+    for (row = start; row < end; ++row) {
+      in = (row & ~1U) * 2 + (row & 1);
+      reduce_row(src->data + in * src->width,
+		 src->data + (in + 2) * src->width,
+		 dst->data + row * dst->width,
+		 dst->width);
+    }
+  }
+}
+
+/* Build count successively halved copies of the source.  Returns 0 if
+ * memory runs out, with all the levels freed. */
+int cfa_reduce(const struct cfa_image* src,
+	       struct cfa_image* levels,
+	       unsigned count)
+{
+  struct work_group group = { 0 };
+  struct band_job* jobs;
+  uint32 bands;
+  uint32 band;
+  unsigned level;
+  int ok;
+
+  for (level = 0; level < count; ++level) {
+    cfa_reduced_size(src->width, src->height, level + 1,
+		     &levels[level].width, &levels[level].height);
+    levels[level].data = malloc(levels[level].width * levels[level].height
+				* sizeof *levels[level].data);
+  }
+  bands = (src->height + BAND_ROWS - 1) / BAND_ROWS;
+  ok = (jobs = malloc(bands * sizeof *jobs)) != 0;
+  for (level = 0; level < count; ++level)
+    if (levels[level].data == 0)
+      ok = 0;
+  if (!ok) {
+    free(jobs);
+    for (level = 0; level < count; ++level) {
+      free(levels[level].data);
+      levels[level].data = 0;
+    }
+    return 0;
+  }
+
+  for (band = 0; band < bands; ++band) {
+    jobs[band].src = src;
+    jobs[band].levels = levels;
+    jobs[band].count = count;
+    jobs[band].row = band * BAND_ROWS;
+    work_submit(&group, reduce_band, &jobs[band]);
+  }
+  work_wait(&group);
+  free(jobs);
+  return 1;
+}
@@ -0,0 +1,25 @@
+#ifndef CFA__H__
+#define CFA__H__
+
+#include "uint.h"
+
+/* A Bayer CFA mosaic with a 2x2 repeat pattern. */
+struct cfa_image
+{
+  uint16* data;
+  uint32 width;
+  uint32 height;
+};
+
+#define CFA_MAX_LEVELS 6
+
+extern int cfa_reduce(const struct cfa_image* src,
+		      struct cfa_image* levels,
+		      unsigned count);
+extern void cfa_reduced_size(uint32 width,
+			     uint32 height,
+			     unsigned level,
+			     uint32* level_width,
+			     uint32* level_height);
+
+#endif
@@ -22,7 +22,7 @@ void warn(int sys, const char* format, ...)
 {
   va_list ap;
   va_start(ap, format);
-  msg(": Fatal error: ", sys, format, ap);
+  msg(": Warning: ", sys, format, ap);
   va_end(ap);
 }
 
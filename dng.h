@@ -0,0 +1,19 @@
+#ifndef DNG__H__
+#define DNG__H__
+
+#include "uint.h"
+
+/* The raw CFA image read back from a DNG file. */
+struct dng_raw
+{
+  uint32 width;
+  uint32 height;
+  uint16* data;
+};
+
+extern int dng_read_raw(const unsigned char* data,
+			uint32 length,
+			struct dng_raw* raw);
+extern uint32 dng_raw_ifd(const unsigned char* data, uint32 length);
+
+#endif
@@ -0,0 +1,243 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dng.h"
+#include "jpeg-ls.h"
+#include "tiff.h"
+#include "work.h"
+
+/* Read the raw image back out of a DNG file as written by this
+ * program: uncompressed 16-bit or packed 12-bit strips, or lossless
+ * JPEG tiles or strips.  Compressed tiles are decoded in parallel on
+ * the work queue. */
+
+struct tile_decode
+{
+  const unsigned char* data;
+  uint32 length;
+  struct dng_raw* raw;
+  uint32 x;
+  uint32 y;
+  uint32 tile_width;
+  uint32 tile_height;
+  int failed;
+};
+
+static inline uint32 minu(uint32 a, uint32 b)
+{
+  return (a < b) ? a : b;
+}
+
+/* Whether an image of the given dimensions can be held in memory,
+ * which its size in bytes is checked against before it is allocated. */
+static int fits(uint32 width, uint32 height)
+{
+  return width <= SIZE_MAX / sizeof(uint16) / height;
+}
+
+static void decode_tile(void* arg)
+{
+  struct tile_decode* job = arg;
+  struct dng_raw* raw = job->raw;
+  uint16* tile;
+  size_t size;
+  uint32 width;
+  uint32 height;
+  uint32 row;
+
+  width = minu(raw->width - job->x, job->tile_width);
+  height = minu(raw->height - job->y, job->tile_height);
+  size = (size_t)job->tile_width * job->tile_height;
+  if ((tile = malloc(size * sizeof *tile)) == 0
+      || !jpeg_ls_decode(job->data, job->length, tile, size)) {
+    job->failed = 1;
+    free(tile);
+    return;
+  }
+  for (row = 0; row < height; ++row)
+    memcpy(raw->data + (size_t)(job->y + row) * raw->width + job->x,
+	   tile + (size_t)row * job->tile_width,
+	   width * sizeof *tile);
+  free(tile);
+}
+
+static int read_compressed(const unsigned char* data,
+			   uint32 length,
+			   uint32 ifd,
+			   struct dng_raw* raw)
+{
+  struct work_group group = { 0 };
+  struct tiff_entry offsets;
+  struct tiff_entry counts;
+  struct tile_decode* jobs;
+  uint32 tile_width;
+  uint32 tile_height;
+  uint32 tiles_across;
+  unsigned long long count;
+  uint32 offset;
+  uint32 i;
+  int strips;
+  int ok;
+
+  strips = !tiff_read_tag(data, length, ifd, TileOffsets, &offsets);
+  if (strips) {
+    tile_width = raw->width;
+    tile_height = tiff_read_value(data, length, ifd, RowsPerStrip,
+				  raw->height);
+    if (!tiff_read_tag(data, length, ifd, StripOffset, &offsets)
+	|| !tiff_read_tag(data, length, ifd, StripByteCounts, &counts))
+      return 0;
+  }
+  else {
+    tile_width = tiff_read_value(data, length, ifd, TileWidth, 0);
+    tile_height = tiff_read_value(data, length, ifd, TileHeight, 0);
+    if (!tiff_read_tag(data, length, ifd, TileByteCounts, &counts))
+      return 0;
+  }
+  if (tile_width == 0 || tile_height == 0 || !fits(tile_width, tile_height))
+    return 0;
+  tiles_across = (raw->width + tile_width - 1) / tile_width;
+  count = (unsigned long long)tiles_across
+    * ((raw->height + tile_height - 1) / tile_height);
+  if (offsets.count != count || counts.count != count)
+    return 0;
+
+  if ((jobs = calloc(count, sizeof *jobs)) == 0)
+    return 0;
+  for (i = 0; i < count; ++i) {
+    offset = tiff_entry_value(&offsets, i);
+    jobs[i].length = tiff_entry_value(&counts, i);
+    if (offset > length || jobs[i].length > length - offset) {
+      jobs[i].failed = 1;
+      continue;
+    }
+    jobs[i].data = data + offset;
+    jobs[i].raw = raw;
+    jobs[i].x = i % tiles_across * tile_width;
+    jobs[i].y = i / tiles_across * tile_height;
+    jobs[i].tile_width = tile_width;
+    /* The last strip holds only the rows that remain, but tiles are
+     * always whole. */
+    jobs[i].tile_height = strips
+      ? minu(raw->height - jobs[i].y, tile_height)
+      : tile_height;
+    work_submit(&group, decode_tile, &jobs[i]);
+  }
+  work_wait(&group);
+
+  for (ok = 1, i = 0; i < count; ++i)
+    if (jobs[i].failed)
+      ok = 0;
+  free(jobs);
+  return ok;
+}
+
+static int read_uncompressed(const unsigned char* data,
+			     uint32 length,
+			     uint32 ifd,
+			     struct dng_raw* raw)
+{
+  struct tiff_entry offsets;
+  struct tiff_entry counts;
+  const unsigned char* src;
+  uint16* dst;
+  uint32 bits;
+  uint32 rows_per_strip;
+  uint32 strip;
+  uint32 offset;
+  uint32 rows;
+  uint32 row;
+  uint32 x;
+
+  bits = tiff_read_value(data, length, ifd, BitsPerSample, 0);
+  rows_per_strip = tiff_read_value(data, length, ifd, RowsPerStrip,
+				   raw->height);
+  if ((bits != 16 && bits != 12) || rows_per_strip == 0
+      || (bits == 12 && raw->width % 2 != 0)
+      || !tiff_read_tag(data, length, ifd, StripOffset, &offsets)
+      || !tiff_read_tag(data, length, ifd, StripByteCounts, &counts)
+      || offsets.count != counts.count
+      || offsets.count != (raw->height + rows_per_strip - 1) / rows_per_strip)
+    return 0;
+
+  for (dst = raw->data, row = 0, strip = 0; strip < offsets.count; ++strip) {
+    offset = tiff_entry_value(&offsets, strip);
+    rows = minu(raw->height - row, rows_per_strip);
+    if (offset > length
+	|| (unsigned long)rows * raw->width * bits / 8 > length - offset
+	|| tiff_entry_value(&counts, strip)
+	   < (unsigned long)rows * raw->width * bits / 8)
+      return 0;
+    src = data + offset;
+    for (row += rows; rows > 0; --rows) {
+      if (bits == 16)
+	for (x = 0; x < raw->width; ++x, src += 2)
+	  *dst++ = uint16_get_lsb(src);
+      else
+	for (x = 0; x < raw->width; x += 2, src += 3, dst += 2) {
+	  dst[0] = ((uint16)src[0] << 4) | (src[1] >> 4);
+	  dst[1] = (((uint16)src[1] << 8) | src[2]) & 0xfff;
+	}
+    }
+  }
+  return 1;
+}
+
+/* The IFD holding the full resolution raw image: the first with a
+ * NewSubfileType of 0, looking at the main IFD and then its SubIFDs. */
+uint32 dng_raw_ifd(const unsigned char* data, uint32 length)
+{
+  struct tiff_entry subifds;
+  uint32 ifd;
+  uint32 i;
+
+  if ((ifd = tiff_read_header(data, length)) == 0)
+    return 0;
+  if (tiff_read_value(data, length, ifd, NewSubfileType, 0) == 0)
+    return ifd;
+  if (tiff_read_tag(data, length, ifd, SubIFDs, &subifds))
+    for (i = 0; i < subifds.count; ++i)
+      if (tiff_read_value(data, length, tiff_entry_value(&subifds, i),
+			  NewSubfileType, 1) == 0)
+	return tiff_entry_value(&subifds, i);
+  return 0;
+}
+
+int dng_read_raw(const unsigned char* data,
+		 uint32 length,
+		 struct dng_raw* raw)
+{
+  uint32 ifd;
+  int ok;
+
+  /* The samples of uncompressed data are read as little-endian, so
+   * only little-endian files are accepted. */
+  raw->data = 0;
+  if ((ifd = dng_raw_ifd(data, length)) == 0 || data[0] != 'I'
+      || tiff_read_value(data, length, ifd, SamplesPerPixel, 1) != 1)
+    return 0;
+  raw->width = tiff_read_value(data, length, ifd, ImageWidth, 0);
+  raw->height = tiff_read_value(data, length, ifd, ImageLength, 0);
+  if (raw->width == 0 || raw->height == 0
+      || !fits(raw->width, raw->height)
+      || (raw->data = malloc((size_t)raw->width * raw->height
+			     * sizeof *raw->data)) == 0)
+    return 0;
+
+  switch (tiff_read_value(data, length, ifd, Compression, 1)) {
+  case 1:
+    ok = read_uncompressed(data, length, ifd, raw);
+    break;
+  case 7:
+    ok = read_compressed(data, length, ifd, raw);
+    break;
+  default:
+    ok = 0;
+  }
+  if (!ok) {
+    free(raw->data);
+    raw->data = 0;
+  }
+  return ok;
+}
@@ -0,0 +1,565 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "die.h"
+#include "dng.h"
+#include "jpeg-ls.h"
+#include "mrwtodng.h"
+#include "stream.h"
+#include "tiff.h"
+#include "uint.h"
+#include "work.h"
+
+const char program[] = "dngrecompress";
+const char usage[] =
+"Usage: dngrecompress [options] FILE.dng ...\n"
+"Recompress the raw image data of DNG files written by mrwtodng in place\n"
+"\n"
+"  -f, --force            Replace files even if they do not get smaller.\n"
+"  -t, --tile             Break compressed data into tiles (default).\n"
+"  -T, --no-tile          Compress the entire data as one block.\n"
+"  -s, --strips           Compress the data as multiple strips.\n"
+"  -r, --rows-per-strip=UNS  The maximum height of all the strips.\n"
+"  -h, --tile-height=UNS  The maximum height of all the tiles.\n"
+"  -w, --tile-width=UNS   The maximum width of all the tiles.\n"
+"  -e, --effort=LEVEL     Trade speed for size: fast, normal, or max.\n"
+"  -L, --layout=LAYOUT    Bayer row layout: fold, plain, or auto.\n"
+"  -a, --align=UNS        Start each tile or strip on a multiple of UNS bytes.\n"
+"  -j, --jobs=UNS         The number of worker threads to run.\n"
+"  -V, --verify           Decode each new file and compare it with the old.\n";
+
+/* Only the options that control the layout and encoding of the raw
+ * image data are used. */
+static struct mrwtodng_options options;
+static unsigned int opt_jobs = 0;
+static int opt_verify = 0;
+static int opt_force = 0;
+static int opt_layout = -1;
+
+/* The raw image data is rewritten after all the other data in the file,
+ * which is copied unchanged.  The raw IFD is replaced by a new one
+ * following the copied data, and only the SubIFDs entry that pointed to
+ * it is changed. */
+struct recompress
+{
+  const char* path;
+  const struct stat* st;
+  const unsigned char* data;
+  uint32 length;
+  uint32 raw_ifd;
+  uint32 raw_start;
+  unsigned bit_depth;
+  struct dng_raw raw;
+
+  struct tiff_ifd ifd;
+  struct tiff_tag* offset_tag;
+  struct tiff_tag* length_tag;
+  uint32 tile_width;
+  uint32 tile_height;
+  uint32 tile_count;
+  struct stream* tiles;
+};
+
+struct tile_job
+{
+  struct recompress* r;
+  uint32 tile;
+  uint32 x;
+  uint32 y;
+};
+
+static inline uint32 minu(uint32 a, uint32 b)
+{
+  return (a < b) ? a : b;
+}
+
+/* Report a problem with one file, which is then left unchanged. */
+static int fail(int sys, const char* format, const char* path)
+{
+  warn(sys, format, path);
+  return 0;
+}
+
+static uint32 align_offset(uint32 offset)
+{
+  return (offset + options.align - 1) / options.align * options.align;
+}
+
+/* The raw data must be the last thing in the file, so that everything
+ * before it can be kept where it is. */
+static int find_raw_data(struct recompress* r)
+{
+  struct tiff_entry offsets;
+  struct tiff_entry counts;
+  uint32 start;
+  uint32 end;
+  uint32 offset;
+  uint32 i;
+
+  if (!tiff_read_tag(r->data, r->length, r->raw_ifd, TileOffsets, &offsets)
+      || !tiff_read_tag(r->data, r->length, r->raw_ifd,
+			TileByteCounts, &counts))
+    if (!tiff_read_tag(r->data, r->length, r->raw_ifd,
+		       StripOffset, &offsets)
+	|| !tiff_read_tag(r->data, r->length, r->raw_ifd,
+			  StripByteCounts, &counts))
+      return fail(0, "No raw image data in '%s'", r->path);
+
+  for (start = ~0U, end = 0, i = 0; i < offsets.count; ++i) {
+    offset = tiff_entry_value(&offsets, i);
+    start = minu(start, offset);
+    if (offset + tiff_entry_value(&counts, i) > end)
+      end = offset + tiff_entry_value(&counts, i);
+  }
+  if (end != r->length || start < r->raw_ifd)
+    return fail(0, "The raw image data is not at the end of '%s'", r->path);
+  r->raw_start = start;
+  return 1;
+}
+
+/* The sample precision for the lossless JPEG data, from the white level
+ * if it covers every sample. */
+static void find_bit_depth(struct recompress* r)
+{
+  const uint32 count = r->raw.width * r->raw.height;
+  uint32 white;
+  uint32 max;
+  uint32 i;
+
+  white = tiff_read_value(r->data, r->length, r->raw_ifd, WhiteLevel, 65535);
+  for (max = 0, i = 0; i < count; ++i)
+    if (r->raw.data[i] > max)
+      max = r->raw.data[i];
+  if (max < white)
+    max = white;
+  for (r->bit_depth = 8; r->bit_depth < 16 && (max >> r->bit_depth) != 0; )
+    ++r->bit_depth;
+}
+
+static int layout_tag(enum tiff_tag_id id)
+{
+  switch (id) {
+  case Compression:
+  case BitsPerSample:
+  case StripOffset:
+  case StripByteCounts:
+  case RowsPerStrip:
+  case TileWidth:
+  case TileHeight:
+  case TileOffsets:
+  case TileByteCounts:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Copy the old raw IFD except for the tags describing the layout of the
+ * image data, and add new ones. */
+static void build_ifd(struct recompress* r)
+{
+  struct tiff_entry entry;
+  struct tiff_tag* tag;
+  enum tiff_tag_id id;
+  uint32 i;
+
+  for (i = 0;
+       tiff_read_entry(r->data, r->length, r->raw_ifd, i, &id, &entry);
+       ++i) {
+    if (layout_tag(id))
+      continue;
+    tag = tiff_ifd_add(&r->ifd, id, entry.type, entry.count);
+    memcpy(tag->data, entry.data, entry.count * tiff_type_size[entry.type]);
+  }
+
+  tiff_ifd_add_short(&r->ifd, BitsPerSample, 1, 16);
+  tiff_ifd_add_short(&r->ifd, Compression, 1, 7);
+  if (options.strips) {
+    r->offset_tag = tiff_ifd_add(&r->ifd, StripOffset, LONG, r->tile_count);
+    tiff_ifd_add_long(&r->ifd, RowsPerStrip, 1, r->tile_height);
+    r->length_tag = tiff_ifd_add(&r->ifd, StripByteCounts, LONG,
+				 r->tile_count);
+  }
+  else if (options.tile) {
+    tiff_ifd_add_long(&r->ifd, TileWidth, 1, r->tile_width);
+    tiff_ifd_add_long(&r->ifd, TileHeight, 1, r->tile_height);
+    r->offset_tag = tiff_ifd_add(&r->ifd, TileOffsets, LONG, r->tile_count);
+    r->length_tag = tiff_ifd_add(&r->ifd, TileByteCounts, LONG,
+				 r->tile_count);
+  }
+  else {
+    r->offset_tag = tiff_ifd_add_long(&r->ifd, StripOffset, 1, 0);
+    tiff_ifd_add_long(&r->ifd, RowsPerStrip, 1, r->raw.height);
+    r->length_tag = tiff_ifd_add_long(&r->ifd, StripByteCounts, 1, 0);
+  }
+}
+
+static void compress_tile(void* arg)
+{
+  const struct tile_job* job = arg;
+  struct recompress* r = job->r;
+  struct stream* out = &r->tiles[job->tile];
+  uint32 height;
+  uint32 length;
+
+  /* A tile whose stream could not be started is left empty. */
+  height = minu(r->raw.height - job->y, r->tile_height);
+  if (!stream_init(out))
+    return;
+  jpeg_ls_encode(out,
+		 r->raw.data + job->x + job->y * r->raw.width,
+		 height, options.strips ? height : r->tile_height,
+		 minu(r->raw.width - job->x, r->tile_width) / 2,
+		 r->tile_width / 2,
+		 2,
+		 r->bit_depth,
+		 r->raw.width,
+		 &options.encoder);
+  if ((length = stream_length(out)) & 1) {
+    stream_putc(out, 0);
+    ++length;
+  }
+  uint32_pack_lsb(length, r->length_tag->data + job->tile * 4);
+}
+
+static int compress_tiles(struct recompress* r)
+{
+  struct work_group group = { 0 };
+  struct tile_job* jobs;
+  uint32 x;
+  uint32 y;
+  uint32 tile;
+
+  if ((r->tiles = calloc(r->tile_count, sizeof *r->tiles)) == 0
+      || (jobs = malloc(r->tile_count * sizeof *jobs)) == 0)
+    return fail(0, "Out of memory recompressing '%s'", r->path);
+  for (tile = 0, y = 0; y < r->raw.height; y += r->tile_height) {
+    for (x = 0; x < r->raw.width; x += r->tile_width, ++tile) {
+      jobs[tile].r = r;
+      jobs[tile].tile = tile;
+      jobs[tile].x = x;
+      jobs[tile].y = y;
+      work_submit(&group, compress_tile, &jobs[tile]);
+    }
+  }
+  work_wait(&group);
+  free(jobs);
+  for (tile = 0; tile < r->tile_count; ++tile)
+    if (uint32_get_lsb(r->length_tag->data + tile * 4) == 0)
+      return fail(0, "Out of memory recompressing '%s'", r->path);
+  return 1;
+}
+
+/* Point the SubIFDs entry of the main IFD at the new raw IFD. */
+static int patch_subifds(const struct recompress* r,
+			  unsigned char* prefix,
+			  uint32 new_ifd)
+{
+  struct tiff_entry subifds;
+  uint32 ifd;
+  uint32 i;
+
+  ifd = tiff_read_header(r->data, r->length);
+  if (!tiff_read_tag(r->data, r->length, ifd, SubIFDs, &subifds))
+    return fail(0, "The raw image of '%s' is not in a SubIFD", r->path);
+  for (i = 0; i < subifds.count; ++i)
+    if (tiff_entry_value(&subifds, i) == r->raw_ifd)
+      break;
+  if (i == subifds.count || subifds.type != LONG
+      || subifds.data + i * 4 >= r->data + r->raw_start)
+    return fail(0, "The raw image of '%s' is not in a SubIFD", r->path);
+  uint32_pack_lsb(new_ifd, prefix + (subifds.data - r->data) + i * 4);
+  return 1;
+}
+
+/* Place the new IFD and the tiles after the copied data.  Returns the
+ * size of the new file. */
+static uint32 layout_file(struct recompress* r)
+{
+  uint32 end;
+  uint32 tile;
+
+  end = round_long(r->raw_start) + tiff_ifd_size(&r->ifd);
+  for (tile = 0; tile < r->tile_count; ++tile) {
+    end = align_offset(end);
+    uint32_pack_lsb(end, r->offset_tag->data + tile * 4);
+    end += uint32_get_lsb(r->length_tag->data + tile * 4);
+  }
+  return end;
+}
+
+static int write_file(struct recompress* r, const char* tmp)
+{
+  static const char zeros[256];
+  const struct stream_buffer* b;
+  unsigned char* prefix;
+  uint32 ifd_start;
+  uint32 end;
+  uint32 offset;
+  uint32 tile;
+  FILE* out;
+
+  ifd_start = round_long(r->raw_start);
+
+  if ((prefix = malloc(r->raw_start)) == 0)
+    return fail(0, "Out of memory recompressing '%s'", r->path);
+  memcpy(prefix, r->data, r->raw_start);
+  if (!patch_subifds(r, prefix, ifd_start)) {
+    free(prefix);
+    return 0;
+  }
+
+  if ((out = fopen(tmp, "wb")) == 0) {
+    free(prefix);
+    return fail(1, "Could not open '%s' for writing", tmp);
+  }
+  fwrite(prefix, 1, r->raw_start, out);
+  fwrite(zeros, 1, ifd_start - r->raw_start, out);
+  free(prefix);
+  end = tiff_write_ifd(out, &r->ifd, ifd_start);
+
+  for (tile = 0; tile < r->tile_count; ++tile) {
+    offset = uint32_get_lsb(r->offset_tag->data + tile * 4);
+    for (; end < offset; end += minu(offset - end, sizeof zeros))
+      fwrite(zeros, 1, minu(offset - end, sizeof zeros), out);
+    for (b = r->tiles[tile].head; b != 0; b = b->next)
+      fwrite(b->data, 1, b->count, out);
+    end += uint32_get_lsb(r->length_tag->data + tile * 4);
+  }
+
+  /* Keep the mode and, where allowed, the owner of the old file, and
+   * have the data on disk before the rename can make it visible. */
+  if (fflush(out) != 0
+      || fchmod(fileno(out), r->st->st_mode & 07777) != 0
+      || (fchown(fileno(out), r->st->st_uid, r->st->st_gid) != 0
+	  && errno != EPERM)
+      || fsync(fileno(out)) != 0
+      || ferror(out)) {
+    fclose(out);
+    return fail(1, "Could not write '%s'", tmp);
+  }
+  if (fclose(out) != 0)
+    return fail(1, "Could not write '%s'", tmp);
+  return 1;
+}
+
+/* Make a rename in the directory holding path durable. */
+static int sync_directory(const char* path)
+{
+  const char* slash;
+  char* dir;
+  int fd;
+  int ok;
+
+  if ((slash = strrchr(path, '/')) == 0)
+    fd = open(".", O_RDONLY | O_DIRECTORY);
+  else if ((dir = strndup(path, (slash == path) ? 1 : slash - path)) == 0)
+    return 0;
+  else {
+    fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+  }
+  if (fd < 0)
+    return 0;
+  ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+static int verify_file(const struct recompress* r, const char* path)
+{
+  struct dng_raw raw;
+  struct stat st;
+  void* map;
+  int fd;
+  int ok;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) != 0
+      || (map = mmap(0, st.st_size, PROT_READ, MAP_SHARED,
+		     fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+  ok = dng_read_raw(map, st.st_size, &raw)
+    && raw.width == r->raw.width
+    && raw.height == r->raw.height
+    && memcmp(raw.data, r->raw.data,
+	      raw.width * raw.height * sizeof *raw.data) == 0;
+  free(raw.data);
+  munmap(map, st.st_size);
+  close(fd);
+  return ok;
+}
+
+/* Write the new file next to the old one and rename it over it, so
+ * that a failure leaves the old one as it was.  Unless forced, a file
+ * is only replaced if that makes it smaller. */
+static int replace_file(struct recompress* r)
+{
+  char* tmp;
+  int ok;
+
+  if (layout_file(r) >= r->length && !opt_force) {
+    warn(0, "'%s' would not get smaller, leaving it unchanged", r->path);
+    return 1;
+  }
+  if ((tmp = malloc(strlen(r->path) + 5)) == 0)
+    return fail(0, "Out of memory recompressing '%s'", r->path);
+  strcpy(tmp, r->path);
+  strcat(tmp, ".tmp");
+  if (!(ok = write_file(r, tmp)))
+    ;
+  else if (opt_verify && !verify_file(r, tmp))
+    ok = fail(0, "Verification of '%s' failed, leaving it unchanged",
+	      r->path);
+  else if (rename(tmp, r->path) != 0)
+    ok = fail(1, "Could not replace '%s'", r->path);
+  else {
+    free(tmp);
+    return sync_directory(r->path)
+      || fail(1, "Could not sync the directory of '%s'", r->path);
+  }
+  unlink(tmp);
+  free(tmp);
+  return ok;
+}
+
+static int recompress(const char* path)
+{
+  struct recompress r;
+  struct stat st;
+  void* map;
+  uint32 tile;
+  int fd;
+  int ok;
+
+  memset(&r, 0, sizeof r);
+  r.path = path;
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return fail(1, "Could not open '%s' for reading", path);
+  if (fstat(fd, &st) != 0
+      || (map = mmap(0, st.st_size, PROT_READ, MAP_SHARED,
+		     fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return fail(1, "Could not read '%s'", path);
+  }
+  r.st = &st;
+  r.data = map;
+  r.length = st.st_size;
+
+  if ((r.raw_ifd = dng_raw_ifd(r.data, r.length)) == 0
+      || !dng_read_raw(r.data, r.length, &r.raw))
+    ok = fail(0, "Could not read the raw image from '%s'", path);
+  else if (r.raw.width % 2 != 0)
+    ok = fail(0, "The raw image of '%s' has an odd width", path);
+  else if ((ok = find_raw_data(&r))) {
+    find_bit_depth(&r);
+    r.tile_count = mrwtodng_tiles(&options, r.raw.width, r.raw.height,
+				  &r.tile_width, &r.tile_height);
+    build_ifd(&r);
+    ok = compress_tiles(&r) && replace_file(&r);
+  }
+
+  if (r.tiles != 0)
+    for (tile = 0; tile < r.tile_count; ++tile)
+      stream_free(&r.tiles[tile]);
+  free(r.tiles);
+  tiff_ifd_free(&r.ifd);
+  free(r.raw.data);
+  munmap(map, st.st_size);
+  close(fd);
+  return ok;
+}
+
+static const struct option long_options[] = {
+  { "force", no_argument, 0, 'f' },
+  { "tile", no_argument, 0, 't' },
+  { "no-tile", no_argument, 0, 'T' },
+  { "strips", no_argument, 0, 's' },
+  { "rows-per-strip", required_argument, 0, 'r' },
+  { "tile-height", required_argument, 0, 'h' },
+  { "tile-width", required_argument, 0, 'w' },
+  { "effort", required_argument, 0, 'e' },
+  { "layout", required_argument, 0, 'L' },
+  { "align", required_argument, 0, 'a' },
+  { "jobs", required_argument, 0, 'j' },
+  { "verify", no_argument, 0, 'V' },
+  { 0, 0, 0, 0 }
+};
+
+int main(int argc, char* argv[])
+{
+  const char* format = 0;
+  int ch;
+  int i;
+  int failed;
+
+  mrwtodng_defaults(&options);
+  while ((ch = getopt_long(argc, argv, "ftTsr:w:h:e:L:a:j:V",
+			   long_options, 0)) != -1) {
+    switch (ch) {
+    case 't': options.tile = 1; options.strips = 0; break;
+    case 'T': options.tile = 0; options.strips = 0; break;
+    case 's': options.tile = 0; options.strips = 1; break;
+    case 'r':
+      format = mrwtodng_dimension(&options, MRWTODNG_ROWS_PER_STRIP, optarg);
+      break;
+    case 'h':
+      format = mrwtodng_dimension(&options, MRWTODNG_TILE_HEIGHT, optarg);
+      break;
+    case 'w':
+      format = mrwtodng_dimension(&options, MRWTODNG_TILE_WIDTH, optarg);
+      break;
+    case 'e':
+      if (!mrwtodng_effort(&options, optarg))
+	die(1, "Invalid effort level: %s", optarg);
+      break;
+    case 'L':
+      if ((opt_layout = mrwtodng_layout(optarg)) < 0)
+	die(1, "Invalid layout: %s", optarg);
+      break;
+    case 'a':
+      if ((options.align = strtoul(optarg, 0, 10)) == 0)
+	die(1, "Invalid alignment: %s", optarg);
+      break;
+    case 'j':
+      if ((opt_jobs = strtoul(optarg, 0, 10)) == 0)
+	die(1, "Invalid number of jobs: %s", optarg);
+      break;
+    case 'V': opt_verify = 1; break;
+    case 'f': opt_force = 1; break;
+    default:
+      die_usage();
+    }
+    if (format != 0)
+      die(1, format, optarg);
+  }
+
+  if (argc - optind < 1)
+    die_usage();
+
+  if (opt_layout >= 0)
+    options.encoder.layout = opt_layout;
+
+  if (opt_jobs == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opt_jobs = (cpus > 0) ? cpus : 1;
+  }
+  if (!work_start(opt_jobs, 0))
+    die(1, "Could not start worker thread");
+
+  for (failed = 0, i = optind; i < argc; ++i)
+    if (!recompress(argv[i]))
+      failed = 1;
+
+  return failed;
+}
@@ -0,0 +1,304 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "jpeg-ls.h"
+
+/*****************************************************************************
+ * Lossless JPEG decoder for the subset written by jpeg_ls_encode: one
+ * SOF3 frame with one scan of all the components, no restart intervals
+ * and no point transform.
+ *****************************************************************************/
+
+#define LOOKAHEAD 9
+
+struct huffman_decoder
+{
+  /* Codes of up to LOOKAHEAD bits are found with one table lookup. */
+  unsigned char lookup_size[1 << LOOKAHEAD];
+  unsigned char lookup_value[1 << LOOKAHEAD];
+  /* Section F.2.2.3: the rest use the canonical code limits. */
+  int32_t maxcode[18];
+  int32_t valptr[17];
+  int32_t mincode[17];
+  unsigned char huffval[256];
+  int defined;
+};
+
+struct bitreader
+{
+  const unsigned char* ptr;
+  const unsigned char* end;
+  uint64_t buffer;
+  unsigned count;
+  /* Zero bytes supplied past the end of the entropy coded data. */
+  unsigned padding;
+};
+
+/*****************************************************************************
+ * Section C.2 and F.2.2.3: build the decoding tables from the lists of
+ * code lengths and values in a DHT segment.
+ *****************************************************************************/
+static int huffman_build(struct huffman_decoder* h,
+			 const unsigned char bits[16],
+			 const unsigned char* values,
+			 unsigned nvalues)
+{
+  unsigned length;
+  unsigned i;
+  unsigned k;
+  unsigned fill;
+  int32_t code;
+
+  memset(h, 0, sizeof *h);
+  memcpy(h->huffval, values, nvalues);
+
+  for (code = 0, k = 0, length = 1; length <= 16; ++length) {
+    /* The codes of each length must fit in that many bits before any
+     * of them go in the lookup tables. */
+    if (code + bits[length - 1] > (1 << length))
+      return 0;
+    h->valptr[length] = k;
+    h->mincode[length] = code;
+    for (i = 0; i < bits[length - 1]; ++i, ++k, ++code) {
+      if (k >= nvalues)
+	return 0;
+      if (length <= LOOKAHEAD) {
+	fill = 1 << (LOOKAHEAD - length);
+	memset(h->lookup_size + (code << (LOOKAHEAD - length)), length, fill);
+	memset(h->lookup_value + (code << (LOOKAHEAD - length)),
+	       values[k], fill);
+      }
+    }
+    h->maxcode[length] = bits[length - 1] ? code - 1 : -1;
+    code <<= 1;
+  }
+  h->maxcode[17] = INT32_MAX;
+  h->defined = 1;
+  return k == nvalues;
+}
+
+/* Keep at least 57 bits in the buffer.  Byte stuffing is removed, and
+ * once a marker or the end of the data is reached zeros are supplied,
+ * which is only an error if they are actually decoded. */
+static inline void fill_bits(struct bitreader* b)
+{
+  unsigned c;
+
+  while (b->count <= 56) {
+    c = 0;
+    if (b->ptr >= b->end)
+      ++b->padding;
+    else if ((c = *b->ptr) != 0xff)
+      ++b->ptr;
+    else if (b->ptr + 1 < b->end && b->ptr[1] == 0)
+      b->ptr += 2;
+    else {
+      c = 0;
+      ++b->padding;
+    }
+    b->buffer |= (uint64_t)c << (56 - b->count);
+    b->count += 8;
+  }
+}
+
+static inline unsigned get_bits(struct bitreader* b, unsigned n)
+{
+  unsigned value;
+
+  value = b->buffer >> (64 - n);
+  b->buffer <<= n;
+  b->count -= n;
+  return value;
+}
+
+static inline int decode_diff(struct bitreader* b,
+			      const struct huffman_decoder* h)
+{
+  unsigned peek;
+  unsigned size;
+  unsigned category;
+  int32_t code;
+  int diff;
+
+  fill_bits(b);
+  peek = b->buffer >> (64 - LOOKAHEAD);
+  if ((size = h->lookup_size[peek]) != 0) {
+    category = h->lookup_value[peek];
+    b->buffer <<= size;
+    b->count -= size;
+  }
+  else {
+    code = get_bits(b, LOOKAHEAD);
+    for (size = LOOKAHEAD; code > h->maxcode[size]; ++size)
+      code = (code << 1) | get_bits(b, 1);
+    if (size > 16)
+      return 65536;
+    category = h->huffval[h->valptr[size] + code - h->mincode[size]];
+  }
+
+  /* Section H.1.2.2: category 16 has no additional bits. */
+  if (category == 0)
+    return 0;
+  if (category > 16)
+    return 65536;
+  if (category == 16)
+    return 32768;
+  fill_bits(b);
+  diff = get_bits(b, category);
+  if (diff < (1 << (category - 1)))
+    diff -= (1 << category) - 1;
+  return diff;
+}
+
+/*****************************************************************************/
+int jpeg_ls_decode(const unsigned char* data,
+		   unsigned long length,
+		   uint16* out,
+		   unsigned long count)
+{
+  struct huffman_decoder tables[4];
+  const struct huffman_decoder* comp_table[4];
+  struct bitreader b;
+  const unsigned char* end = data + length;
+  const unsigned char* seg;
+  const unsigned char* p;
+  unsigned seglen;
+  unsigned marker;
+  unsigned bit_depth = 0;
+  unsigned rows = 0;
+  unsigned cols = 0;
+  unsigned channels = 0;
+  unsigned comp_id[4];
+  unsigned predictor;
+  unsigned i;
+  unsigned j;
+  unsigned n;
+  unsigned row;
+  unsigned col;
+  unsigned c;
+  unsigned rowlen;
+  uint16* prev;
+  uint16* cur;
+  int pred;
+  int ra;
+  int rb;
+  int rc;
+  int diff;
+
+  memset(tables, 0, sizeof tables);
+  if (length < 4 || data[0] != 0xff || data[1] != M_SOI)
+    return 0;
+
+  /* Section B.2: marker segments up to the scan. */
+  for (p = data + 2; ; p = seg + seglen) {
+    if (p + 4 > end || p[0] != 0xff)
+      return 0;
+    marker = p[1];
+    seglen = (p[2] << 8) | p[3];
+    seg = p + 4;
+    if (seglen < 2 || seg + (seglen -= 2) > end)
+      return 0;
+
+    switch (marker) {
+    case M_SOF3:
+      if (seglen < 6 || (channels = seg[5]) < 1 || channels > 4
+	  || seglen < 6 + 3 * channels)
+	return 0;
+      bit_depth = seg[0];
+      rows = (seg[1] << 8) | seg[2];
+      cols = (seg[3] << 8) | seg[4];
+      for (c = 0; c < channels; ++c) {
+	comp_id[c] = seg[6 + 3 * c];
+	if (seg[7 + 3 * c] != 0x11)
+	  return 0;
+      }
+      break;
+
+    case M_DHT:
+      for (i = 0; i < seglen; i += 17 + n) {
+	if (i + 17 > seglen || (seg[i] & 0xf0) != 0 || (seg[i] & 15) > 3)
+	  return 0;
+	for (n = 0, j = 1; j <= 16; ++j)
+	  n += seg[i + j];
+	if (i + 17 + n > seglen || n > 256
+	    || !huffman_build(&tables[seg[i] & 15], seg + i + 1,
+			      seg + i + 17, n))
+	  return 0;
+      }
+      break;
+
+    case M_SOS:
+      if (channels == 0 || seglen < 4 || seg[0] != channels
+	  || seglen < 4 + 2 * channels)
+	return 0;
+      for (c = 0; c < channels; ++c) {
+	if (seg[1 + 2 * c] != comp_id[c])
+	  return 0;
+	if ((j = seg[2 + 2 * c] >> 4) > 3 || !tables[j].defined)
+	  return 0;
+	comp_table[c] = &tables[j];
+      }
+      predictor = seg[1 + 2 * channels];
+      if (predictor < 1 || predictor > 7 || seg[3 + 2 * channels] != 0)
+	return 0;
+      goto scan;
+
+    case M_DRI:
+      /* Restart intervals are not handled. */
+      if (seglen < 2 || seg[0] != 0 || seg[1] != 0)
+	return 0;
+      break;
+
+    default:
+      /* Nor are any of the other coding processes. */
+      if ((marker & 0xf0) == 0xc0 && marker != M_DHT)
+	return 0;
+    }
+  }
+
+ scan:
+  if (bit_depth < 2 || bit_depth > 16
+      || (unsigned long)rows * cols * channels != count)
+    return 0;
+
+  b.ptr = seg + seglen;
+  b.end = end;
+  b.buffer = 0;
+  b.count = 0;
+  b.padding = 0;
+
+  /* Section H.1.2.1: the first row is predicted from the left, and the
+   * first column from above. */
+  rowlen = cols * channels;
+  for (prev = 0, cur = out, row = 0; row < rows; ++row) {
+    for (col = 0; col < cols; ++col) {
+      for (c = 0; c < channels; ++c) {
+	if ((diff = decode_diff(&b, comp_table[c])) > 32768)
+	  return 0;
+	if (col == 0)
+	  pred = (row == 0) ? 1 << (bit_depth - 1) : prev[c];
+	else if (row == 0)
+	  pred = cur[-(int)channels];
+	else {
+	  ra = cur[-(int)channels];
+	  rb = prev[col * channels + c];
+	  rc = prev[(col - 1) * channels + c];
+	  switch (predictor) {
+	  case 1: pred = ra; break;
+	  case 2: pred = rb; break;
+	  case 3: pred = rc; break;
+	  case 4: pred = ra + rb - rc; break;
+	  case 5: pred = ra + ((rb - rc) >> 1); break;
+	  case 6: pred = rb + ((ra - rc) >> 1); break;
+	  default: pred = (ra + rb) / 2; break;
+	  }
+	}
+	*cur++ = pred + diff;
+      }
+    }
+    prev = cur - rowlen;
+  }
+
+  /* Decoding must not have used any of the zeros past the data. */
+  return b.padding * 8 <= b.count;
+}
@@ -80,6 +80,41 @@ static void jpeg_write_huffman(struct bitstream* out,
     jpeg_write_byte(out, h->huffval[i]);
 }
 
+/*****************************************************************************
+ * The number of bytes jpeg_write_huffman will write
+ *****************************************************************************/
+unsigned jpeg_huffman_size(const struct jpeg_huffman_encoder* h)
+{
+  unsigned i;
+  unsigned length;
+
+  for (length = 0, i = 1; i <= 16; ++i)
+    length += h->bits[i];
+  return 2 + 2 + 1 + 16 + length;
+}
+
+/*****************************************************************************
+ * The number of bytes jpeg_write_start will write
+ *****************************************************************************/
+unsigned jpeg_start_size(unsigned channels,
+			 const struct jpeg_huffman_encoder* huffman,
+			 int multi_table)
+{
+  unsigned channel;
+  unsigned size;
+
+  size = 2			/* SOI */
+    + 2 + 8 + 3 * channels	/* SOF3 */
+    + 2 + 6 + 2 * channels;	/* SOS */
+  if (multi_table) {
+    for (channel = 0; channel < channels; ++channel)
+      size += jpeg_huffman_size(&huffman[channel]);
+  }
+  else
+    size += jpeg_huffman_size(huffman);
+  return size;
+}
+
 /*****************************************************************************
  * Write out the JPEG file start
  *****************************************************************************/
@@ -116,7 +151,7 @@ void jpeg_write_start(struct bitstream* stream,
       jpeg_write_huffman(stream, &huffman[channel], channel);
   }
   else
-    jpeg_write_huffman(stream, huffman, channel);
+    jpeg_write_huffman(stream, huffman, 0);
 
   /* B.2.3 Scan header syntax*/
   jpeg_write_marker(stream, M_SOS);
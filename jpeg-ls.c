@@ -1,9 +1,11 @@
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
 
 #include "jpeg-ls.h"
 
 static unsigned numbits[65536];
+static pthread_once_t numbits_once = PTHREAD_ONCE_INIT;
 
 static void init_numbits(void)
 {
@@ -17,6 +19,22 @@ static void init_numbits(void)
   }
 }
 
+/* Entropy coders for the differences.  The counting coder gathers the
+ * category frequencies for building Huffman tables, and the writing
+ * coder emits the bits.  Runs of zero differences, as produced by
+ * padding, are handed over in one call as a count of whole samples of
+ * all channels. */
+struct diff_coder
+{
+  void (*diff)(struct bitstream* stream,
+	       int diff,
+	       void* data);
+  void (*zeros)(struct bitstream* stream,
+		unsigned samples,
+		unsigned channels,
+		void* data[]);
+};
+
 static void count_diff(struct bitstream* stream,
 		       int diff,
 		       void* dataptr)
@@ -28,6 +46,18 @@ static void count_diff(struct bitstream* stream,
   (void)stream;
 }
 
+static void count_zeros(struct bitstream* stream,
+			unsigned samples,
+			unsigned channels,
+			void* data[])
+{
+  unsigned channel;
+
+  for (channel = 0; channel < channels; ++channel)
+    ((unsigned long*)data[channel])[0] += samples;
+  (void)stream;
+}
+
 static void write_diff(struct bitstream* stream,
 		       int diff,
 		       void* dataptr)
@@ -48,77 +78,223 @@ static void write_diff(struct bitstream* stream,
     jpeg_write_bits(stream, bits, data & ~(~0U << bits));
 }
 
-static void process_row(struct bitstream* stream,
-			void (*fn)(struct bitstream* stream,
-				   int diff,
-				   void* data),
+/* A zero difference is its category code alone, so a run of them is
+ * the same codes repeated.  Pack as many samples as fit into each call
+ * to the bit writer. */
+static void write_zeros(struct bitstream* stream,
+			unsigned samples,
+			unsigned channels,
+			void* data[])
+{
+  const struct jpeg_huffman_encoder* h;
+  unsigned channel;
+  unsigned size;
+  unsigned code;
+  unsigned per_write;
+  unsigned chunk;
+  unsigned i;
+
+  for (size = code = 0, channel = 0; channel < channels; ++channel) {
+    h = data[channel];
+    size += h->ehufsi[0];
+    code = (code << h->ehufsi[0]) | h->ehufco[0];
+  }
+
+  if (size > 24) {
+    while (samples-- > 0)
+      for (channel = 0; channel < channels; ++channel) {
+	h = data[channel];
+	jpeg_write_bits(stream, h->ehufsi[0], h->ehufco[0]);
+      }
+    return;
+  }
+  per_write = 24 / size;
+  for (chunk = 0, i = 0; i < per_write; ++i)
+    chunk = (chunk << size) | code;
+  for (; samples >= per_write; samples -= per_write)
+    jpeg_write_bits(stream, per_write * size, chunk);
+  if (samples > 0)
+    jpeg_write_bits(stream, samples * size,
+		    chunk & ~(~0U << (samples * size)));
+}
+
+static const struct diff_coder counter = { count_diff, count_zeros };
+static const struct diff_coder writer = { write_diff, write_zeros };
+
+/* The row kernels below are written for any channel count and are
+ * instantiated for each one, so the compiler can unroll the channel
+ * loops. */
+#ifdef __GNUC__
+#define KERNEL static inline __attribute__((always_inline))
+#else
+#define KERNEL static inline
+#endif
+
+/* Predictor context: Px is the predictor to calculate. Ra is the
+ * just encoded pixel and Rc and Rb are the pixels above as follows:
+ *
+ * Rc Rb
+ * Ra Px
+ */
+KERNEL void predict(int predictor,
+		    const uint16* row0,
+		    const uint16* row1,
+		    int pred[],
+		    const unsigned channels)
+{
+  unsigned c;
+
+  switch (predictor) {
+  case 1:			/* Px = Ra */
+    for (c = 0; c < channels; ++c)
+      pred[c] = row1[c];
+    break;
+  case 2:			/* Px = Rb */
+    for (c = 0; c < channels; ++c)
+      pred[c] = row0[channels + c];
+    break;
+  case 3:			/* Px = Rc */
+    for (c = 0; c < channels; ++c)
+      pred[c] = row0[c];
+    break;
+  case 4:			/* Px = Ra + Rb - Rc */
+    for (c = 0; c < channels; ++c)
+      pred[c] = row1[c] + row0[channels + c] - row0[c];
+    break;
+  case 5:			/* Px = Ra + ((Rb - Rc) >> 1) */
+    for (c = 0; c < channels; ++c)
+      pred[c] = row1[c] + ((row0[channels + c] - row0[c]) >> 1);
+    break;
+  case 6:			/* Px = Rb + ((Ra - Rc) >> 1) */
+    for (c = 0; c < channels; ++c)
+      pred[c] = row0[channels + c] + ((row1[c] - row0[c]) >> 1);
+    break;
+  case 7:
+    for (c = 0; c < channels; ++c)
+      pred[c] = (row1[c] + row0[channels + c]) / 2;
+    break;
+  }
+}
+
+/* Differences are taken modulo 2^16 (H.1.2.1).  Below 15 bits they
+ * always fit in category 15, so the reduction is only done for deeper
+ * samples. */
+KERNEL int difference(int sample, int pred, const int wrap)
+{
+  if (wrap)
+    return ((sample - pred + 32767) & 0xffff) - 32767;
+  return sample - pred;
+}
+
+static inline int clamp(int value, int maxval)
+{
+  return (value < 0) ? 0 : (value > maxval) ? maxval : value;
+}
+
+/* Encode one virtual row made of fold image rows of out_cols samples
+ * each.  Only the first enc_cols samples of each image row hold data;
+ * the rest is padding and is filled in here with the predicted value,
+ * which makes its difference zero whatever the predictor.  Predictions
+ * that fall outside the sample range are clamped, and only those cost
+ * more than the zero category code. */
+KERNEL void process_row(struct bitstream* stream,
+			const struct diff_coder* coder,
 			const uint16* row0,
-			const uint16* row1,
-			unsigned cols,
+			uint16* row1,
+			unsigned enc_cols,
+			unsigned out_cols,
+			unsigned fold,
+			int maxval,
 			void* data[],
-			int table1,
-			int predictor)
+			int predictor,
+			const unsigned channels,
+			const int wrap)
 {
   unsigned col;
-  int pred0;
-  int pred1;
-  int diff0;
-  int diff1;
-
-  pred0 = row0[0];
-  pred1 = row0[1];
-
-  for (col = 0; col < cols; ++col, row0 += 2, row1 += 2) {
-
-    diff0 = row1[0] - pred0;
-    diff1 = row1[1] - pred1;
-
-    fn(stream, diff0, data[0]);
-    fn(stream, diff1, data[table1]);
-
-    /* Predictor context: Px is the predictor to calculate. Ra is the
-     * just encoded pixel and Rc and Rb are the pixels above as follows:
-     *
-     * Rc Rb
-     * Ra Px
-     */
-    switch (predictor) {
-    case 1:			/* Px = Ra */
-      pred0 = row1[0];
-      pred1 = row1[1];
-      break;
-    case 2:			/* Px = Rb */
-      pred0 = row0[2];
-      pred1 = row0[3];
-      break;
-    case 3:			/* Px = Rc */
-      pred0 = row0[0];
-      pred1 = row0[1];
-      break;
-    case 4:			/* Px = Ra + Rb - Rc */
-      pred0 = row1[0] + row0[2] - row0[0];
-      pred1 = row1[1] + row0[3] - row0[1];
-      break;
-    case 5:			/* Px = Ra + ((Rb - Rc) >> 1) */
-      pred0 = row1[0] + ((row0[2] - row0[0]) >> 1);
-      pred1 = row1[1] + ((row0[3] - row0[1]) >> 1);
-      break;
-    case 6:			/* Px = Rb + ((Ra - Rc) >> 1) */
-      pred0 = row0[2] + ((row1[0] - row0[0]) >> 1);
-      pred1 = row0[3] + ((row1[1] - row0[1]) >> 1);
-      break;
-    case 7:
-      pred0 = (row1[0] + row0[2]) / 2;
-      pred1 = (row1[1] + row0[3]) / 2;
-      break;
+  unsigned run;
+  unsigned c;
+  int nonzero;
+  int pred[4];
+  int diff[4];
+
+  for (c = 0; c < channels; ++c)
+    pred[c] = row0[c];
+
+  for (run = 0; fold > 0; --fold) {
+
+    for (col = 0; col < enc_cols; ++col, row0 += channels, row1 += channels) {
+      for (c = 0; c < channels; ++c)
+	coder->diff(stream, difference(row1[c], pred[c], wrap), data[c]);
+      predict(predictor, row0, row1, pred, channels);
+    }
+
+    for (; col < out_cols; ++col, row0 += channels, row1 += channels) {
+      for (nonzero = 0, c = 0; c < channels; ++c) {
+	row1[c] = clamp(pred[c], maxval);
+	diff[c] = difference(row1[c], pred[c], wrap);
+	nonzero |= diff[c];
+      }
+      if (nonzero == 0)
+	++run;
+      else {
+	if (run > 0)
+	  coder->zeros(stream, run, channels, data);
+	run = 0;
+	for (c = 0; c < channels; ++c)
+	  coder->diff(stream, diff[c], data[c]);
+      }
+      predict(predictor, row0, row1, pred, channels);
     }
+
+    if (run > 0)
+      coder->zeros(stream, run, channels, data);
+    run = 0;
   }
 }
 
+typedef void (*row_kernel)(struct bitstream* stream,
+			   const struct diff_coder* coder,
+			   const uint16* row0,
+			   uint16* row1,
+			   unsigned enc_cols,
+			   unsigned out_cols,
+			   unsigned fold,
+			   int maxval,
+			   void* data[],
+			   int predictor);
+
+#define ROW_KERNEL(CHANNELS, WRAP)					\
+  static void process_row_##CHANNELS##_##WRAP(struct bitstream* stream,	\
+					      const struct diff_coder* coder, \
+					      const uint16* row0,	\
+					      uint16* row1,		\
+					      unsigned enc_cols,	\
+					      unsigned out_cols,	\
+					      unsigned fold,		\
+					      int maxval,		\
+					      void* data[],		\
+					      int predictor)		\
+  {									\
+    process_row(stream, coder, row0, row1, enc_cols, out_cols, fold,	\
+		maxval, data, predictor, CHANNELS, WRAP);		\
+  }
+
+ROW_KERNEL(1, 0)
+ROW_KERNEL(2, 0)
+ROW_KERNEL(3, 0)
+ROW_KERNEL(4, 0)
+ROW_KERNEL(1, 1)
+ROW_KERNEL(2, 1)
+ROW_KERNEL(3, 1)
+ROW_KERNEL(4, 1)
+
+static const row_kernel row_kernels[2][4] = {
+  { process_row_1_0, process_row_2_0, process_row_3_0, process_row_4_0 },
+  { process_row_1_1, process_row_2_1, process_row_3_1, process_row_4_1 },
+};
+
 static void process_image(struct bitstream* stream,
-			  void (*fn)(struct bitstream* stream,
-				     int diff,
-				     void* data),
+			  const struct diff_coder* coder,
 			  const uint16* rowptr,
 			  unsigned enc_rows,
 			  unsigned out_rows,
@@ -129,109 +305,238 @@ static void process_image(struct bitstream* stream,
 			  unsigned row_width,
 			  void* data[],
 			  int multi_table,
-			  int predictor)
+			  int predictor,
+			  unsigned fold)
 {
   unsigned row;
   unsigned vrow;
-  unsigned col;
-  unsigned vcol;
-  const int table1 = !!multi_table;
-  uint16 vrows[2][out_cols*channels*2];
+  unsigned channel;
+  const int maxval = (1 << bit_depth) - 1;
+  const row_kernel kernel = row_kernels[bit_depth > 14][channels - 1];
+  void* tables[4];
+  /* The predictor for the column past the end is calculated but never
+   * used, so leave room for it to be read. */
+  uint16 vrows[2][out_cols*channels*fold + channels];
   uint16* vrow0;
   uint16* vrow1;
   uint16* ptr;
-  uint16 last0;
-  uint16 last1;
 
+  for (channel = 0; channel < channels; ++channel)
+    tables[channel] = data[multi_table ? channel : 0];
   vrow0 = vrows[0];
   vrow1 = vrows[1];
 
-  for (row = 0; row < enc_rows; row += 2) {
+  for (row = 0; row < enc_rows; row += fold) {
 
     if (row == 0)
-      vrow0[0] = vrow0[1] = 1 << (bit_depth - 1);
-
-    for (ptr = vrow1, vcol = vrow = 0; vrow < 2; ++vrow) {
-      for (col = 0; col < enc_cols * channels; ++col, ++vcol, ++ptr)
-	*ptr = rowptr[col];
-      last0 = ptr[-2];
-      last1 = ptr[-1];
-      for (; col < out_cols * channels; col += 2, vcol += 2, ptr += 2) {
-	ptr[0] = last0;
-	ptr[1] = last1;
-      }
-      rowptr += row_width;
-    }
+      for (channel = 0; channel < channels; ++channel)
+	vrow0[channel] = 1 << (bit_depth - 1);
+
+    for (vrow = 0; vrow < fold; ++vrow, rowptr += row_width)
+      memcpy(vrow1 + vrow * out_cols * channels, rowptr,
+	     enc_cols * channels * sizeof *rowptr);
 
-    process_row(stream, fn, vrow0, vrow1, out_cols * 2, data, table1,
-		(row == 0) ? 1 : predictor);
+    kernel(stream, coder, vrow0, vrow1, enc_cols, out_cols, fold,
+	   maxval, tables, (row == 0) ? 1 : predictor);
 
     ptr = vrow0;
     vrow0 = vrow1;
     vrow1 = ptr;
   }
-  for (; row < out_rows; row += 2) {
-#if 0
-    /* This doesn't work for predictors 5 and 6, and so the bitstream is
-     * larger. */
-    for (col = 0; col < out_cols * 2 / channels; ++col) {
-      fn(stream, 0, data[0]);
-      fn(stream, 0, data[table1]);
-    }
-#else
-    process_row(stream, fn, vrow0, vrow1, out_cols * 2, data, table1,
-		predictor);
+
+  /* Rows below the data are all padding. */
+  for (; row < out_rows; row += fold) {
+    kernel(stream, coder, vrow0, vrow1, 0, out_cols, fold,
+	   maxval, tables, predictor);
     ptr = vrow0;
     vrow0 = vrow1;
     vrow1 = ptr;
-#endif
   }
 }
 
-static int best_predictor(const uint16* data,
-			  unsigned enc_rows,
-			  unsigned out_rows,
-			  unsigned enc_cols,
-			  unsigned out_cols,
-			  unsigned channels,
-			  unsigned bit_depth,
-			  unsigned row_width,
-			  int multi_table,
-			  struct jpeg_huffman_encoder huffman[8][2])
+/* The number of bits used by encoding the counted differences with the
+ * given table: the Huffman code for each category plus that many
+ * additional bits, except for category 16 which has none.  Differences
+ * of a full bit_depth bits are possible, so every category is counted. */
+static unsigned long table_bits(const struct jpeg_huffman_encoder* h,
+				const unsigned long freq[256])
+{
+  unsigned long bits;
+  unsigned i;
+
+  for (bits = 0, i = 0; i < 16; ++i)
+    bits += (h->ehufsi[i] + i) * freq[i];
+  bits += h->ehufsi[16] * freq[16];
+  return bits;
+}
+
+/* Find the predictor (and, if allowed, the number of Huffman tables
+ * and the row folding) that produces the smallest output, and fill in
+ * the tables to encode with.  One table shared by all channels codes
+ * the data less tightly but saves DHT segments, which can win on small
+ * or flat tiles, so the two are compared on their total size.  Returns
+ * the estimated number of bits of entropy coded data.  If sizes is not
+ * null, the projected number of bytes of the best encoding using each
+ * table mode is also stored there, indexed by JPEG_LS_TABLES_MULTI and
+ * JPEG_LS_TABLES_SINGLE. */
+static unsigned long best_encoding(const uint16* data,
+				   unsigned enc_rows,
+				   unsigned out_rows,
+				   unsigned enc_cols,
+				   unsigned out_cols,
+				   unsigned channels,
+				   unsigned bit_depth,
+				   unsigned row_width,
+				   const struct jpeg_ls_options* options,
+				   struct jpeg_huffman_encoder huffman[4],
+				   int* predictorp,
+				   int* multi_tablep,
+				   unsigned* foldp,
+				   unsigned long sizes[2])
 {
+  unsigned long modecost[2] = { ~0UL, ~0UL };
+  unsigned long bestcost;
   unsigned long bestbits;
   unsigned long bits;
+  unsigned long cost;
   unsigned i;
-  int bestpred;
+  unsigned channel;
   int pred;
-  void* dataptrs[2];
-  unsigned long freq[2][256];
-
-  bestbits = ~0UL;
-  bestpred = 1;
-  for (pred = 1; pred < 8; ++pred) {
-    memset(freq, 0, sizeof freq);
-    dataptrs[0] = freq[0];
-    dataptrs[1] = freq[1];
-    process_image(0, count_diff, data,
-		  enc_rows, out_rows, enc_cols, out_cols,
-		  channels, bit_depth, row_width, dataptrs,
-		  multi_table, pred);
-    jpeg_huffman_generate(&huffman[pred][0], freq[0]);
-    if (multi_table)
-      jpeg_huffman_generate(&huffman[pred][1], freq[1]);
-    /* Estimate roughly the number of bits used by this encoding. */
-    for (bits = 0, i = 0; i < bit_depth; ++i)
-      bits += (huffman[pred][0].ehufsi[i] + i) * freq[0][i];
-    if (multi_table)
-      for (bits = 0, i = 0; i < bit_depth; ++i)
-	bits += (huffman[pred][1].ehufsi[i] + i) * freq[1][i];
-    if (bits < bestbits) {
-      bestbits = bits;
-      bestpred = pred;
+  int first;
+  int last;
+  unsigned fold;
+  unsigned first_fold;
+  unsigned last_fold;
+  void* dataptrs[4];
+  unsigned long freq[4][256];
+  struct jpeg_huffman_encoder tables[4];
+
+  first = (options->predictor > 0) ? options->predictor : 1;
+  last = (options->predictor > 0) ? options->predictor : 7;
+  first_fold = (options->layout == JPEG_LS_LAYOUT_PLAIN) ? 1 : 2;
+  last_fold = (options->layout == JPEG_LS_LAYOUT_FOLD) ? 2 : 1;
+  /* Folding takes rows two at a time. */
+  if (enc_rows % 2 != 0 || out_rows % 2 != 0)
+    first_fold = last_fold = 1;
+  bestcost = bestbits = ~0UL;
+  *predictorp = first;
+  *multi_tablep = 1;
+  *foldp = first_fold;
+  for (fold = first_fold; fold >= last_fold; --fold) {
+    for (pred = first; pred <= last; ++pred) {
+      memset(freq, 0, sizeof freq);
+      for (channel = 0; channel < channels; ++channel)
+	dataptrs[channel] = freq[channel];
+      process_image(0, &counter, data,
+		    enc_rows, out_rows, enc_cols, out_cols,
+		    channels, bit_depth, row_width, dataptrs,
+		    1, pred, fold);
+
+      if (options->tables != JPEG_LS_TABLES_SINGLE || channels == 1) {
+	for (bits = cost = 0, channel = 0; channel < channels; ++channel) {
+	  jpeg_huffman_generate(&tables[channel], freq[channel]);
+	  bits += table_bits(&tables[channel], freq[channel]);
+	  cost += 8 * jpeg_huffman_size(&tables[channel]);
+	}
+	cost += bits;
+	if (sizes != 0 && cost < modecost[JPEG_LS_TABLES_MULTI]) {
+	  modecost[JPEG_LS_TABLES_MULTI] = cost;
+	  sizes[JPEG_LS_TABLES_MULTI] = (bits + 7) / 8 + 2
+	    + jpeg_start_size(channels, tables, 1);
+	}
+	if (cost < bestcost) {
+	  bestcost = cost;
+	  bestbits = bits;
+	  *predictorp = pred;
+	  *multi_tablep = 1;
+	  *foldp = fold;
+	  memcpy(huffman, tables, channels * sizeof *tables);
+	}
+      }
+
+      if (options->tables != JPEG_LS_TABLES_MULTI && channels > 1) {
+	for (channel = 1; channel < channels; ++channel)
+	  for (i = 0; i < 256; ++i)
+	    freq[0][i] += freq[channel][i];
+	jpeg_huffman_generate(&tables[0], freq[0]);
+	bits = table_bits(&tables[0], freq[0]);
+	cost = bits + 8 * jpeg_huffman_size(&tables[0]);
+	if (sizes != 0 && cost < modecost[JPEG_LS_TABLES_SINGLE]) {
+	  modecost[JPEG_LS_TABLES_SINGLE] = cost;
+	  sizes[JPEG_LS_TABLES_SINGLE] = (bits + 7) / 8 + 2
+	    + jpeg_start_size(channels, tables, 0);
+	}
+	if (cost < bestcost) {
+	  bestcost = cost;
+	  bestbits = bits;
+	  *predictorp = pred;
+	  *multi_tablep = 0;
+	  *foldp = fold;
+	  huffman[0] = tables[0];
+	}
+      }
     }
   }
-  return bestpred;
+  if (sizes != 0 && channels == 1)
+    sizes[JPEG_LS_TABLES_SINGLE] = sizes[JPEG_LS_TABLES_MULTI];
+  return bestbits;
+}
+
+/*****************************************************************************/
+unsigned long jpeg_ls_estimate(const uint16* data,
+			       unsigned enc_rows,
+			       unsigned out_rows,
+			       unsigned enc_cols,
+			       unsigned out_cols,
+			       unsigned channels,
+			       unsigned bit_depth,
+			       unsigned row_width,
+			       const struct jpeg_ls_options* options)
+{
+  struct jpeg_huffman_encoder huffman[4];
+  int multi_table;
+  int predictor;
+  unsigned fold;
+  unsigned long bits;
+
+  assert(channels >= 1 && channels <= 4);
+  assert(bit_depth >= 2 && bit_depth <= 16);
+
+  pthread_once(&numbits_once, init_numbits);
+  bits = best_encoding(data, enc_rows, out_rows, enc_cols, out_cols,
+		       channels, bit_depth, row_width, options,
+		       huffman, &predictor, &multi_table, &fold, 0);
+  return (bits + 7) / 8
+    + jpeg_start_size(channels, huffman, multi_table)
+    + 2;
+}
+
+/*****************************************************************************/
+void jpeg_ls_estimate_tables(const uint16* data,
+			     unsigned enc_rows,
+			     unsigned out_rows,
+			     unsigned enc_cols,
+			     unsigned out_cols,
+			     unsigned channels,
+			     unsigned bit_depth,
+			     unsigned row_width,
+			     const struct jpeg_ls_options* options,
+			     unsigned long sizes[2])
+{
+  struct jpeg_huffman_encoder huffman[4];
+  struct jpeg_ls_options both = *options;
+  int multi_table;
+  int predictor;
+  unsigned fold;
+
+  assert(channels >= 1 && channels <= 4);
+  assert(bit_depth >= 2 && bit_depth <= 16);
+
+  both.tables = JPEG_LS_TABLES_AUTO;
+  pthread_once(&numbits_once, init_numbits);
+  best_encoding(data, enc_rows, out_rows, enc_cols, out_cols,
+		channels, bit_depth, row_width, &both,
+		huffman, &predictor, &multi_table, &fold, sizes);
 }
 
 /*****************************************************************************/
@@ -243,21 +548,24 @@ int jpeg_ls_encode(struct stream* stream,
 		   unsigned out_cols,
 		   unsigned channels,
 		   unsigned bit_depth,
-		   unsigned row_width)
+		   unsigned row_width,
+		   const struct jpeg_ls_options* options)
 {
-  struct jpeg_huffman_encoder huffman[8][2];
+  struct jpeg_huffman_encoder huffman[4];
   struct bitstream bitstream = { stream, 0, 0 };
-  int multi_table = 1;
-  void* dataptrs[2];
-  int predictor = 7;
+  int multi_table;
+  void* dataptrs[4];
+  unsigned channel;
+  int predictor;
+  unsigned fold;
 
-  /* FIXME: This encoder only handles 2-channel data from raw images. */
-  assert(channels == 2);
+  assert(channels >= 1 && channels <= 4);
+  assert(bit_depth >= 2 && bit_depth <= 16);
 
-  init_numbits();
-  predictor = best_predictor(data, enc_rows, out_rows, enc_cols, out_cols,
-			     channels, bit_depth, row_width, multi_table,
-			     huffman);
+  pthread_once(&numbits_once, init_numbits);
+  best_encoding(data, enc_rows, out_rows, enc_cols, out_cols,
+		channels, bit_depth, row_width, options,
+		huffman, &predictor, &multi_table, &fold, 0);
 
   /* The Bayer image matrix is typically similar to:
    *
@@ -278,16 +586,19 @@ int jpeg_ls_encode(struct stream* stream,
    * color pairs switch in the middle of a row, there will be a pair of
    * poor predictions made at that switch, but that's a relatively minor
    * effect compared to the benefits of allowing better prediction
-   * above. */
-  /* FIXME: this 2-row merging should be made adjustable too. */
-  jpeg_write_start(&bitstream, out_rows/2, out_cols*2, channels, bit_depth,
-		   huffman[predictor], multi_table, predictor);
-  dataptrs[0] = &huffman[predictor][0];
-  dataptrs[1] = &huffman[predictor][1];
-  process_image(&bitstream, write_diff, data,
+   * above.
+   *
+   * Which layout predicts better depends on the image content, so the
+   * plain one-row-per-row layout may be chosen instead. */
+  jpeg_write_start(&bitstream, out_rows/fold, out_cols*fold,
+		   channels, bit_depth,
+		   huffman, multi_table, predictor);
+  for (channel = 0; channel < channels; ++channel)
+    dataptrs[channel] = &huffman[channel];
+  process_image(&bitstream, &writer, data,
 		enc_rows, out_rows, enc_cols, out_cols,
 		channels, bit_depth, row_width, dataptrs,
-		multi_table, predictor);
+		multi_table, predictor, fold);
   jpeg_write_flush(&bitstream);
   jpeg_write_end(&bitstream);
 
@@ -9,6 +9,7 @@
 #define M_SOI 0xd8
 #define M_EOI 0xd9
 #define M_SOS 0xda
+#define M_DRI 0xdd
 
 struct jpeg_huffman_encoder
 {
@@ -18,7 +19,22 @@ struct jpeg_huffman_encoder
   unsigned ehufsi[256];
 };
 
-#define SINGLE_HUFFMAN 0
+#define JPEG_LS_TABLES_MULTI 0
+#define JPEG_LS_TABLES_SINGLE 1
+#define JPEG_LS_TABLES_AUTO 2
+
+/* Pairs of Bayer rows are folded into one JPEG row, or each is its own
+ * JPEG row. */
+#define JPEG_LS_LAYOUT_FOLD 0
+#define JPEG_LS_LAYOUT_PLAIN 1
+#define JPEG_LS_LAYOUT_AUTO 2
+
+struct jpeg_ls_options
+{
+  int predictor;		/* 1-7, or 0 to search for the best one */
+  int tables;			/* One of the JPEG_LS_TABLES_* choices */
+  int layout;			/* One of the JPEG_LS_LAYOUT_* choices */
+};
 
 struct bitstream
 {
@@ -46,6 +62,10 @@ extern void jpeg_write_start(struct bitstream* stream,
 			     int multi_table,
 			     int predictor);
 extern void jpeg_write_end(struct bitstream* stream);
+extern unsigned jpeg_huffman_size(const struct jpeg_huffman_encoder* h);
+extern unsigned jpeg_start_size(unsigned channels,
+				const struct jpeg_huffman_encoder* huffman,
+				int multi_table);
 
 extern int jpeg_ls_encode(struct stream* stream,
 			  const uint16* data,
@@ -55,6 +75,35 @@ extern int jpeg_ls_encode(struct stream* stream,
 			  unsigned out_cols,
 			  unsigned channels,
 			  unsigned bit_depth,
-			  unsigned row_width);
+			  unsigned row_width,
+			  const struct jpeg_ls_options* options);
+extern unsigned long jpeg_ls_estimate(const uint16* data,
+				      unsigned enc_rows,
+				      unsigned out_rows,
+				      unsigned enc_cols,
+				      unsigned out_cols,
+				      unsigned channels,
+				      unsigned bit_depth,
+				      unsigned row_width,
+				      const struct jpeg_ls_options* options);
+/* Decode a lossless JPEG holding exactly count samples into out, row
+ * by row with the channels interleaved.  Returns 0 if the data is
+ * malformed or uses features the encoder never writes. */
+extern int jpeg_ls_decode(const unsigned char* data,
+			  unsigned long length,
+			  uint16* out,
+			  unsigned long count);
+/* Estimate the size with both table modes from one set of counting
+ * passes; sizes is indexed by JPEG_LS_TABLES_MULTI and _SINGLE. */
+extern void jpeg_ls_estimate_tables(const uint16* data,
+				    unsigned enc_rows,
+				    unsigned out_rows,
+				    unsigned enc_cols,
+				    unsigned out_cols,
+				    unsigned channels,
+				    unsigned bit_depth,
+				    unsigned row_width,
+				    const struct jpeg_ls_options* options,
+				    unsigned long sizes[2]);
 
 #endif
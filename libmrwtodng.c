@@ -0,0 +1,1969 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "budget.h"
+#include "cfa.h"
+#include "dng.h"
+#include "jpeg-ls.h"
+#include "md5.h"
+#include "mrw.h"
+#include "mrwtodng.h"
+#include "preview.h"
+#include "stream.h"
+#include "tiff.h"
+#include "uint.h"
+#include "work.h"
+
+#define PREVIEW_QUALITY 90
+
+/* A reduced-resolution copy of the raw image, always compressed in
+ * tiles. */
+struct reduced
+{
+  struct cfa_image image;
+  struct tiff_ifd ifd;
+  uint32 tile_width;
+  uint32 tile_height;
+  uint32 tile_count;
+  struct stream* tiles;
+  struct tiff_tag* offset_tag;
+  struct tiff_tag* length_tag;
+};
+
+/* The state of one conversion. */
+struct dng
+{
+  const struct mrwtodng_options* opt;
+  const char* source;
+  char* error;
+
+  /* The output goes through a stdio stream that passes it on to the
+   * caller's writer. */
+  mrwtodng_writer write;
+  void* write_arg;
+  int write_failed;
+
+  struct tiff_ifd mainifd;
+  struct tiff_ifd exififd;
+  struct tiff_ifd subifd1;
+  struct tiff_ifd iopifd;
+  struct tiff_ifd subifd2;
+
+  struct mrw mrw;
+
+  uint32 tile_width;
+  uint32 tile_height;
+  uint32 tile_count;
+  struct stream* compressed_data;
+  struct tiff_tag* raw_offset_tag;
+  struct tiff_tag* raw_length_tag;
+  struct tiff_tag* iop_offset_tag;
+
+  const unsigned char* thumbnail_start;
+  uint32 thumbnail_length;
+  const struct tiff_tag* thumbnail_offset_tag;
+
+  /* The preview is rendered while the raw data is compressed. */
+  struct preview preview;
+  struct stream preview_data;
+  struct work_group preview_group;
+  int preview_ok;
+  struct tiff_tag* preview_offset_tag;
+
+  /* So are the reduced-resolution copies. */
+  struct reduced reduced[MRWTODNG_MAX_REDUCED];
+  struct work_group reduced_group;
+  struct reduced_job* reduced_jobs;
+  uint32 reduced_start;
+
+  /* The file offset where the raw image data begins, before any
+   * alignment padding. */
+  uint32 image_start;
+
+  unsigned char digest[MD5_DIGEST_LENGTH];
+
+  /* The memory still held from the budget.  Tile jobs update it
+   * concurrently. */
+  unsigned long held;
+};
+
+static int fail(char* error, const char* format, ...)
+{
+  va_list ap;
+
+  if (error != 0) {
+    va_start(ap, format);
+    vsnprintf(error, MRWTODNG_ERROR_SIZE, format, ap);
+    va_end(ap);
+  }
+  return 0;
+}
+
+static void note(const struct dng* dng, const char* format, ...)
+{
+  char message[MRWTODNG_ERROR_SIZE];
+  va_list ap;
+
+  if (dng->opt->warning != 0) {
+    va_start(ap, format);
+    vsnprintf(message, sizeof message, format, ap);
+    va_end(ap);
+    dng->opt->warning(dng->opt->warning_arg, message);
+  }
+}
+
+/* Each conversion has its estimated peak memory reserved from the
+ * budget before its raw data is loaded.  Tiles are charged at their
+ * worst case size and the slack is returned as soon as each one is
+ * compressed. */
+static void charge(struct dng* dng, unsigned long bytes)
+{
+  __sync_fetch_and_add(&dng->held, bytes);
+  if (dng->opt->budget != 0)
+    budget_charge(dng->opt->budget, bytes);
+}
+
+static void release(struct dng* dng, unsigned long bytes)
+{
+  __sync_fetch_and_sub(&dng->held, bytes);
+  if (dng->opt->budget != 0)
+    budget_release(dng->opt->budget, bytes);
+}
+
+static void parse_ifd(struct dng* dng,
+		      const unsigned char* start,
+		      uint32 offset,
+		      void (*fn)(struct dng* dng,
+				 const unsigned char* start,
+				 enum tiff_tag_id tag,
+				 enum tiff_tag_type type,
+				 uint32 count,
+				 uint32 value));
+
+static int parse_prd(struct dng* dng)
+{
+  uint32 x;
+  uint32 y;
+  const unsigned char* data = dng->mrw.prd.data;
+  
+  if (memcmp(data, "21810002", 8) == 0) {
+    tiff_ifd_add_ascii(&dng->mainifd, UniqueCameraModel,
+		       "Konica Minolta Maxxum 7D");
+    tiff_ifd_add_ascii(&dng->mainifd, LocalizedCameraModel,
+		       "Konica Minolta Maxxum 7D");
+  }
+  else
+    return fail(dng->error, "Unknown camera model");
+
+  tiff_ifd_add_long(&dng->subifd1, ImageWidth, 1, dng->mrw.width);
+  tiff_ifd_add_long(&dng->subifd1, ImageLength, 1, dng->mrw.height);
+  tiff_ifd_add_long(&dng->subifd1, ActiveArea, 4,
+		    0, 0, dng->mrw.height, dng->mrw.width);
+  
+  /* The preview is half the size of the crop, so it must be at least
+   * two pixels each way. */
+  y = uint16_get_msb(data + 12);
+  x = uint16_get_msb(data + 14);
+  if (x < 2 || x > dng->mrw.width || y < 2 || y > dng->mrw.height)
+    return fail(dng->error, "Invalid crop size");
+  tiff_ifd_add_rational(&dng->subifd1, DefaultScale, 2, 1, 1, 1, 1);
+  tiff_ifd_add_rational(&dng->subifd1, DefaultCropOrigin, 2,
+			(dng->mrw.width - x) / 2, 1, (dng->mrw.height - y) / 2, 1);
+  tiff_ifd_add_rational(&dng->subifd1, DefaultCropSize, 2, x, 1, y, 1);
+
+  /* The preview covers the default crop, starting on a whole CFA
+   * block. */
+  if (dng->opt->preview) {
+    dng->preview.x = (dng->mrw.width - x) / 2 & ~1U;
+    dng->preview.y = (dng->mrw.height - y) / 2 & ~1U;
+    dng->preview.width = x / 2;
+    dng->preview.height = y / 2;
+    tiff_ifd_add_long(&dng->subifd2, ImageWidth, 1, dng->preview.width);
+    tiff_ifd_add_long(&dng->subifd2, ImageLength, 1, dng->preview.height);
+    tiff_ifd_add_long(&dng->subifd2, RowsPerStrip, 1, dng->preview.height);
+  }
+
+  if (data[16] != 12)
+    return fail(dng->error, "Invalid DataSize number");
+  if (data[17] != 12)
+    return fail(dng->error, "Invalid PixelSize number");
+  if (data[18] != 0x59)
+    return fail(dng->error, "Invalid StorageMethod number");
+
+  if (uint16_get_msb(data + 22) != 1)
+    return fail(dng->error, "Invalid BayerPattern number");
+  tiff_ifd_add_short(&dng->subifd1, CFARepeatPattern, 2, 2, 2);
+  tiff_ifd_add_byte(&dng->subifd1, CFAPattern, 4, "\0\1\1\2");
+  tiff_ifd_add_byte(&dng->subifd1, CFAPlaneColor, 3, "\0\1\2");
+  tiff_ifd_add_short(&dng->subifd1, CFALayout, 1, 1);
+  return 1;
+}
+
+static void parse_ttw_makernote(struct dng* dng,
+				const unsigned char* start,
+				enum tiff_tag_id tag,
+				enum tiff_tag_type type,
+				uint32 count,
+				uint32 value)
+{
+  switch (tag) {
+  case MLTThumbnailOffset:
+    dng->thumbnail_start = start + value;
+    break;
+  case MLTThumbnailLength:
+    dng->thumbnail_length = value;
+    break;
+  default:
+    ;
+  }
+  (void)type;
+  (void)count;
+}
+
+/* DNGPrivateData is to contain:
+
+1) Six bytes containing the zero-terminated string "Adobe" (the DNG spec
+calls for the DNGPrivateData tag to start with an ASCII string
+identifying the creator/format).
+
+2) An ASCII string ("MakN" for a Makernote), presumably indicating what
+sort of data is being stored here. Note that this is not
+zero-terminated.
+
+3) A four-byte count (number of data bytes following); for a simple
+MakerNote copy this the length of the original MakerNote data, plus six
+additional bytes to store the next two data items.
+
+4) The byte-order indicator from the original file (the usual 'MM'/4D4D
+or 'II'/4949).
+
+5) The original file offset for the MakerNote tag data (stored according
+to the byte order given above).
+
+6) The contents of the MakerNote tag. This appears to be a simple
+byte-for-byte copy, with no modification.
+*/
+
+static void add_makernote(struct dng* dng,
+			  const unsigned char* start,
+			  uint32 offset,
+			  uint32 length)
+{
+  unsigned char tmpstr[20 + length
+		       + 8 + dng->mrw.prd.length
+		       + 8 + dng->mrw.wbg.length
+		       + 8 + dng->mrw.rif.length
+		       + 12];
+  /* Stuff the original maker note into the DNG */
+  memcpy(tmpstr, "Adobe\0MakN\0\0\0\0\x4d\x4d\x00\x00\x00\x00", 20);
+  uint32_pack_msb(offset, tmpstr + 16);
+  uint32_pack_msb(length + 6, tmpstr + 10);
+  memcpy(tmpstr + 20, start, length);
+  length += 20;
+  /* Adobe RAW converter also adds other bits of the MRW here */
+  memcpy(tmpstr + length, "MRW \0\0\0\0\x4d\x4d\x00\x03", 12);
+  length += 12;
+  
+  uint32_pack_msb(8 + dng->mrw.prd.length
+		  + 8 + dng->mrw.wbg.length
+		  + 8 + dng->mrw.rif.length
+		  + 4, tmpstr + length - 8);
+  memcpy(tmpstr + length, dng->mrw.prd.data - 8, dng->mrw.prd.length + 8);
+  length += dng->mrw.prd.length + 8;
+  memcpy(tmpstr + length, dng->mrw.wbg.data - 8, dng->mrw.wbg.length + 8);
+  length += dng->mrw.wbg.length + 8;
+  memcpy(tmpstr + length, dng->mrw.rif.data - 8, dng->mrw.rif.length + 8);
+  length += dng->mrw.rif.length + 8;
+  tiff_ifd_add_byte(&dng->mainifd, DNGPrivateData, length, tmpstr);
+}
+
+static struct tiff_tag* copy_tag(const struct dng* dng,
+				 struct tiff_ifd* ifd,
+				 const unsigned char* start,
+				 enum tiff_tag_id tag,
+				 enum tiff_tag_type type,
+				 uint32 count,
+				 uint32 value)
+{
+  struct tiff_tag* newtag;
+  uint32 i;
+  
+  newtag = tiff_ifd_add(ifd, tag, type, count);
+    
+  switch (type) {
+  case ASCII:
+  case UNDEFINED:
+    if (count > 4)
+      memcpy(newtag->data, start + value, newtag->size);
+    else {
+      for (i = 0; i < count; ++i, value <<= 8)
+	newtag->data[i] = value >> 24;
+    }
+    break;
+  case SHORT:
+  case SSHORT:
+    if (count == 1)
+      uint16_pack_lsb(value >> 16, newtag->data);
+    else if (count == 2) {
+      uint16_pack_lsb(value >> 16, newtag->data);
+      uint16_pack_lsb(value, newtag->data + 2);
+    }
+    else
+      for (i = 0; i < count; ++i)
+	uint16_pack_lsb(uint16_get_msb(start + value + i * 2),
+			newtag->data + i * 2);
+    break;
+  case RATIONAL:
+  case SRATIONAL:
+    for (i = 0; i < count; ++i) {
+      uint32_pack_lsb(uint32_get_msb(start + value + i * 8),
+		      newtag->data + i * 8);
+      uint32_pack_lsb(uint32_get_msb(start + value + i * 8 + 4),
+		      newtag->data + i * 8 + 4);
+    }
+    break;
+  case LONG:
+    if (count == 1)
+      uint32_pack_lsb(value, newtag->data);
+    else
+      for (i = 0; i < count; ++i)
+	uint32_pack_lsb(uint32_get_msb(start + value + i * 4),
+			newtag->data + i * 4);
+    break;
+  default:
+    note(dng, "Unhandled SubEXIF type #%d", type);
+  }
+  return newtag;
+}
+
+static void parse_ttw_iop(struct dng* dng,
+			  const unsigned char* start,
+			  enum tiff_tag_id tag,
+			  enum tiff_tag_type type,
+			  uint32 count,
+			  uint32 value)
+{
+  copy_tag(dng, &dng->iopifd, start, tag, type, count, value);
+}
+
+static void parse_ttw_subtag(struct dng* dng,
+			     const unsigned char* start,
+			     enum tiff_tag_id tag,
+			     enum tiff_tag_type type,
+			     uint32 count,
+			     uint32 value)
+{
+  switch (tag) {
+  case MakerNote:
+    parse_ifd(dng, start, value, parse_ttw_makernote);
+    add_makernote(dng, start + value, value, count);
+    break;
+  case InteroperabilityIFD:
+    dng->iop_offset_tag = tiff_ifd_add_long(&dng->exififd, tag, 1, 0);
+    parse_ifd(dng, start, value, parse_ttw_iop);
+    break;
+  default:
+    copy_tag(dng, &dng->exififd, start, tag, type, count, value);
+  }
+}
+
+static void parse_ttw_tag(struct dng* dng,
+			  const unsigned char* start,
+			  enum tiff_tag_id tag,
+			  enum tiff_tag_type type,
+			  uint32 count,
+			  uint32 value)
+{
+  switch (tag) {
+  case ImageWidth:
+  case ImageLength:
+  case Compression:
+    break;
+    
+  case DateTime:
+  case ImageDescription:
+  case Make:
+  case Model:
+  case Software:
+    tiff_ifd_add_ascii(&dng->mainifd, tag, (const char*)start + value);
+    break;
+  case ExifIFD:
+    parse_ifd(dng, start, value, parse_ttw_subtag);
+    break;
+  case Orientation:
+    tiff_ifd_add_short(&dng->mainifd, tag, 1, value >> 16);
+    break;
+  case PrintIM:
+    tiff_ifd_add_undefined(&dng->exififd, tag, count,
+			   (const char*)start + value);
+    break;
+  case XResolution:
+  case YResolution:
+  case ResolutionUnit:
+    break;
+  default:
+    note(dng, "Unhandled EXIF tag #%d", tag);
+  }
+  (void)type;
+}
+
+static void parse_ifd(struct dng* dng,
+		      const unsigned char* start,
+		      uint32 offset,
+		      void (*fn)(struct dng* dng,
+				 const unsigned char* start,
+				 enum tiff_tag_id tag,
+				 enum tiff_tag_type type,
+				 uint32 count,
+				 uint32 value))
+{
+  uint32 entries;
+  enum tiff_tag_id tag;
+  enum tiff_tag_type type;
+  uint32 count;
+  uint32 value;
+
+  for (entries = uint16_get_msb(start + offset), offset += 2;
+       entries > 0;
+       --entries, offset += 12) {
+    tag = uint16_get_msb(start + offset);
+    type = uint16_get_msb(start + offset + 2);
+    count = uint32_get_msb(start + offset + 4);
+    value = uint32_get_msb(start + offset + 8);
+
+    fn(dng, start, tag, type, count, value);
+  }
+}
+
+static int parse_ttw(struct dng* dng)
+{
+  if (memcmp(dng->mrw.ttw.data, "MM\0\052\0\0\0\010", 8) != 0)
+    return fail(dng->error, "Invalid TTW block format");
+
+  parse_ifd(dng, dng->mrw.ttw.data, 8, parse_ttw_tag);
+
+  /* The thumbnail is what the main IFD describes. */
+  if (dng->thumbnail_start == 0 || dng->thumbnail_length < 2
+      || dng->thumbnail_start < dng->mrw.ttw.data
+      || dng->thumbnail_start + dng->thumbnail_length
+         > dng->mrw.ttw.data + dng->mrw.ttw.length)
+    return fail(dng->error, "No thumbnail in TTW block");
+
+  tiff_ifd_add_long(&dng->mainifd, ImageWidth, 1, 640);
+  tiff_ifd_add_long(&dng->mainifd, ImageLength, 1, 480);
+  tiff_ifd_add_short(&dng->mainifd, BitsPerSample, 3, 8, 8, 8);
+  tiff_ifd_add_short(&dng->mainifd, Compression, 1, 7);
+  tiff_ifd_add_short(&dng->mainifd, PhotometricInterpretation, 1,
+		     6 /* 2 */);
+  dng->thumbnail_offset_tag = tiff_ifd_add_long(&dng->mainifd, StripOffset,
+						1, 0);
+  tiff_ifd_add_short(&dng->mainifd, SamplesPerPixel, 1, 3);
+  tiff_ifd_add_long(&dng->mainifd, RowsPerStrip, 1, 480);
+  tiff_ifd_add_long(&dng->mainifd, StripByteCounts, 1,
+		    dng->thumbnail_length);
+  tiff_ifd_add_short(&dng->mainifd, PlanarConfiguration, 1, 1);
+  tiff_ifd_add_short(&dng->mainifd, YCbCrSubSampling, 2, 2, 1);
+  tiff_ifd_add_rational(&dng->mainifd, RefBlackWhite, 6,
+			0,1, 255,1, 128,1, 255,1, 128,1, 255,1);
+
+  tiff_ifd_add_rational(&dng->mainifd, YCbCrCoefficients, 3,
+			299,1000, 587,1000, 114,1000);
+  tiff_ifd_add_short(&dng->mainifd, YCbCrPositioning, 1, 2);
+  return 1;
+}
+
+static void parse_wbg(struct dng* dng)
+{
+  double r;
+  double g;
+  double b;
+  const unsigned char* data = dng->mrw.wbg.data;
+  r = uint16_get_msb(data + 4) * 1.0 / (64 << data[0]);
+  g = uint16_get_msb(data + 6) * 1.0 / (64 << data[1])
+    + uint16_get_msb(data + 8) * 1.0 / (64 << data[2]);
+  g /= 2.0;
+  b = uint16_get_msb(data + 10) * 1.0 / (64 << data[3]);
+
+  tiff_ifd_add_rational(&dng->mainifd, AnalogBalance, 3,
+			1000000, 1000000,
+			1000000, 1000000,
+			1000000, 1000000);
+  tiff_ifd_add_rational(&dng->mainifd, AsShotNeutral, 3,
+			(uint32)(1000000 / r), 1000000,
+			(uint32)(1000000 / g), 1000000,
+			(uint32)(1000000 / b), 1000000);
+
+  dng->preview.balance[0] = r / g;
+  dng->preview.balance[1] = 1.0;
+  dng->preview.balance[2] = b / g;
+}
+
+static void start_dng(struct dng* dng)
+{
+  uint16 s;
+
+  tzset();
+  s = -timezone / 60 / 60;
+
+  tiff_ifd_add_long(&dng->mainifd, NewSubfileType, 1, 1);
+  tiff_ifd_add_sshort(&dng->mainifd, TimeZoneOffset, 2, s, s);
+  tiff_ifd_add_byte(&dng->mainifd, DNGVersion, 4, "\1\2\0\0");
+  tiff_ifd_add_byte(&dng->mainifd, DNGBackwardVersion, 4, "\1\1\0\0");
+  tiff_ifd_add_ascii(&dng->mainifd, OriginalRawFileName, dng->source);
+  tiff_ifd_add_byte(&dng->mainifd, RawImageDigest, sizeof dng->digest,
+		    (const char*)dng->digest);
+  /* FIXME: are these all really constant? */
+  tiff_ifd_add_srational(&dng->mainifd, BaselineExposure, 1, -50,100);
+  tiff_ifd_add_rational(&dng->mainifd, BaselineNoise, 1, 133,100);
+  tiff_ifd_add_rational(&dng->mainifd, BaselineSharpness, 1, 133,100);
+  tiff_ifd_add_rational(&dng->mainifd, LinearResponseLimit, 1, 100,100);
+  tiff_ifd_add_rational(&dng->mainifd, ShadowScale, 1, 1,1);
+  tiff_ifd_add_short(&dng->mainifd, CalibrationIlluminant1, 1, 17);
+  tiff_ifd_add_short(&dng->mainifd, CalibrationIlluminant2, 1, 21);
+  tiff_ifd_add_srational(&dng->mainifd, ColorMatrix1, 9,
+			 12036,10000, -4954,10000, -75,10000,
+			 -7019,10000, 14449,10000, 2811,10000,
+			 -513,10000, 635,10000, 6839,10000);
+  tiff_ifd_add_srational(&dng->mainifd, ColorMatrix2, 9,
+			 10239,10000, -3104,10000, -1099,10000,
+			 -8037,10000, 15727,10000, 2451,10000,
+			 -927,10000, 925,10000, 6871,10000);
+  
+  tiff_ifd_add_long(&dng->subifd1, NewSubfileType, 1, 0);
+  tiff_ifd_add_short(&dng->subifd1, PhotometricInterpretation, 1, 32803);
+  tiff_ifd_add_short(&dng->subifd1, BitsPerSample, 1,
+		     (!dng->opt->compress && dng->opt->packed) ? 12 : 16);
+  tiff_ifd_add_long(&dng->subifd1, BayerGreenSplit, 1, 500);
+  tiff_ifd_add_short(&dng->subifd1, PlanarConfiguration, 1, 1);
+  tiff_ifd_add_short(&dng->subifd1, Compression, 1, dng->opt->compress ? 7 : 1);
+  tiff_ifd_add_short(&dng->subifd1, SamplesPerPixel, 1, 1);
+  tiff_ifd_add_rational(&dng->subifd1, AntiAliasStrength, 1, 100, 100);
+  tiff_ifd_add_rational(&dng->subifd1, BestQualityScale, 1, 1, 1);
+  tiff_ifd_add_short(&dng->subifd1, BlackLevelRepeatDim, 2, 1, 1);
+  tiff_ifd_add_rational(&dng->subifd1, BlackLevel, 1, 0, 256);
+  tiff_ifd_add_short(&dng->subifd1, WhiteLevel, 1, 4095);
+
+  if (dng->opt->preview) {
+    tiff_ifd_add_long(&dng->subifd2, NewSubfileType, 1, 1);
+    tiff_ifd_add_short(&dng->subifd2, PhotometricInterpretation, 1, 6);
+    tiff_ifd_add_short(&dng->subifd2, PlanarConfiguration, 1, 1);
+    tiff_ifd_add_short(&dng->subifd2, SamplesPerPixel, 1, 3);
+    tiff_ifd_add_short(&dng->subifd2, BitsPerSample, 3, 8, 8, 8);
+    tiff_ifd_add_short(&dng->subifd2, Compression, 1, 7);
+    tiff_ifd_add_rational(&dng->subifd2, RefBlackWhite, 6,
+			  0, 1, 255, 1, 128, 1, 255, 1, 128, 1, 255, 1);
+    tiff_ifd_add_rational(&dng->subifd2, YCbCrCoefficients, 3,
+			  299,1000, 587,1000, 114,1000);
+    tiff_ifd_add_short(&dng->subifd2, YCbCrSubSampling, 2, 2, 2);
+    tiff_ifd_add_short(&dng->subifd2, YCbCrPositioning, 1, 2);
+    tiff_ifd_add_long(&dng->subifd2, PreviewColorSpace, 1, 2 /* sRGB */);
+    dng->preview_offset_tag = tiff_ifd_add_long(&dng->subifd2, StripOffset,
+						1, 0);
+  }
+}
+
+static uint32 align_offset(const struct dng* dng, uint32 offset)
+{
+  const uint32 align = dng->opt->align;
+
+  return (offset + align - 1) / align * align;
+}
+
+static void end_dng(struct dng* dng)
+{
+  uint32 end;
+  struct tiff_tag* sub_tag;
+  struct tiff_tag* exif_tag;
+  const struct reduced* level;
+  uint32 tile;
+  unsigned i;
+
+  sub_tag = tiff_ifd_add(&dng->mainifd, SubIFDs, LONG,
+			 1 + !!dng->opt->preview + dng->opt->reduced);
+  exif_tag = tiff_ifd_add(&dng->mainifd, ExifIFD, LONG, 1);
+
+  end = 8 + tiff_ifd_size(&dng->mainifd);
+
+  uint32_pack_lsb(end, sub_tag->data);
+  end += tiff_ifd_size(&dng->subifd1);
+  if (dng->opt->preview) {
+    uint32_pack_lsb(end, sub_tag->data + 4);
+    end += tiff_ifd_size(&dng->subifd2);
+  }
+  for (i = 0; i < dng->opt->reduced; ++i) {
+    uint32_pack_lsb(end, sub_tag->data + (1 + !!dng->opt->preview + i) * 4);
+    end += tiff_ifd_size(&dng->reduced[i].ifd);
+  }
+  uint32_pack_lsb(end, exif_tag->data);
+  end += tiff_ifd_size(&dng->exififd);
+
+  if (dng->iop_offset_tag != 0) {
+    uint32_pack_lsb(end, dng->iop_offset_tag->data);
+    end += tiff_ifd_size(&dng->iopifd);
+  }
+  
+  uint32_pack_lsb(end, dng->thumbnail_offset_tag->data);
+  end += dng->thumbnail_length;
+
+  if (dng->opt->preview) {
+    uint32_pack_lsb(end, dng->preview_offset_tag->data);
+    end += stream_length(&dng->preview_data);
+  }
+
+  /* The reduced copies come before the full image, which is kept last
+   * in the file. */
+  dng->reduced_start = end;
+  for (i = 0; i < dng->opt->reduced; ++i) {
+    level = &dng->reduced[i];
+    for (tile = 0; tile < level->tile_count; ++tile) {
+      end = align_offset(dng, end);
+      uint32_pack_lsb(end, level->offset_tag->data + tile * 4);
+      end += uint32_get_lsb(level->length_tag->data + tile * 4);
+    }
+  }
+
+  dng->image_start = end;
+  for (tile = 0; tile < dng->tile_count; ++tile) {
+    end = align_offset(dng, end);
+    uint32_pack_lsb(end, dng->raw_offset_tag->data + tile * 4);
+    end += uint32_get_lsb(dng->raw_length_tag->data + tile * 4);
+  }
+}
+
+static uint32 encode_block(const struct dng* dng,
+			   struct stream* out,
+			   const uint16* data,
+			   uint32 row_width,
+			   uint32 enc_width,
+			   uint32 out_width,
+			   uint32 enc_height,
+			   uint32 out_height)
+{
+  uint32 length;
+  
+  if (!stream_init(out))
+    return 0;
+  jpeg_ls_encode(out,
+		 data,
+		 enc_height, out_height,
+		 enc_width / 2, out_width / 2,
+		 2,
+		 12,
+		 row_width,
+		 &dng->opt->encoder);
+  if ((length = stream_length(out)) & 1) {
+    stream_putc(out, 0);
+    ++length;
+  }
+  return length;
+}
+
+static uint32 compress_block(const struct dng* dng,
+			     struct stream* out,
+			     uint32 xoffset,
+			     uint32 enc_width,
+			     uint32 out_width,
+			     uint32 yoffset,
+			     uint32 enc_height,
+			     uint32 out_height)
+{
+  return encode_block(dng, out,
+		      dng->mrw.raw + xoffset + yoffset * dng->mrw.width,
+		      dng->mrw.width,
+		      enc_width, out_width,
+		      enc_height, out_height);
+}
+
+static inline uint32 minu(uint32 a, uint32 b)
+{
+  return (a < b) ? a : b;
+}
+
+/* The memory held by a stream of the given length. */
+static unsigned long stream_memory(unsigned long length)
+{
+  return (length / STREAM_BUFSIZE + 1) * sizeof(struct stream_buffer);
+}
+
+/* The memory budgeted for one tile before it is compressed.  The
+ * compressed data is assumed to be no larger than the 16-bit samples. */
+static unsigned long tile_memory(const struct dng* dng)
+{
+  return stream_memory(dng->tile_width * dng->tile_height * 2);
+}
+
+/* The tile size near the target that leaves the fewest leftover
+ * pixels, rounded up to an even number. */
+static uint32 fit_tile(uint32 size, uint32 target)
+{
+  uint32 tile;
+
+  if (size <= target)
+    tile = size;
+  else
+    tile = size / (size / target) + (size % target != 0);
+  return tile + (tile & 1);
+}
+
+static uint32 count_tiles(const struct dng* dng,
+			  uint32 tile_width,
+			  uint32 tile_height)
+{
+  return ((dng->mrw.width + tile_width - 1) / tile_width)
+    * ((dng->mrw.height + tile_height - 1) / tile_height);
+}
+
+unsigned mrwtodng_tiles(const struct mrwtodng_options* options,
+			unsigned width,
+			unsigned height,
+			unsigned* tile_width,
+			unsigned* tile_height)
+{
+  if (!options->compress)
+    return 0;
+  if (options->strips) {
+    if ((*tile_height = options->rows_per_strip) == 0)
+      *tile_height = fit_tile(height, 256);
+    *tile_width = width;
+  }
+  else if (!options->tile) {
+    *tile_width = width;
+    *tile_height = height;
+  }
+  else {
+    if ((*tile_width = options->tile_width) == 0)
+      *tile_width = fit_tile(width, 256);
+    if ((*tile_height = options->tile_height) == 0)
+      *tile_height = fit_tile(height, 256);
+  }
+  return ((width + *tile_width - 1) / *tile_width)
+    * ((height + *tile_height - 1) / *tile_height);
+}
+
+static void calc_tiles(struct dng* dng)
+{
+  dng->tile_count = mrwtodng_tiles(dng->opt, dng->mrw.width,
+				   dng->mrw.height, &dng->tile_width,
+				   &dng->tile_height);
+}
+
+/* The reduced-resolution copies use the default tile size for their
+ * dimensions. */
+static void calc_reduced(struct dng* dng)
+{
+  struct reduced* level;
+  unsigned i;
+
+  for (i = 0; i < dng->opt->reduced; ++i) {
+    level = &dng->reduced[i];
+    cfa_reduced_size(dng->mrw.width, dng->mrw.height, i + 1,
+		     &level->image.width, &level->image.height);
+    level->tile_width = fit_tile(level->image.width, 256);
+    level->tile_height = fit_tile(level->image.height, 256);
+    level->tile_count =
+      ((level->image.width + level->tile_width - 1) / level->tile_width)
+      * ((level->image.height + level->tile_height - 1) / level->tile_height);
+  }
+}
+
+static unsigned long reduced_tile_memory(const struct reduced* level)
+{
+  return stream_memory(level->tile_width * level->tile_height * 2);
+}
+
+/* Each copy and a worst case for each of its tiles. */
+static unsigned long reduced_memory(const struct dng* dng)
+{
+  const struct reduced* level;
+  unsigned long total;
+  unsigned i;
+
+  for (total = 0, i = 0; i < dng->opt->reduced; ++i) {
+    level = &dng->reduced[i];
+    total += level->image.width * level->image.height * 2
+      + level->tile_count * reduced_tile_memory(level);
+  }
+  return total;
+}
+
+/* The preview's RGB image and a worst case for its JPEG data, from the
+ * full image size since the crop is not known yet. */
+static unsigned long preview_memory(const struct dng* dng)
+{
+  const unsigned long rgb = (dng->mrw.width / 2) * (dng->mrw.height / 2) * 3;
+
+  return rgb + stream_memory(rgb);
+}
+
+/* Candidate tile sizes tried by auto_tile, and the number of tiles
+ * trial compressed for each one. */
+static const uint32 tile_targets[] = { 128, 192, 256, 384, 512, 768, 1024 };
+#define TILE_TARGETS (sizeof tile_targets / sizeof tile_targets[0])
+#define TILE_SAMPLES 8
+
+static int auto_tiling(const struct dng* dng)
+{
+  return dng->opt->compress && dng->opt->auto_tile
+    && (dng->opt->tile || dng->opt->strips);
+}
+
+static void candidate_tiles(const struct dng* dng,
+			    unsigned i,
+			    uint32* tile_width,
+			    uint32* tile_height)
+{
+  if (dng->opt->strips) {
+    *tile_width = dng->mrw.width;
+    *tile_height = fit_tile(dng->mrw.height, tile_targets[i]);
+  }
+  else {
+    if ((*tile_width = dng->opt->tile_width) == 0)
+      *tile_width = fit_tile(dng->mrw.width, tile_targets[i]);
+    if ((*tile_height = dng->opt->tile_height) == 0)
+      *tile_height = fit_tile(dng->mrw.height, tile_targets[i]);
+  }
+}
+
+/* A worst case for the compressed tiles.  With auto_tile, that is the
+ * most that any of the candidate sizes could need, since the size is
+ * only chosen once the memory has been reserved. */
+static unsigned long tiles_memory(const struct dng* dng)
+{
+  unsigned long most;
+  unsigned long memory;
+  uint32 tile_width;
+  uint32 tile_height;
+  unsigned i;
+
+  most = dng->tile_count * tile_memory(dng);
+  if (auto_tiling(dng))
+    for (i = 0; i < TILE_TARGETS; ++i) {
+      candidate_tiles(dng, i, &tile_width, &tile_height);
+      memory = count_tiles(dng, tile_width, tile_height)
+	* stream_memory(tile_width * tile_height * 2);
+      if (memory > most)
+	most = memory;
+    }
+  return most;
+}
+
+/* Estimate the peak memory a conversion will use from the image
+ * dimensions alone, before any of the raw data is loaded. */
+static unsigned long estimate_memory(const struct dng* dng)
+{
+  const unsigned long raw = dng->mrw.width * dng->mrw.height
+    * sizeof *dng->mrw.raw;
+  const unsigned long extras = (dng->opt->preview ? preview_memory(dng) : 0)
+    + reduced_memory(dng);
+
+  /* Packed output is written straight from the source, so the raw
+   * image is only unpacked to render the preview and reduced copies. */
+  if (!dng->opt->compress && dng->opt->packed)
+    return extras + ((dng->opt->preview || dng->opt->reduced) ? raw : 0);
+  return raw + tiles_memory(dng) + extras;
+}
+
+struct tile_job
+{
+  struct dng* dng;
+  uint32 tile;
+  uint32 x;
+  uint32 y;
+};
+
+static void compress_tile(void* arg)
+{
+  const struct tile_job* job = arg;
+  struct dng* dng = job->dng;
+  uint32 raw_size;
+  uint32 height;
+  unsigned long estimate;
+  unsigned long actual;
+
+  height = minu(dng->mrw.height - job->y, dng->tile_height);
+  /* Tiles are always padded out to the full tile size, but the last
+   * strip only contains the rows that remain. */
+  raw_size = compress_block(dng, &dng->compressed_data[job->tile],
+			    job->x,
+			    minu(dng->mrw.width - job->x, dng->tile_width),
+			    dng->tile_width,
+			    job->y,
+			    height,
+			    dng->opt->strips ? height : dng->tile_height);
+  uint32_pack_lsb(raw_size, dng->raw_length_tag->data + job->tile * 4);
+
+  estimate = tile_memory(dng);
+  actual = stream_memory(raw_size);
+  if (actual < estimate)
+    release(dng, estimate - actual);
+  else
+    charge(dng, actual - estimate);
+}
+
+/* A tile whose stream could not be started comes back empty. */
+static int compress_tiles(struct dng* dng)
+{
+  struct work_group group = { 0 };
+  struct tile_job* jobs;
+  uint32 x;
+  uint32 y;
+  uint32 tile;
+
+  if ((jobs = malloc(dng->tile_count * sizeof *jobs)) == 0)
+    return fail(dng->error, "Out of memory");
+  for (tile = 0, y = 0; y < dng->mrw.height; y += dng->tile_height) {
+    for (x = 0; x < dng->mrw.width; x += dng->tile_width, ++tile) {
+      jobs[tile].dng = dng;
+      jobs[tile].tile = tile;
+      jobs[tile].x = x;
+      jobs[tile].y = y;
+      work_submit(&group, compress_tile, &jobs[tile]);
+    }
+  }
+  work_wait(&group);
+  free(jobs);
+  for (tile = 0; tile < dng->tile_count; ++tile)
+    if (uint32_get_lsb(dng->raw_length_tag->data + tile * 4) == 0)
+      return fail(dng->error, "Out of memory");
+  return 1;
+}
+
+struct trial_job
+{
+  const struct dng* dng;
+  uint32 tile_width;
+  uint32 tile_height;
+  uint32 x;
+  uint32 y;
+  unsigned long bytes;
+};
+
+static void trial_tile(void* arg)
+{
+  struct trial_job* job = arg;
+  const struct dng* dng = job->dng;
+  uint32 width;
+  uint32 height;
+
+  width = minu(dng->mrw.width - job->x, job->tile_width);
+  height = minu(dng->mrw.height - job->y, job->tile_height);
+  job->bytes = jpeg_ls_estimate(dng->mrw.raw + job->x
+				+ job->y * dng->mrw.width,
+				height,
+				dng->opt->strips ? height : job->tile_height,
+				width / 2, job->tile_width / 2,
+				2,
+				12,
+				dng->mrw.width,
+				&dng->opt->encoder);
+}
+
+/* Pick the tile size with the smallest projected total by estimating
+ * the compressed size of a sample of tiles at each candidate size.
+ * All the samples for all the candidates are estimated in parallel. */
+static void choose_tiles(struct dng* dng)
+{
+  struct work_group group = { 0 };
+  struct trial_job jobs[TILE_TARGETS][TILE_SAMPLES];
+  uint32 counts[TILE_TARGETS];
+  uint32 samples[TILE_TARGETS];
+  uint32 tiles_across;
+  uint32 tile_width;
+  uint32 tile_height;
+  uint32 sample;
+  uint32 tile;
+  unsigned long total;
+  unsigned long best_total;
+  unsigned long reserved;
+  unsigned i;
+  int best;
+
+  for (i = 0; i < TILE_TARGETS; ++i) {
+    candidate_tiles(dng, i, &tile_width, &tile_height);
+    counts[i] = count_tiles(dng, tile_width, tile_height);
+    samples[i] = minu(counts[i], TILE_SAMPLES);
+    tiles_across = (dng->mrw.width + tile_width - 1) / tile_width;
+
+    /* Spread the samples evenly over the tiles, including the last
+     * (padded) one. */
+    for (sample = 0; sample < samples[i]; ++sample) {
+      tile = (samples[i] > 1)
+	? sample * (counts[i] - 1) / (samples[i] - 1)
+	: 0;
+      jobs[i][sample].dng = dng;
+      jobs[i][sample].tile_width = tile_width;
+      jobs[i][sample].tile_height = tile_height;
+      jobs[i][sample].x = tile % tiles_across * tile_width;
+      jobs[i][sample].y = tile / tiles_across * tile_height;
+      work_submit(&group, trial_tile, &jobs[i][sample]);
+    }
+  }
+  work_wait(&group);
+
+  /* If no candidate has enough tiles, settle for the one with the
+   * most. */
+  best = 0;
+  best_total = ~0UL;
+  for (i = 0; i < TILE_TARGETS; ++i) {
+    for (total = 0, sample = 0; sample < samples[i]; ++sample)
+      total += jobs[i][sample].bytes;
+    total = total * counts[i] / samples[i];
+    if (counts[i] < dng->opt->min_tiles)
+      total = ~0UL - counts[i];
+    if (total < best_total) {
+      best_total = total;
+      best = i;
+    }
+  }
+
+  /* The reservation covered every candidate, so this only ever gives
+   * memory back. */
+  reserved = tiles_memory(dng);
+  dng->tile_width = jobs[best][0].tile_width;
+  dng->tile_height = jobs[best][0].tile_height;
+  dng->tile_count = counts[best];
+  release(dng, reserved - dng->tile_count * tile_memory(dng));
+}
+
+/* The same as ColorMatrix2 in start_dng. */
+static const double d65_xyz_to_camera[9] = {
+  1.0239, -0.3104, -0.1099,
+  -0.8037, 1.5727, 0.2451,
+  -0.0927, 0.0925, 0.6871,
+};
+
+static void render_preview(void* arg)
+{
+  struct dng* dng = arg;
+  unsigned long used;
+
+  dng->preview_ok = preview_encode(&dng->preview, &dng->preview_data);
+  used = stream_memory(stream_length(&dng->preview_data));
+  if (used < preview_memory(dng))
+    release(dng, preview_memory(dng) - used);
+}
+
+/* Render the preview from the raw image in the background. */
+static void start_preview(struct dng* dng)
+{
+  dng->preview.raw = dng->mrw.raw;
+  dng->preview.row_width = dng->mrw.width;
+  dng->preview.white = 4095;
+  memcpy(dng->preview.xyz_to_camera, d65_xyz_to_camera,
+	 sizeof d65_xyz_to_camera);
+  dng->preview.quality = PREVIEW_QUALITY;
+  work_submit(&dng->preview_group, render_preview, dng);
+}
+
+static int finish_preview(struct dng* dng)
+{
+  work_wait(&dng->preview_group);
+  if (!dng->preview_ok)
+    return fail(dng->error, "Could not render the preview");
+  tiff_ifd_add_long(&dng->subifd2, StripByteCounts, 1,
+		    stream_length(&dng->preview_data));
+  return 1;
+}
+
+struct reduced_job
+{
+  struct dng* dng;
+  struct reduced* level;
+  uint32 tile;
+  uint32 x;
+  uint32 y;
+};
+
+static void compress_reduced_tile(void* arg)
+{
+  const struct reduced_job* job = arg;
+  struct dng* dng = job->dng;
+  struct reduced* level = job->level;
+  const struct cfa_image* image = &level->image;
+  unsigned long estimate;
+  unsigned long actual;
+  uint32 length;
+
+  length = encode_block(dng, &level->tiles[job->tile],
+			image->data + job->x + job->y * image->width,
+			image->width,
+			minu(image->width - job->x, level->tile_width),
+			level->tile_width,
+			minu(image->height - job->y, level->tile_height),
+			level->tile_height);
+  uint32_pack_lsb(length, level->length_tag->data + job->tile * 4);
+
+  estimate = reduced_tile_memory(level);
+  actual = stream_memory(length);
+  if (actual < estimate)
+    release(dng, estimate - actual);
+  else
+    charge(dng, actual - estimate);
+}
+
+static void reduced_ifd(struct reduced* level)
+{
+  struct tiff_ifd* ifd = &level->ifd;
+
+  tiff_ifd_add_long(ifd, NewSubfileType, 1, 1);
+  tiff_ifd_add_long(ifd, ImageWidth, 1, level->image.width);
+  tiff_ifd_add_long(ifd, ImageLength, 1, level->image.height);
+  tiff_ifd_add_short(ifd, PhotometricInterpretation, 1, 32803);
+  tiff_ifd_add_short(ifd, BitsPerSample, 1, 16);
+  tiff_ifd_add_short(ifd, PlanarConfiguration, 1, 1);
+  tiff_ifd_add_short(ifd, Compression, 1, 7);
+  tiff_ifd_add_short(ifd, SamplesPerPixel, 1, 1);
+  tiff_ifd_add_short(ifd, CFARepeatPattern, 2, 2, 2);
+  tiff_ifd_add_byte(ifd, CFAPattern, 4, "\0\1\1\2");
+  tiff_ifd_add_byte(ifd, CFAPlaneColor, 3, "\0\1\2");
+  tiff_ifd_add_short(ifd, CFALayout, 1, 1);
+  tiff_ifd_add_short(ifd, BlackLevelRepeatDim, 2, 1, 1);
+  tiff_ifd_add_rational(ifd, BlackLevel, 1, 0, 256);
+  tiff_ifd_add_short(ifd, WhiteLevel, 1, 4095);
+  tiff_ifd_add_long(ifd, TileWidth, 1, level->tile_width);
+  tiff_ifd_add_long(ifd, TileHeight, 1, level->tile_height);
+  level->offset_tag = tiff_ifd_add(ifd, TileOffsets, LONG, level->tile_count);
+  level->length_tag = tiff_ifd_add(ifd, TileByteCounts, LONG,
+				   level->tile_count);
+}
+
+/* Build all the reduced copies in one pass over the raw image, then
+ * queue their tiles to be compressed alongside the full image. */
+static int start_reduced(struct dng* dng)
+{
+  struct cfa_image full;
+  struct cfa_image images[MRWTODNG_MAX_REDUCED];
+  struct reduced* level;
+  struct reduced_job* job;
+  uint32 count;
+  uint32 tile;
+  uint32 x;
+  uint32 y;
+  unsigned i;
+
+  full.data = (uint16*)dng->mrw.raw;
+  full.width = dng->mrw.width;
+  full.height = dng->mrw.height;
+  if (!cfa_reduce(&full, images, dng->opt->reduced))
+    return fail(dng->error, "Out of memory");
+  for (i = 0; i < dng->opt->reduced; ++i)
+    dng->reduced[i].image = images[i];
+
+  for (count = 0, i = 0; i < dng->opt->reduced; ++i)
+    count += dng->reduced[i].tile_count;
+  if ((dng->reduced_jobs = malloc(count * sizeof *job)) == 0)
+    return fail(dng->error, "Out of memory");
+
+  for (job = dng->reduced_jobs, i = 0; i < dng->opt->reduced; ++i) {
+    level = &dng->reduced[i];
+    level->tiles = calloc(level->tile_count, sizeof *level->tiles);
+    if (level->tiles == 0)
+      return fail(dng->error, "Out of memory");
+    reduced_ifd(level);
+    for (tile = 0, y = 0; y < level->image.height; y += level->tile_height) {
+      for (x = 0; x < level->image.width; x += level->tile_width) {
+	job->dng = dng;
+	job->level = level;
+	job->tile = tile++;
+	job->x = x;
+	job->y = y;
+	work_submit(&dng->reduced_group, compress_reduced_tile, job++);
+      }
+    }
+  }
+  return 1;
+}
+
+/* Wait for the tiles of the reduced copies, which are empty if their
+ * streams could not be started, and free the images. */
+static int finish_reduced(struct dng* dng)
+{
+  struct reduced* level;
+  uint32 tile;
+  unsigned i;
+  int ok = 1;
+
+  work_wait(&dng->reduced_group);
+  free(dng->reduced_jobs);
+  dng->reduced_jobs = 0;
+  for (i = 0; i < dng->opt->reduced; ++i) {
+    level = &dng->reduced[i];
+    if (level->image.data == 0)
+      continue;
+    free(level->image.data);
+    level->image.data = 0;
+    release(dng, level->image.width * level->image.height * 2);
+    for (tile = 0; tile < level->tile_count; ++tile)
+      if (level->tiles == 0
+	  || uint32_get_lsb(level->length_tag->data + tile * 4) == 0)
+	ok = 0;
+  }
+  if (!ok)
+    return fail(dng->error, "Out of memory");
+  return 1;
+}
+
+/* The preview and the reduced copies are rendered in the background
+ * while the raw data is compressed, and must be waited for even if
+ * something fails. */
+static int parse_raw(struct dng* dng)
+{
+  unsigned long long raw_size;
+  int ok = 1;
+
+  if (dng->opt->compress) {
+    dng->compressed_data = calloc(dng->tile_count,
+				  sizeof *dng->compressed_data);
+    if (dng->compressed_data == 0)
+      return fail(dng->error, "Out of memory");
+
+    if (dng->opt->strips) {
+      dng->raw_offset_tag = tiff_ifd_add(&dng->subifd1, StripOffset,
+					 LONG, dng->tile_count);
+      tiff_ifd_add_long(&dng->subifd1, RowsPerStrip, 1, dng->tile_height);
+      dng->raw_length_tag = tiff_ifd_add(&dng->subifd1, StripByteCounts,
+					 LONG, dng->tile_count);
+    }
+    else if (dng->opt->tile) {
+      tiff_ifd_add_long(&dng->subifd1, TileWidth, 1, dng->tile_width);
+      tiff_ifd_add_long(&dng->subifd1, TileHeight, 1, dng->tile_height);
+      dng->raw_offset_tag = tiff_ifd_add(&dng->subifd1, TileOffsets,
+					 LONG, dng->tile_count);
+      dng->raw_length_tag = tiff_ifd_add(&dng->subifd1, TileByteCounts,
+					 LONG, dng->tile_count);
+    }
+    else {
+      dng->raw_offset_tag = tiff_ifd_add_long(&dng->subifd1, StripOffset,
+					      1, 0);
+      tiff_ifd_add_long(&dng->subifd1, RowsPerStrip, 1, dng->mrw.height);
+      dng->raw_length_tag = tiff_ifd_add_long(&dng->subifd1,
+					      StripByteCounts, 1, 0);
+    }
+    if (dng->opt->preview)
+      start_preview(dng);
+    if (dng->opt->reduced)
+      ok = start_reduced(dng);
+    ok = ok && compress_tiles(dng);
+    if (dng->opt->reduced)
+      ok = finish_reduced(dng) && ok;
+    if (dng->opt->preview)
+      ok = finish_preview(dng) && ok;
+  }
+  else {
+    raw_size = dng->opt->packed
+      ? mrw_raw_length(&dng->mrw)
+      : (unsigned long long)dng->mrw.width * dng->mrw.height * 2;
+    if (raw_size > 0xffffffffUL)
+      return fail(dng->error, "Raw image too large for a DNG file");
+
+    dng->tile_count = 1;
+    dng->raw_offset_tag = tiff_ifd_add_long(&dng->subifd1, StripOffset,
+					    1, 0);
+    tiff_ifd_add_long(&dng->subifd1, RowsPerStrip, 1, dng->mrw.height);
+    dng->raw_length_tag = tiff_ifd_add_long(&dng->subifd1, StripByteCounts,
+					    1, raw_size);
+
+    if (dng->opt->preview)
+      start_preview(dng);
+    if (dng->opt->reduced) {
+      ok = start_reduced(dng);
+      ok = finish_reduced(dng) && ok;
+    }
+    if (dng->opt->preview)
+      ok = finish_preview(dng) && ok;
+  }
+
+  /* Only the compressed or packed data is written, so the raw image
+   * can be released before the output is. */
+  if (dng->mrw.raw != 0 && (dng->opt->compress || dng->opt->packed)) {
+    mrw_free_raw(&dng->mrw);
+    release(dng, dng->mrw.width * dng->mrw.height * sizeof *dng->mrw.raw);
+  }
+  return ok;
+}
+
+static int parse_file(struct dng* dng)
+{
+  /* The data in the RIF block is duplicated by the EXIF data in the TTW
+   * block, which is copied in parse_ttw. */
+  if (!parse_prd(dng) || !parse_ttw(dng))
+    return 0;
+  parse_wbg(dng);
+  return parse_raw(dng);
+}
+
+static void write_thumbnail(const struct dng* dng, FILE* out)
+{
+  /* The embeded thumbnail appears to have a garbled JPEG SOI marker. */
+  fwrite("\xff\xd8", 1, 2, out);
+  fwrite(dng->thumbnail_start + 2, 1, dng->thumbnail_length - 2, out);
+}
+
+static void write_padding(FILE* out, uint32 count)
+{
+  static const char zeros[256];
+  uint32 n;
+
+  for (; count > 0; count -= n) {
+    n = minu(count, sizeof zeros);
+    fwrite(zeros, 1, n, out);
+  }
+}
+
+/* The stdio stream the output is written through passes each block on
+ * to the caller's writer. */
+static ssize_t output_write(void* cookie, const char* data, size_t length)
+{
+  struct dng* dng = cookie;
+
+  if (dng->write_failed
+      || !dng->write(dng->write_arg, (const unsigned char*)data, length)) {
+    dng->write_failed = 1;
+    return -1;
+  }
+  return length;
+}
+
+/* The packed raw data goes to the writer in one piece straight from
+ * the source, so that the writer can recognize it and copy it some
+ * other way. */
+static void write_packed(struct dng* dng, FILE* out)
+{
+  if (fflush(out) == 0)
+    output_write(dng, (const char*)dng->mrw.packed,
+		 mrw_raw_length(&dng->mrw));
+}
+
+static void write_reduced(const struct dng* dng, FILE* out)
+{
+  const struct reduced* level;
+  const struct stream_buffer* b;
+  uint32 tile;
+  uint32 offset;
+  uint32 pos;
+  unsigned i;
+
+  for (pos = dng->reduced_start, i = 0; i < dng->opt->reduced; ++i) {
+    level = &dng->reduced[i];
+    for (tile = 0; tile < level->tile_count; ++tile) {
+      offset = uint32_get_lsb(level->offset_tag->data + tile * 4);
+      write_padding(out, offset - pos);
+      pos = offset + uint32_get_lsb(level->length_tag->data + tile * 4);
+      for (b = level->tiles[tile].head; b != 0; b = b->next)
+	fwrite(b->data, 1, b->count, out);
+    }
+  }
+}
+
+static void write_image(struct dng* dng, FILE* out)
+{
+  const struct stream_buffer* b;
+  uint32 tile;
+  uint32 offset;
+  uint32 pos;
+  
+  for (pos = dng->image_start, tile = 0; tile < dng->tile_count; ++tile) {
+    offset = uint32_get_lsb(dng->raw_offset_tag->data + tile * 4);
+    write_padding(out, offset - pos);
+    pos = offset + uint32_get_lsb(dng->raw_length_tag->data + tile * 4);
+    if (dng->opt->compress) {
+      for (b = dng->compressed_data[tile].head; b != 0; b = b->next)
+	fwrite(b->data, 1, b->count, out);
+    }
+    else if (dng->opt->packed)
+      write_packed(dng, out);
+    else
+      fwrite(dng->mrw.raw, 2, dng->mrw.width * dng->mrw.height, out);
+  }
+}
+
+static int write_dng(struct dng* dng)
+{
+  static const cookie_io_functions_t functions = { 0, output_write, 0, 0 };
+  const struct stream_buffer* b;
+  FILE* out;
+  uint32 pos;
+  unsigned i;
+
+  if ((out = fopencookie(dng, "w", functions)) == 0)
+    return fail(dng->error, "Out of memory");
+  setvbuf(out, 0, _IOFBF, 65536);
+
+  /* Everything is written strictly in order, at the offsets end_dng
+   * laid out, so the output can be a pipe. */
+  tiff_start(out, 8);
+  pos = tiff_write_ifd(out, &dng->mainifd, 8);
+  pos = tiff_write_ifd(out, &dng->subifd1, pos);
+  if (dng->opt->preview)
+    pos = tiff_write_ifd(out, &dng->subifd2, pos);
+  for (i = 0; i < dng->opt->reduced; ++i)
+    pos = tiff_write_ifd(out, &dng->reduced[i].ifd, pos);
+  pos = tiff_write_ifd(out, &dng->exififd, pos);
+  if (dng->iop_offset_tag != 0)
+    pos = tiff_write_ifd(out, &dng->iopifd, pos);
+  if (pos != uint32_get_lsb(dng->thumbnail_offset_tag->data)) {
+    fclose(out);
+    return fail(dng->error, "Internal write error");
+  }
+  write_thumbnail(dng, out);
+  if (dng->opt->preview)
+    for (b = dng->preview_data.head; b != 0; b = b->next)
+      fwrite(b->data, 1, b->count, out);
+  write_reduced(dng, out);
+  write_image(dng, out);
+
+  if (fclose(out) != 0 || dng->write_failed)
+    return fail(dng->error, "Could not write the output");
+  return 1;
+}
+
+/* Everything the conversion still holds from the budget is returned
+ * here, whether it succeeded or not. */
+static void free_dng(struct dng* dng)
+{
+  struct reduced* level;
+  uint32 tile;
+  unsigned i;
+
+  if (dng->compressed_data != 0) {
+    for (tile = 0; tile < dng->tile_count; ++tile)
+      stream_free(&dng->compressed_data[tile]);
+    free(dng->compressed_data);
+  }
+  stream_free(&dng->preview_data);
+  for (i = 0; i < dng->opt->reduced; ++i) {
+    level = &dng->reduced[i];
+    if (level->tiles != 0) {
+      for (tile = 0; tile < level->tile_count; ++tile)
+	stream_free(&level->tiles[tile]);
+      free(level->tiles);
+    }
+    tiff_ifd_free(&level->ifd);
+  }
+
+  tiff_ifd_free(&dng->mainifd);
+  tiff_ifd_free(&dng->exififd);
+  tiff_ifd_free(&dng->subifd1);
+  tiff_ifd_free(&dng->iopifd);
+  tiff_ifd_free(&dng->subifd2);
+  mrw_free_raw(&dng->mrw);
+  release(dng, dng->held);
+  free(dng);
+}
+
+/* The option sets reported by mrwtodng_estimate.  Each tile size is
+ * estimated with the fixed first predictor and with the predictor
+ * search, and each of those gives the size with both Huffman table
+ * modes at once. */
+struct estimate_job
+{
+  const struct dng* dng;
+  uint32 tile_width;
+  uint32 tile_height;
+  uint32 x;
+  uint32 y;
+  unsigned long bytes[2][2];	/* [search][JPEG_LS_TABLES_*] */
+};
+
+static void estimate_tile(void* arg)
+{
+  struct estimate_job* job = arg;
+  const struct dng* dng = job->dng;
+  struct jpeg_ls_options options = dng->opt->encoder;
+  uint32 width;
+  uint32 height;
+  int search;
+
+  width = minu(dng->mrw.width - job->x, job->tile_width);
+  height = minu(dng->mrw.height - job->y, job->tile_height);
+  for (search = 0; search < 2; ++search) {
+    options.predictor = search ? 0 : 1;
+    jpeg_ls_estimate_tables(dng->mrw.raw + job->x
+			    + job->y * dng->mrw.width,
+			    height,
+			    dng->opt->strips ? height : job->tile_height,
+			    width / 2, job->tile_width / 2,
+			    2,
+			    12,
+			    dng->mrw.width,
+			    &options,
+			    job->bytes[search]);
+  }
+}
+
+/* The projected file size of raw data stored in the given pieces: the
+ * metadata, the offset and length tags and their arrays, and each piece
+ * padded to an even length and aligned. */
+static unsigned long projected_size(const struct dng* dng,
+				    unsigned tags,
+				    uint32 count,
+				    const unsigned long* bytes)
+{
+  unsigned long end;
+  uint32 i;
+
+  end = dng->image_start + tags * 12 + (count > 1 ? count * 8 : 0);
+  for (i = 0; i < count; ++i)
+    end = align_offset(dng, end) + ((bytes[i] + 1) & ~1UL);
+  return end;
+}
+
+static void add_estimate(struct mrwtodng_estimate* result,
+			 const char* layout,
+			 const char* predictor,
+			 const char* tables,
+			 unsigned long bytes)
+{
+  snprintf(result->layout, sizeof result->layout, "%s", layout);
+  result->predictor = predictor;
+  result->tables = tables;
+  result->bytes = bytes;
+}
+
+/* Report the projected output size for each option set instead of
+ * converting the file.  Only the counting passes of the encoder are run,
+ * for every tile of every candidate size, all in parallel. */
+static int estimate_dng(struct dng* dng,
+			struct mrwtodng_estimate** results,
+			unsigned* count)
+{
+  static const char* const table_names[3] = {
+    [JPEG_LS_TABLES_MULTI] = "multi",
+    [JPEG_LS_TABLES_SINGLE] = "single",
+    [JPEG_LS_TABLES_AUTO] = "auto",
+  };
+  struct work_group group = { 0 };
+  struct estimate_job* jobs;
+  struct mrwtodng_estimate* result;
+  uint32 widths[TILE_TARGETS + 1];
+  uint32 heights[TILE_TARGETS + 1];
+  uint32 counts[TILE_TARGETS + 1];
+  uint32 first[TILE_TARGETS + 2];
+  unsigned long* bytes;
+  unsigned long raw_bytes;
+  unsigned long multi;
+  unsigned long single;
+  uint32 tiles_across;
+  uint32 tile;
+  uint32 i;
+  unsigned layouts;
+  unsigned layout;
+  unsigned tags;
+  int search;
+  int tables;
+  int ok;
+  char name[32];
+
+  /* The configured tile size comes first, then the auto_tile
+   * candidates that differ from it. */
+  widths[0] = dng->tile_width;
+  heights[0] = dng->tile_height;
+  layouts = 1;
+  if (dng->opt->tile || dng->opt->strips) {
+    for (i = 0; i < TILE_TARGETS; ++i) {
+      candidate_tiles(dng, i, &widths[layouts], &heights[layouts]);
+      for (layout = 0; layout < layouts; ++layout)
+	if (widths[layout] == widths[layouts]
+	    && heights[layout] == heights[layouts])
+	  break;
+      if (layout == layouts)
+	++layouts;
+    }
+  }
+
+  for (first[0] = 0, layout = 0; layout < layouts; ++layout) {
+    counts[layout] = count_tiles(dng, widths[layout], heights[layout]);
+    first[layout + 1] = first[layout] + counts[layout];
+  }
+  *count = 2 + layouts * 2 * 3;
+  jobs = malloc(first[layouts] * sizeof *jobs);
+  bytes = malloc(first[layouts] * sizeof *bytes);
+  *results = malloc(*count * sizeof **results);
+  if (jobs == 0 || bytes == 0 || *results == 0) {
+    free(jobs);
+    free(bytes);
+    free(*results);
+    *results = 0;
+    return fail(dng->error, "Out of memory");
+  }
+  for (layout = 0; layout < layouts; ++layout) {
+    tiles_across = (dng->mrw.width + widths[layout] - 1) / widths[layout];
+    for (tile = 0; tile < counts[layout]; ++tile) {
+      i = first[layout] + tile;
+      jobs[i].dng = dng;
+      jobs[i].tile_width = widths[layout];
+      jobs[i].tile_height = heights[layout];
+      jobs[i].x = tile % tiles_across * widths[layout];
+      jobs[i].y = tile / tiles_across * heights[layout];
+      work_submit(&group, estimate_tile, &jobs[i]);
+    }
+  }
+
+  /* The metadata is the same for every option set, so lay it out once
+   * without any raw data while the tiles are being estimated. */
+  start_dng(dng);
+  ok = parse_prd(dng) && parse_ttw(dng);
+  if (ok) {
+    parse_wbg(dng);
+    tile = dng->tile_count;
+    dng->tile_count = 0;
+    end_dng(dng);
+    dng->tile_count = tile;
+  }
+  work_wait(&group);
+  if (!ok) {
+    free(bytes);
+    free(jobs);
+    free(*results);
+    *results = 0;
+    return 0;
+  }
+
+  result = *results;
+  raw_bytes = (unsigned long)dng->mrw.width * dng->mrw.height * 2;
+  add_estimate(result++, "uncompressed", "-", "-",
+	       projected_size(dng, 3, 1, &raw_bytes));
+  raw_bytes = mrw_raw_length(&dng->mrw);
+  add_estimate(result++, "packed", "-", "-",
+	       projected_size(dng, 3, 1, &raw_bytes));
+
+  for (layout = 0; layout < layouts; ++layout) {
+    if (dng->opt->strips) {
+      snprintf(name, sizeof name, "strips=%lu",
+	       (unsigned long)heights[layout]);
+      tags = 3;
+    }
+    else if (dng->opt->tile) {
+      snprintf(name, sizeof name, "tiles=%lux%lu",
+	       (unsigned long)widths[layout], (unsigned long)heights[layout]);
+      tags = 4;
+    }
+    else {
+      strcpy(name, "single");
+      tags = 3;
+    }
+    for (search = 0; search < 2; ++search)
+      for (tables = 0; tables < 3; ++tables) {
+	for (tile = 0; tile < counts[layout]; ++tile) {
+	  i = first[layout] + tile;
+	  multi = jobs[i].bytes[search][JPEG_LS_TABLES_MULTI];
+	  single = jobs[i].bytes[search][JPEG_LS_TABLES_SINGLE];
+	  /* The automatic choice is made per tile. */
+	  bytes[i] = (tables == JPEG_LS_TABLES_MULTI) ? multi
+	    : (tables == JPEG_LS_TABLES_SINGLE || single < multi) ? single
+	    : multi;
+	}
+	add_estimate(result++, name, search ? "search" : "1",
+		     table_names[tables],
+		     projected_size(dng, tags, counts[layout],
+				    bytes + first[layout]));
+      }
+  }
+
+  free(bytes);
+  free(jobs);
+  return 1;
+}
+
+/* Packed output is copied from the source as the file is written, so
+ * unless a preview or reduced copies are wanted only its digest is
+ * computed. */
+static int load_raw(struct dng* dng)
+{
+  const struct mrwtodng_options* opt = dng->opt;
+
+  if (opt->compress || !opt->packed || opt->preview || opt->reduced) {
+    if (!mrw_load_raw(&dng->mrw, dng->digest))
+      return fail(dng->error, "Out of memory");
+  }
+  else
+    mrw_digest_raw(&dng->mrw, dng->digest);
+  return 1;
+}
+
+static int check_options(const struct mrwtodng_options* opt, char* error)
+{
+  if (opt->reduced > MRWTODNG_MAX_REDUCED)
+    return fail(error, "At most %d reduced-resolution copies are supported",
+		MRWTODNG_MAX_REDUCED);
+  if (opt->rows_per_strip % 2 != 0)
+    return fail(error, "Rows per strip must be even");
+  if (opt->tile_width % 2 != 0)
+    return fail(error, "Tile width must be even");
+  if (opt->align == 0)
+    return fail(error, "Invalid alignment");
+  return 1;
+}
+
+/* Parse the header and lay out the tiles, which is all that is needed
+ * to know how much memory the conversion will use. */
+static struct dng* open_dng(const struct mrwtodng_options* options,
+			    const char* name,
+			    const unsigned char* mrw,
+			    unsigned long length,
+			    char* error)
+{
+  struct dng* dng;
+
+  if (!check_options(options, error))
+    return 0;
+  if ((dng = calloc(1, sizeof *dng)) == 0) {
+    fail(error, "Out of memory");
+    return 0;
+  }
+  dng->opt = options;
+  dng->source = name;
+  dng->error = error;
+  if (!mrw_parse(&dng->mrw, mrw, length,
+		 options->warning, options->warning_arg)) {
+    free(dng);
+    fail(error, "Invalid MRW data");
+    return 0;
+  }
+  calc_tiles(dng);
+  calc_reduced(dng);
+  dng->held = estimate_memory(dng);
+  return dng;
+}
+
+/*****************************************************************************/
+void mrwtodng_defaults(struct mrwtodng_options* options)
+{
+  memset(options, 0, sizeof *options);
+  options->compress = 1;
+  options->tile = 1;
+  options->encoder.predictor = 0;
+  options->encoder.tables = JPEG_LS_TABLES_AUTO;
+  options->encoder.layout = JPEG_LS_LAYOUT_FOLD;
+  options->align = 1;
+}
+
+int mrwtodng_effort(struct mrwtodng_options* options, const char* level)
+{
+  struct jpeg_ls_options* encoder = &options->encoder;
+
+  if (strcmp(level, "fast") == 0) {
+    /* One predictor, so only one counting pass before encoding. */
+    encoder->predictor = 1;
+    encoder->tables = JPEG_LS_TABLES_MULTI;
+    encoder->layout = JPEG_LS_LAYOUT_FOLD;
+  }
+  else if (strcmp(level, "normal") == 0) {
+    encoder->predictor = 0;
+    encoder->tables = JPEG_LS_TABLES_AUTO;
+    encoder->layout = JPEG_LS_LAYOUT_FOLD;
+  }
+  else if (strcmp(level, "max") == 0) {
+    encoder->predictor = 0;
+    encoder->tables = JPEG_LS_TABLES_AUTO;
+    encoder->layout = JPEG_LS_LAYOUT_AUTO;
+    options->auto_tile = 1;
+  }
+  else
+    return 0;
+  return 1;
+}
+
+int mrwtodng_layout(const char* name)
+{
+  if (strcmp(name, "fold") == 0)
+    return JPEG_LS_LAYOUT_FOLD;
+  if (strcmp(name, "plain") == 0)
+    return JPEG_LS_LAYOUT_PLAIN;
+  if (strcmp(name, "auto") == 0)
+    return JPEG_LS_LAYOUT_AUTO;
+  return -1;
+}
+
+const char* mrwtodng_dimension(struct mrwtodng_options* options,
+			       enum mrwtodng_dimension which,
+			       const char* value)
+{
+  unsigned long n = strtoul(value, 0, 10);
+
+  switch (which) {
+  case MRWTODNG_ROWS_PER_STRIP:
+    if ((options->rows_per_strip = n) < 2)
+      return "Invalid rows per strip: %s";
+    if (n % 2 != 0)
+      return "Rows per strip must be even: %s";
+    options->tile = 0;
+    options->strips = 1;
+    break;
+  case MRWTODNG_TILE_WIDTH:
+    if ((options->tile_width = n) < 16)
+      return "Invalid tile width: %s";
+    if (n % 2 != 0)
+      return "Tile width must be even: %s";
+    break;
+  case MRWTODNG_TILE_HEIGHT:
+    if ((options->tile_height = n) < 16)
+      return "Invalid tile height: %s";
+    break;
+  }
+  return 0;
+}
+
+unsigned long mrwtodng_header_length(const unsigned char* mrw)
+{
+  return 8 + (unsigned long)uint32_get_msb(mrw + 4);
+}
+
+unsigned long mrwtodng_memory(const struct mrwtodng_options* options,
+			      const unsigned char* mrw,
+			      unsigned long length)
+{
+  struct mrwtodng_options quiet = *options;
+  struct dng* dng;
+  unsigned long memory;
+
+  quiet.warning = 0;
+  if ((dng = open_dng(&quiet, "", mrw, length, 0)) == 0)
+    return 0;
+  memory = dng->held;
+  free(dng);
+  return memory;
+}
+
+int mrwtodng_convert(const struct mrwtodng_options* options,
+		     const char* name,
+		     const unsigned char* mrw,
+		     unsigned long length,
+		     mrwtodng_writer write,
+		     void* arg,
+		     char* error)
+{
+  struct dng* dng;
+  int ok;
+
+  if ((dng = open_dng(options, name, mrw, length, error)) == 0)
+    return 0;
+  dng->write = write;
+  dng->write_arg = arg;
+
+  if ((ok = load_raw(dng))) {
+    if (auto_tiling(dng))
+      choose_tiles(dng);
+    start_dng(dng);
+    if ((ok = parse_file(dng))) {
+      end_dng(dng);
+      ok = write_dng(dng);
+    }
+  }
+  free_dng(dng);
+  return ok;
+}
+
+struct buffer
+{
+  unsigned char* data;
+  unsigned long length;
+  unsigned long size;
+};
+
+static int buffer_write(void* arg,
+			const unsigned char* data,
+			unsigned long length)
+{
+  struct buffer* b = arg;
+  unsigned long size;
+  unsigned char* p;
+
+  if (length > b->size - b->length) {
+    for (size = b->size ? b->size : 65536; size - b->length < length; )
+      size *= 2;
+    if ((p = realloc(b->data, size)) == 0)
+      return 0;
+    b->data = p;
+    b->size = size;
+  }
+  memcpy(b->data + b->length, data, length);
+  b->length += length;
+  return 1;
+}
+
+int mrwtodng_convert_buffer(const struct mrwtodng_options* options,
+			    const char* name,
+			    const unsigned char* mrw,
+			    unsigned long length,
+			    unsigned char** dng,
+			    unsigned long* dng_length,
+			    char* error)
+{
+  struct buffer b = { 0, 0, 0 };
+
+  if (!mrwtodng_convert(options, name, mrw, length, buffer_write, &b,
+			error)) {
+    free(b.data);
+    return 0;
+  }
+  *dng = b.data;
+  *dng_length = b.length;
+  return 1;
+}
+
+int mrwtodng_estimate(const struct mrwtodng_options* options,
+		      const char* name,
+		      const unsigned char* mrw,
+		      unsigned long length,
+		      struct mrwtodng_estimate** results,
+		      unsigned* count,
+		      char* error)
+{
+  struct dng* dng;
+  int ok;
+
+  if (!options->compress || options->preview || options->reduced)
+    return fail(error, "Only compressed raw data can be estimated");
+  if ((dng = open_dng(options, name, mrw, length, error)) == 0)
+    return 0;
+
+  if ((ok = mrw_load_raw(&dng->mrw, 0))) {
+    if (auto_tiling(dng))
+      choose_tiles(dng);
+    ok = estimate_dng(dng, results, count);
+  }
+  else
+    fail(error, "Out of memory");
+  free_dng(dng);
+  return ok;
+}
+
+/* The raw image is compared with the source one row at a time, so only
+ * the decoded copy is held in full. */
+int mrwtodng_verify(const unsigned char* mrw,
+		    unsigned long mrw_length,
+		    const unsigned char* dng,
+		    unsigned long dng_length,
+		    char* error)
+{
+  struct mrw source;
+  struct dng_raw raw;
+  int ok;
+
+  if (!mrw_parse(&source, mrw, mrw_length, 0, 0))
+    return fail(error, "Invalid MRW data");
+  if (!dng_read_raw(dng, dng_length, &raw))
+    return fail(error, "Could not decode the raw image");
+  ok = raw.width == source.width
+    && raw.height == source.height
+    && mrw_compare_raw(&source, raw.data);
+  free(raw.data);
+  if (!ok)
+    return fail(error, "The raw image does not match the source");
+  return 1;
+}
+
+unsigned long mrwtodng_verify_memory(const unsigned char* mrw,
+				     unsigned long length)
+{
+  struct mrw source;
+
+  if (!mrw_parse(&source, mrw, length, 0, 0))
+    return 0;
+  return source.width * source.height * sizeof *source.raw;
+}
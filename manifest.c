@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "manifest.h"
+
+/* The manifest is a text file with one line per converted file, holding
+ * six tab-separated fields: the source name, its size, its modification
+ * time, the MD5 digest of its contents, the digest of the conversion
+ * options, and the destination name.  Lines are only ever appended,
+ * each as soon as its file is done, so an interrupted run loses
+ * nothing it finished.  A later line for the same source supersedes an
+ * earlier one, and a line cut short by a crash is ignored. */
+
+static const char header[] = "# mrwtodng manifest\n";
+
+static int hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+static int parse_hex(const char* s, unsigned char* out, unsigned length)
+{
+  unsigned i;
+  int hi;
+  int lo;
+
+  for (i = 0; i < length; ++i, s += 2) {
+    if ((hi = hex_digit(s[0])) < 0 || (lo = hex_digit(s[1])) < 0)
+      return 0;
+    out[i] = hi << 4 | lo;
+  }
+  return *s == 0;
+}
+
+static int parse_entry(char* line, struct manifest_entry* e)
+{
+  char* fields[6];
+  char* end;
+  unsigned i;
+
+  for (i = 0; i < 6; ++i) {
+    fields[i] = line;
+    if ((line = strchr(line, i < 5 ? '\t' : '\n')) == 0)
+      return 0;
+    *line++ = 0;
+  }
+  e->source = fields[0];
+  e->size = strtoul(fields[1], &end, 10);
+  if (*end != 0 || end == fields[1])
+    return 0;
+  e->mtime.tv_sec = strtol(fields[2], &end, 10);
+  if (*end != '.')
+    return 0;
+  e->mtime.tv_nsec = strtol(end + 1, &end, 10);
+  if (*end != 0)
+    return 0;
+  e->destination = fields[5];
+  return parse_hex(fields[3], e->hash, sizeof e->hash)
+    && parse_hex(fields[4], e->fingerprint, sizeof e->fingerprint);
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+  const struct manifest_entry* x = a;
+  const struct manifest_entry* y = b;
+  int diff;
+
+  if ((diff = strcmp(x->source, y->source)) != 0)
+    return diff;
+  return (x->line > y->line) - (x->line < y->line);
+}
+
+/* Keep only the last entry for each source. */
+static void sort_entries(struct manifest* m)
+{
+  unsigned long i;
+  unsigned long j;
+
+  qsort(m->entries, m->count, sizeof *m->entries, compare_entries);
+  for (i = j = 0; i < m->count; ++i) {
+    if (i + 1 < m->count
+	&& strcmp(m->entries[i].source, m->entries[i + 1].source) == 0)
+      free((char*)m->entries[i].source);
+    else
+      m->entries[j++] = m->entries[i];
+  }
+  m->count = j;
+}
+
+/* Load the manifest, creating it if it does not exist, and open it for
+ * new entries.  Returns 0 with errno set if it cannot be read or
+ * written. */
+int manifest_open(struct manifest* m, const char* path)
+{
+  struct manifest_entry* entries;
+  struct manifest_entry e;
+  unsigned long size;
+  unsigned long line;
+  char* buf;
+  size_t bufsize;
+  ssize_t len;
+  int newline;
+  int ok;
+
+  pthread_mutex_init(&m->lock, 0);
+  m->entries = 0;
+  m->count = 0;
+  if ((m->out = fopen(path, "a+")) == 0)
+    return 0;
+
+  ok = 1;
+  newline = 1;
+  size = 0;
+  for (line = 0, buf = 0, bufsize = 0;
+       (len = getline(&buf, &bufsize, m->out)) > 0;
+       ++line) {
+    newline = buf[len - 1] == '\n';
+    if (buf[0] == '#' || !parse_entry(buf, &e))
+      continue;
+    if (m->count == size) {
+      size = size ? size * 2 : 64;
+      if ((entries = realloc(m->entries, size * sizeof *entries)) == 0) {
+	ok = 0;
+	break;
+      }
+      m->entries = entries;
+    }
+    e.line = line;
+    m->entries[m->count++] = e;
+    /* The entry keeps the line it points into. */
+    buf = 0;
+    bufsize = 0;
+  }
+  free(buf);
+  if (!ok || ferror(m->out)) {
+    if (!ok)
+      errno = ENOMEM;
+    manifest_close(m);
+    return 0;
+  }
+  sort_entries(m);
+
+  fseek(m->out, 0, SEEK_END);
+  if (line == 0)
+    fputs(header, m->out);
+  else if (!newline)
+    fputc('\n', m->out);
+  return fflush(m->out) == 0;
+}
+
+const struct manifest_entry* manifest_find(const struct manifest* m,
+					   const char* source)
+{
+  unsigned long lo;
+  unsigned long hi;
+  unsigned long mid;
+  int diff;
+
+  for (lo = 0, hi = m->count; lo < hi; ) {
+    mid = (lo + hi) / 2;
+    if ((diff = strcmp(source, m->entries[mid].source)) == 0)
+      return &m->entries[mid];
+    if (diff < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return 0;
+}
+
+static void format_hex(char* out, const unsigned char* data, unsigned length)
+{
+  static const char digits[] = "0123456789abcdef";
+  unsigned i;
+
+  for (i = 0; i < length; ++i) {
+    *out++ = digits[data[i] >> 4];
+    *out++ = digits[data[i] & 15];
+  }
+  *out = 0;
+}
+
+/* Append an entry and flush it to the file at once.  Names that would
+ * break the format are not recorded, so those files are always
+ * converted. */
+int manifest_add(struct manifest* m, const struct manifest_entry* e)
+{
+  char hash[MD5_DIGEST_LENGTH * 2 + 1];
+  char fingerprint[MD5_DIGEST_LENGTH * 2 + 1];
+  int ok;
+
+  if (strpbrk(e->source, "\t\n") != 0 || strpbrk(e->destination, "\t\n") != 0
+      || e->source[0] == '#')
+    return 1;
+  format_hex(hash, e->hash, sizeof e->hash);
+  format_hex(fingerprint, e->fingerprint, sizeof e->fingerprint);
+  pthread_mutex_lock(&m->lock);
+  ok = fprintf(m->out, "%s\t%lu\t%ld.%09ld\t%s\t%s\t%s\n",
+	       e->source, e->size, (long)e->mtime.tv_sec,
+	       (long)e->mtime.tv_nsec, hash, fingerprint, e->destination) > 0
+    && fflush(m->out) == 0;
+  pthread_mutex_unlock(&m->lock);
+  return ok;
+}
+
+int manifest_close(struct manifest* m)
+{
+  unsigned long i;
+  int ok;
+
+  for (i = 0; i < m->count; ++i)
+    free((char*)m->entries[i].source);
+  free(m->entries);
+  ok = fclose(m->out) == 0;
+  pthread_mutex_destroy(&m->lock);
+  return ok;
+}
@@ -0,0 +1,38 @@
+#ifndef MANIFEST__H__
+#define MANIFEST__H__
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "md5.h"
+
+/* A record of the files converted by earlier runs, kept so that a batch
+ * can skip the sources whose outputs are already up to date. */
+
+struct manifest_entry
+{
+  const char* source;
+  const char* destination;
+  unsigned long size;
+  struct timespec mtime;
+  unsigned char hash[MD5_DIGEST_LENGTH];
+  unsigned char fingerprint[MD5_DIGEST_LENGTH];
+  unsigned long line;
+};
+
+struct manifest
+{
+  pthread_mutex_t lock;
+  FILE* out;
+  struct manifest_entry* entries;
+  unsigned long count;
+};
+
+extern int manifest_open(struct manifest* m, const char* path);
+extern const struct manifest_entry* manifest_find(const struct manifest* m,
+						  const char* source);
+extern int manifest_add(struct manifest* m, const struct manifest_entry* e);
+extern int manifest_close(struct manifest* m);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef MD5__H__
+#define MD5__H__
+
+#include "uint.h"
+
+#define MD5_DIGEST_LENGTH 16
+
+struct md5_ctx
+{
+  uint32 state[4];
+  uint32 bytes_lo;
+  uint32 bytes_hi;
+  unsigned char block[64];
+};
+
+extern void md5_init(struct md5_ctx* ctx);
+extern void md5_update(struct md5_ctx* ctx,
+		       const unsigned char* data,
+		       unsigned long length);
+extern void md5_final(struct md5_ctx* ctx,
+		      unsigned char digest[MD5_DIGEST_LENGTH]);
+
+#endif
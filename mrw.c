@@ -1,19 +1,43 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "die.h"
+#include "md5.h"
 #include "mrw.h"
 #include "uint.h"
 
-static int mrw_parse(struct mrw* mrw)
+/* Find the blocks of the header and check that the whole raw image is
+ * present.  Unknown blocks are passed to the warning function, if
+ * there is one. */
+int mrw_parse(struct mrw* mrw,
+	      const unsigned char* data,
+	      unsigned long length,
+	      void (*warning)(void* arg, const char* message),
+	      void* arg)
 {
   uint32 offset;
-  uint32 length;
+  uint32 block_length;
   struct mrw_block* block;
   const unsigned char* ptr;
-  
-  for (offset = 0; offset < mrw->header_length; offset += length + 8) {
+  char message[64];
+
+  memset(mrw, 0, sizeof *mrw);
+
+  if (length < 8 || memcmp(data, "\0MRM", 4) != 0)
+    return 0;
+  mrw->header_length = uint32_get_msb(data + 4);
+  if (mrw->header_length > length - 8)
+    return 0;
+  mrw->header = data + 8;
+
+  for (offset = 0;
+       offset < mrw->header_length;
+       offset += block_length + 8) {
     ptr = mrw->header + offset;
-    length = uint32_get_msb(ptr + 4);
+    if (mrw->header_length - offset < 8)
+      return 0;
+    block_length = uint32_get_msb(ptr + 4);
+    if (block_length > mrw->header_length - offset - 8)
+      return 0;
     if (memcmp(ptr, "\0PRD", 4) == 0)
       block = &mrw->prd;
     else if (memcmp(ptr, "\0TTW", 4) == 0)
@@ -25,78 +49,140 @@ static int mrw_parse(struct mrw* mrw)
     else if (memcmp(ptr, "\0PAD", 4) == 0)
       continue;
     else {
-      warn(0, "Unknown MRW block type: %c%c%c%c",
-	   ptr[0], ptr[1], ptr[2], ptr[3]);
+      if (warning != 0) {
+	snprintf(message, sizeof message, "Unknown MRW block type: %c%c%c%c",
+		 ptr[0], ptr[1], ptr[2], ptr[3]);
+	warning(arg, message);
+      }
       continue;
     }
 
     block->offset = offset;
-    block->length = length;
+    block->length = block_length;
     block->data = ptr + 8;
   }
 
-  if (mrw->prd.length == 0
-      || mrw->ttw.length == 0
-      || mrw->wbg.length == 0
+  /* The fixed parts of the blocks that are read directly. */
+  if (mrw->prd.length < 24
+      || mrw->ttw.length < 8
+      || mrw->wbg.length < 12
       || mrw->rif.length == 0)
     return 0;
   
   mrw->width = uint16_get_msb(mrw->prd.data + 10);
   mrw->height = uint16_get_msb(mrw->prd.data + 8);
+  if (mrw->width == 0 || mrw->width % 2 != 0 || mrw->height == 0
+      || mrw_raw_length(mrw) > length - mrw_raw_offset(mrw))
+    return 0;
+  mrw->packed = data + mrw_raw_offset(mrw);
 
   return 1;
 }
 
-static int mrw_load_header(struct mrw* mrw, FILE* in)
+/* Unpack one row of 12-bit samples.  If a digest is being computed,
+ * the samples are also fed to it as 16-bit little-endian values while
+ * they are still in registers. */
+static void unpack_row(const unsigned char* srcptr,
+		       uint16* dstptr,
+		       uint32 width,
+		       struct md5_ctx* md5)
 {
-  unsigned char header[8];
-  unsigned char* h;
-
-  memset(mrw, 0, sizeof *mrw);
-  
-  if (fread(header, 1, sizeof header, in) != sizeof header)
-    return 0;
-  if (memcmp(header, "\0MRM", 4) != 0)
-    return 0;
-  
-  mrw->header_length = uint32_get_msb(header + 4);
-  if ((h = malloc(mrw->header_length)) == 0)
-    return 0;
-  mrw->header = h;
+  unsigned char le[width * 2];
+  unsigned char* leptr;
+  uint32 x;
 
-  if (fread(h, 1, mrw->header_length, in) != mrw->header_length)
-    return 0;
-  
-  return mrw_parse(mrw);
+  if (md5 == 0) {
+    for (x = 0; x < width; x += 2, srcptr += 3, dstptr += 2) {
+      dstptr[0] = ((uint16)srcptr[0] << 4) | (srcptr[1] >> 4);
+      dstptr[1] = (((uint16)srcptr[1] << 8) | srcptr[2]) & 0xfff;
+    }
+    return;
+  }
+  for (x = 0, leptr = le; x < width; x += 2, srcptr += 3, leptr += 4) {
+    const uint16 a = ((uint16)srcptr[0] << 4) | (srcptr[1] >> 4);
+    const uint16 b = (((uint16)srcptr[1] << 8) | srcptr[2]) & 0xfff;
+    if (dstptr != 0) {
+      *dstptr++ = a;
+      *dstptr++ = b;
+    }
+    uint16_pack_lsb(a, leptr);
+    uint16_pack_lsb(b, leptr + 2);
+  }
+  md5_update(md5, le, sizeof le);
 }
 
-static int mrw_load_raw(struct mrw* mrw, FILE* in)
+/* The DNG RawImageDigest is the MD5 of all the samples in row order,
+ * each as a 16-bit little-endian value.  If digest is not null, it is
+ * computed as the data is unpacked. */
+int mrw_load_raw(struct mrw* mrw, unsigned char* digest)
 {
-  unsigned char row[mrw->width * 3 / 2];
-  unsigned char* srcptr;
+  const unsigned char* srcptr = mrw->packed;
+  const uint32 row = mrw->width * 3 / 2;
+  struct md5_ctx md5;
   uint16* dstptr;
-  uint32 x;
   uint32 y;
   
-  if ((dstptr = malloc(mrw->width * mrw->height * sizeof *mrw->raw)) == 0)
+  if ((dstptr = malloc((size_t)mrw->width * mrw->height
+		       * sizeof *mrw->raw)) == 0)
     return 0;
   mrw->raw = dstptr;
 
-  for (y = 0; y < mrw->height; ++y) {
-    if (fread(row, 1, sizeof row, in) != sizeof row)
+  if (digest != 0)
+    md5_init(&md5);
+  for (y = 0; y < mrw->height; ++y, srcptr += row, dstptr += mrw->width)
+    unpack_row(srcptr, dstptr, mrw->width, digest ? &md5 : 0);
+  if (digest != 0)
+    md5_final(&md5, digest);
+  return 1;
+}
+
+/* Compute the digest of the raw data without keeping it. */
+void mrw_digest_raw(const struct mrw* mrw, unsigned char* digest)
+{
+  const unsigned char* srcptr = mrw->packed;
+  const uint32 row = mrw->width * 3 / 2;
+  struct md5_ctx md5;
+  uint32 y;
+
+  md5_init(&md5);
+  for (y = 0; y < mrw->height; ++y, srcptr += row)
+    unpack_row(srcptr, 0, mrw->width, &md5);
+  md5_final(&md5, digest);
+}
+
+/* Compare an unpacked image with the raw data one row at a time, so
+ * that the raw data never needs to be unpacked in full. */
+int mrw_compare_raw(const struct mrw* mrw, const uint16* raw)
+{
+  const unsigned char* srcptr = mrw->packed;
+  const uint32 row = mrw->width * 3 / 2;
+  uint16 unpacked[mrw->width];
+  uint32 y;
+
+  for (y = 0; y < mrw->height; ++y, srcptr += row, raw += mrw->width) {
+    unpack_row(srcptr, unpacked, mrw->width, 0);
+    if (memcmp(unpacked, raw, sizeof unpacked) != 0)
       return 0;
-    for (x = 0, srcptr = row;
-	 x < mrw->width;
-	 x += 2, srcptr += 3, dstptr += 2) {
-      dstptr[0] = ((uint16)srcptr[0] << 4) | (srcptr[1] >> 4);
-      dstptr[1] = (((uint16)srcptr[1] << 8) | srcptr[2]) & 0xfff;
-    }
   }
   return 1;
 }
 
-int mrw_load(struct mrw* mrw, FILE* in)
+/* The packed raw data follows the header directly, 12 bits per sample
+ * with the most significant bits first. */
+uint32 mrw_raw_offset(const struct mrw* mrw)
+{
+  return 8 + mrw->header_length;
+}
+
+/* This is worked out in 64 bits, since the dimensions in a damaged
+ * header can make it overflow 32. */
+unsigned long long mrw_raw_length(const struct mrw* mrw)
+{
+  return (unsigned long long)mrw->width * 3 / 2 * mrw->height;
+}
+
+void mrw_free_raw(struct mrw* mrw)
 {
-  return mrw_load_header(mrw, in)
-    && mrw_load_raw(mrw, in);
+  free((uint16*)mrw->raw);
+  mrw->raw = 0;
 }
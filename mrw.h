@@ -1,7 +1,6 @@
 #ifndef MRW__H__
 #define MRW__H__
 
-#include <stdio.h>
 #include "uint.h"
 
 struct mrw_block
@@ -11,6 +10,8 @@ struct mrw_block
   const unsigned char* data;
 };
 
+/* An MRW file held in memory.  The header and the packed raw data
+ * point into the caller's buffer. */
 struct mrw
 {
   uint32 header_length;
@@ -23,9 +24,20 @@ struct mrw
 
   uint32 width;
   uint32 height;
+  const unsigned char* packed;
   const uint16* raw;
 };
 
-extern int mrw_load(struct mrw* mrw, FILE* in);
+extern int mrw_parse(struct mrw* mrw,
+		     const unsigned char* data,
+		     unsigned long length,
+		     void (*warning)(void* arg, const char* message),
+		     void* arg);
+extern int mrw_load_raw(struct mrw* mrw, unsigned char* digest);
+extern void mrw_digest_raw(const struct mrw* mrw, unsigned char* digest);
+extern int mrw_compare_raw(const struct mrw* mrw, const uint16* raw);
+extern uint32 mrw_raw_offset(const struct mrw* mrw);
+extern unsigned long long mrw_raw_length(const struct mrw* mrw);
+extern void mrw_free_raw(struct mrw* mrw);
 
 #endif
@@ -0,0 +1,622 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "die.h"
+#include "dng.h"
+#include "mrw.h"
+#include "tiff.h"
+#include "uint.h"
+#include "work.h"
+
+const char program[] = "mrwinfo";
+const char usage[] =
+"Usage: mrwinfo [options] FILE ...\n"
+"Print the metadata of MRW and DNG files, one line per file\n"
+"\n"
+"  -c, --csv              Print comma-separated values instead of JSON.\n"
+"  -l, --list=FILE        Also read the names of files from FILE.\n"
+"  -j, --jobs=UNS         The number of worker threads to run.\n";
+
+static int opt_csv = 0;
+static const char* opt_list = 0;
+static unsigned int opt_jobs = 0;
+
+/* The columns of the output.  Those that hold a tag are named after
+ * it. */
+enum column
+{
+  FILE_NAME,
+  TYPE,
+  FILE_SIZE,
+  MAKE,
+  MODEL,
+  WIDTH,
+  HEIGHT,
+  DATE,
+  EXPOSURE_TIME,
+  F_NUMBER,
+  ISO,
+  EXPOSURE_BIAS,
+  FOCAL_LENGTH,
+  NEUTRAL,
+  THUMBNAIL_OFFSET,
+  THUMBNAIL_LENGTH,
+  COMPRESSION,
+  BITS,
+  TILE_WIDTH,
+  TILE_HEIGHT,
+  ROWS_PER_STRIP,
+  TILES,
+  RAW_SIZE,
+  DNG_VERSION,
+  ORIGINAL_NAME,
+  DIGEST,
+  ERROR,
+  COLUMNS
+};
+
+static const struct
+{
+  const char* name;
+  enum tiff_tag_id tag;
+} columns[COLUMNS] = {
+  { "File", 0 },
+  { "Type", 0 },
+  { "FileSize", 0 },
+  { 0, Make },
+  { 0, Model },
+  { 0, ImageWidth },
+  { 0, ImageLength },
+  { 0, DateTimeOriginal },
+  { 0, ExposureTime },
+  { 0, FNumber },
+  { 0, ISOSpeedRatings },
+  { 0, ExposureBiasValue },
+  { 0, FocalLength },
+  { 0, AsShotNeutral },
+  { "ThumbnailOffset", 0 },
+  { "ThumbnailLength", 0 },
+  { 0, Compression },
+  { 0, BitsPerSample },
+  { 0, TileWidth },
+  { 0, TileHeight },
+  { 0, RowsPerStrip },
+  { "Tiles", 0 },
+  { "RawDataSize", 0 },
+  { 0, DNGVersion },
+  { 0, OriginalRawFileName },
+  { 0, RawImageDigest },
+  { "Error", 0 },
+};
+
+enum kind
+{
+  NONE,
+  NUMBER,
+  STRING,
+  /* Numbers separated by spaces. */
+  LIST
+};
+
+struct value
+{
+  enum kind kind;
+  char* text;
+};
+
+/* One file being indexed. */
+struct info
+{
+  const char* path;
+  int owned;
+  struct value values[COLUMNS];
+};
+
+/* Files are indexed in batches of this many, and each batch is printed
+ * in order once it is done. */
+#define BATCH 4096
+
+static struct info batch[BATCH];
+static unsigned batch_count;
+static int failed;
+
+static const char* column_name(enum column col)
+{
+  return columns[col].name != 0 ? columns[col].name
+    : tiff_tag_name(columns[col].tag);
+}
+
+static void set(struct info* info,
+		enum column col,
+		enum kind kind,
+		const char* format, ...)
+{
+  struct value* v = &info->values[col];
+  va_list ap;
+  char* text;
+  int ok;
+
+  va_start(ap, format);
+  ok = vasprintf(&text, format, ap) >= 0;
+  va_end(ap);
+  if (ok) {
+    free(v->text);
+    v->kind = kind;
+    v->text = text;
+  }
+}
+
+static void fail(struct info* info, int sys, const char* message)
+{
+  if (sys)
+    set(info, ERROR, STRING, "%s: %s", message, strerror(errno));
+  else
+    set(info, ERROR, STRING, "%s", message);
+}
+
+/* Copy a tag into a column: text as a string, a single number as a
+ * number, and several as a list. */
+static void copy_tag(struct info* info,
+		     enum column col,
+		     const unsigned char* data,
+		     uint32 length,
+		     uint32 ifd)
+{
+  struct tiff_entry entry;
+  char list[256];
+  size_t used;
+  uint32 i;
+
+  if (!tiff_read_tag(data, length, ifd, columns[col].tag, &entry)
+      || entry.count == 0)
+    return;
+  switch (entry.type) {
+  case ASCII:
+    for (i = strnlen((const char*)entry.data, entry.count);
+	 i > 0 && entry.data[i - 1] == ' ';
+	 --i)
+      ;
+    set(info, col, STRING, "%.*s", (int)i, entry.data);
+    return;
+  case UNDEFINED:
+  case FLOAT:
+  case DOUBLE:
+    return;
+  default:
+    ;
+  }
+  if (entry.count == 1) {
+    set(info, col, NUMBER, "%.6g", tiff_entry_real(&entry, 0));
+    return;
+  }
+  for (used = 0, i = 0; i < entry.count && used < sizeof list; ++i)
+    used += snprintf(list + used, sizeof list - used, i ? " %.6g" : "%.6g",
+		     tiff_entry_real(&entry, i));
+  if (used < sizeof list)
+    set(info, col, LIST, "%s", list);
+}
+
+static void read_exif(struct info* info,
+		      const unsigned char* data,
+		      uint32 length,
+		      uint32 ifd)
+{
+  copy_tag(info, DATE, data, length, ifd);
+  copy_tag(info, EXPOSURE_TIME, data, length, ifd);
+  copy_tag(info, F_NUMBER, data, length, ifd);
+  copy_tag(info, ISO, data, length, ifd);
+  copy_tag(info, EXPOSURE_BIAS, data, length, ifd);
+  copy_tag(info, FOCAL_LENGTH, data, length, ifd);
+}
+
+/* The gain for one channel in the WBG block, whose first four bytes
+ * are the scale of each. */
+static double wbg_gain(const unsigned char* wbg, unsigned channel)
+{
+  return uint16_get_msb(wbg + 4 + channel * 2) / ldexp(64, wbg[channel]);
+}
+
+/* Everything comes from the MRW header blocks.  The TTW block is a
+ * big-endian TIFF file holding the EXIF data, with the thumbnail
+ * located by the maker note, and the white balance is the inverse of
+ * the WBG block's gains, as mrwtodng writes it. */
+static void read_mrw(struct info* info,
+		     const unsigned char* data,
+		     unsigned long length)
+{
+  struct mrw mrw;
+  struct tiff_entry entry;
+  const unsigned char* ttw;
+  const unsigned char* wbg;
+  uint32 ttw_length;
+  uint32 exif;
+  uint32 note;
+  uint32 offset;
+  double r;
+  double g;
+  double b;
+
+  set(info, TYPE, STRING, "mrw");
+  if (!mrw_parse(&mrw, data, length, 0, 0)) {
+    fail(info, 0, "Invalid or truncated MRW file");
+    return;
+  }
+  set(info, WIDTH, NUMBER, "%u", mrw.width);
+  set(info, HEIGHT, NUMBER, "%u", mrw.height);
+  set(info, BITS, NUMBER, "%u", mrw.prd.data[16]);
+  set(info, RAW_SIZE, NUMBER, "%llu", mrw_raw_length(&mrw));
+
+  wbg = mrw.wbg.data;
+  r = wbg_gain(wbg, 0);
+  g = (wbg_gain(wbg, 1) + wbg_gain(wbg, 2)) / 2.0;
+  b = wbg_gain(wbg, 3);
+  if (r > 0 && g > 0 && b > 0)
+    set(info, NEUTRAL, LIST, "%.6g %.6g %.6g", 1 / r, 1 / g, 1 / b);
+
+  ttw = mrw.ttw.data;
+  ttw_length = mrw.ttw.length;
+  if (memcmp(ttw, "MM\0\052\0\0\0\010", 8) != 0)
+    return;
+  copy_tag(info, MAKE, ttw, ttw_length, 8);
+  copy_tag(info, MODEL, ttw, ttw_length, 8);
+  if ((exif = tiff_read_value(ttw, ttw_length, 8, ExifIFD, 0)) == 0)
+    return;
+  read_exif(info, ttw, ttw_length, exif);
+  if (tiff_read_tag(ttw, ttw_length, exif, MakerNote, &entry)) {
+    note = entry.data - ttw;
+    offset = tiff_read_value(ttw, ttw_length, note, MLTThumbnailOffset, 0);
+    if (offset != 0) {
+      set(info, THUMBNAIL_OFFSET, NUMBER, "%lu",
+	  (unsigned long)(ttw - data) + offset);
+      set(info, THUMBNAIL_LENGTH, NUMBER, "%u",
+	  tiff_read_value(ttw, ttw_length, note, MLTThumbnailLength, 0));
+    }
+  }
+}
+
+/* Only the IFDs and the tag data they point to are read.  The main IFD
+ * holds the thumbnail, and the raw IFD the layout of the image data. */
+static void read_dng(struct info* info,
+		     const unsigned char* data,
+		     uint32 length)
+{
+  struct tiff_entry entry;
+  struct tiff_entry counts;
+  unsigned long size;
+  uint32 ifd;
+  uint32 raw;
+  uint32 exif;
+  uint32 i;
+
+  ifd = tiff_read_header(data, length);
+  if (!tiff_read_tag(data, length, ifd, DNGVersion, &entry)
+      || entry.type != BYTE || entry.count != 4) {
+    fail(info, 0, "Not a DNG file");
+    return;
+  }
+  set(info, TYPE, STRING, "dng");
+  set(info, DNG_VERSION, STRING, "%u.%u.%u.%u",
+      entry.data[0], entry.data[1], entry.data[2], entry.data[3]);
+  copy_tag(info, MAKE, data, length, ifd);
+  copy_tag(info, MODEL, data, length, ifd);
+  copy_tag(info, NEUTRAL, data, length, ifd);
+  copy_tag(info, ORIGINAL_NAME, data, length, ifd);
+  if (tiff_read_tag(data, length, ifd, RawImageDigest, &entry)
+      && entry.count == 16)
+    set(info, DIGEST, STRING,
+	"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
+	entry.data[0], entry.data[1], entry.data[2], entry.data[3],
+	entry.data[4], entry.data[5], entry.data[6], entry.data[7],
+	entry.data[8], entry.data[9], entry.data[10], entry.data[11],
+	entry.data[12], entry.data[13], entry.data[14], entry.data[15]);
+  if ((exif = tiff_read_value(data, length, ifd, ExifIFD, 0)) != 0)
+    read_exif(info, data, length, exif);
+  if (tiff_read_value(data, length, ifd, NewSubfileType, 0) == 1
+      && tiff_read_tag(data, length, ifd, StripOffset, &entry)
+      && tiff_read_tag(data, length, ifd, StripByteCounts, &counts)) {
+    set(info, THUMBNAIL_OFFSET, NUMBER, "%u", tiff_entry_value(&entry, 0));
+    set(info, THUMBNAIL_LENGTH, NUMBER, "%u", tiff_entry_value(&counts, 0));
+  }
+
+  if ((raw = dng_raw_ifd(data, length)) == 0) {
+    fail(info, 0, "No raw image in DNG file");
+    return;
+  }
+  copy_tag(info, WIDTH, data, length, raw);
+  copy_tag(info, HEIGHT, data, length, raw);
+  copy_tag(info, COMPRESSION, data, length, raw);
+  copy_tag(info, BITS, data, length, raw);
+  if (tiff_read_tag(data, length, raw, TileOffsets, &entry)) {
+    copy_tag(info, TILE_WIDTH, data, length, raw);
+    copy_tag(info, TILE_HEIGHT, data, length, raw);
+    if (!tiff_read_tag(data, length, raw, TileByteCounts, &counts))
+      return;
+  }
+  else {
+    copy_tag(info, ROWS_PER_STRIP, data, length, raw);
+    if (!tiff_read_tag(data, length, raw, StripOffset, &entry)
+	|| !tiff_read_tag(data, length, raw, StripByteCounts, &counts))
+      return;
+  }
+  set(info, TILES, NUMBER, "%u", entry.count);
+  for (size = 0, i = 0; i < counts.count; ++i)
+    size += tiff_entry_value(&counts, i);
+  set(info, RAW_SIZE, NUMBER, "%lu", size);
+}
+
+/* The file is mapped with read-ahead turned off, so that only the pages
+ * holding the metadata are ever read from the disk. */
+static void index_file(void* arg)
+{
+  struct info* info = arg;
+  struct stat st;
+  void* map;
+  int fd;
+
+  if ((fd = open(info->path, O_RDONLY)) < 0) {
+    fail(info, 1, "Could not open file");
+    return;
+  }
+  if (fstat(fd, &st) != 0) {
+    fail(info, 1, "Could not read file");
+    close(fd);
+    return;
+  }
+  set(info, FILE_SIZE, NUMBER, "%lu", (unsigned long)st.st_size);
+  if (!S_ISREG(st.st_mode) || st.st_size < 8) {
+    fail(info, 0, "Not an MRW or DNG file");
+    close(fd);
+    return;
+  }
+  if (st.st_size > 0xffffffffL) {
+    fail(info, 0, "File too large");
+    close(fd);
+    return;
+  }
+  map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fail(info, 1, "Could not read file");
+    return;
+  }
+  madvise(map, st.st_size, MADV_RANDOM);
+
+  if (memcmp(map, "\0MRM", 4) == 0)
+    read_mrw(info, map, st.st_size);
+  else if (tiff_read_header(map, st.st_size) != 0)
+    read_dng(info, map, st.st_size);
+  else
+    fail(info, 0, "Not an MRW or DNG file");
+  munmap(map, st.st_size);
+}
+
+/* The length of the UTF-8 sequence starting at s, or 0 if it is not
+ * valid. */
+static unsigned utf8_length(const unsigned char* s)
+{
+  unsigned length;
+  unsigned i;
+
+  if (*s < 0x80)
+    return 1;
+  if (*s >= 0xc2 && *s < 0xe0)
+    length = 2;
+  else if (*s >= 0xe0 && *s < 0xf0)
+    length = 3;
+  else if (*s >= 0xf0 && *s < 0xf5)
+    length = 4;
+  else
+    return 0;
+  for (i = 1; i < length; ++i)
+    if ((s[i] & 0xc0) != 0x80)
+      return 0;
+  return length;
+}
+
+/* Bytes that are not valid UTF-8, which names and damaged tags may
+ * hold, are written as the Latin-1 characters of the same value. */
+static void put_json_string(const char* s)
+{
+  const unsigned char* p;
+  unsigned length;
+
+  putchar('"');
+  for (p = (const unsigned char*)s; *p != 0; p += length) {
+    length = utf8_length(p);
+    if (*p == '"' || *p == '\\')
+      printf("\\%c", *p);
+    else if (*p < 0x20 || length == 0) {
+      printf("\\u%04x", *p);
+      length = 1;
+    }
+    else
+      fwrite(p, 1, length, stdout);
+  }
+  putchar('"');
+}
+
+static void put_csv_string(const char* s)
+{
+  if (strpbrk(s, ",\"\r\n") == 0) {
+    fputs(s, stdout);
+    return;
+  }
+  putchar('"');
+  for (; *s != 0; ++s) {
+    if (*s == '"')
+      putchar('"');
+    putchar(*s);
+  }
+  putchar('"');
+}
+
+/* JSON rows leave out the columns with no value, and lists become
+ * arrays. */
+static void print_json(const struct info* info)
+{
+  const struct value* v;
+  const char* p;
+  unsigned col;
+
+  printf("{\"%s\":", column_name(FILE_NAME));
+  put_json_string(info->path);
+  for (col = FILE_NAME + 1; col < COLUMNS; ++col) {
+    v = &info->values[col];
+    if (v->kind == NONE)
+      continue;
+    printf(",\"%s\":", column_name(col));
+    switch (v->kind) {
+    case STRING:
+      put_json_string(v->text);
+      break;
+    case LIST:
+      putchar('[');
+      for (p = v->text; *p != 0; ++p)
+	putchar(*p == ' ' ? ',' : *p);
+      putchar(']');
+      break;
+    default:
+      fputs(v->text, stdout);
+    }
+  }
+  puts("}");
+}
+
+static void print_csv(const struct info* info)
+{
+  unsigned col;
+
+  put_csv_string(info->path);
+  for (col = FILE_NAME + 1; col < COLUMNS; ++col) {
+    putchar(',');
+    if (info->values[col].kind != NONE)
+      put_csv_string(info->values[col].text);
+  }
+  putchar('\n');
+}
+
+static void flush_batch(void)
+{
+  struct work_group group = { 0 };
+  struct info* info;
+  unsigned i;
+  unsigned col;
+
+  for (i = 0; i < batch_count; ++i)
+    work_submit(&group, index_file, &batch[i]);
+  work_wait(&group);
+
+  for (i = 0; i < batch_count; ++i) {
+    info = &batch[i];
+    if (info->values[ERROR].kind != NONE)
+      failed = 1;
+    if (opt_csv)
+      print_csv(info);
+    else
+      print_json(info);
+    for (col = 0; col < COLUMNS; ++col)
+      free(info->values[col].text);
+    if (info->owned)
+      free((char*)info->path);
+    memset(info, 0, sizeof *info);
+  }
+  batch_count = 0;
+  if (fflush(stdout) != 0)
+    die(-1, "Could not write output");
+}
+
+static void add_file(const char* path, int owned)
+{
+  batch[batch_count].path = path;
+  batch[batch_count].owned = owned;
+  if (++batch_count == BATCH)
+    flush_batch();
+}
+
+/* Names are read one per line, so that they can come from find. */
+static void read_list(const char* path)
+{
+  FILE* in;
+  char* line;
+  size_t size;
+  ssize_t len;
+
+  if (strcmp(path, "-") == 0)
+    in = stdin;
+  else if ((in = fopen(path, "r")) == 0)
+    die(-1, "Could not open '%s'", path);
+  for (line = 0, size = 0; (len = getline(&line, &size, in)) > 0; ) {
+    if (line[len - 1] == '\n')
+      line[--len] = 0;
+    if (len == 0)
+      continue;
+    add_file(line, 1);
+    line = 0;
+    size = 0;
+  }
+  free(line);
+  if (ferror(in))
+    die(-1, "Could not read '%s'", path);
+  if (in != stdin)
+    fclose(in);
+}
+
+static const struct option long_options[] = {
+  { "csv", no_argument, 0, 'c' },
+  { "list", required_argument, 0, 'l' },
+  { "jobs", required_argument, 0, 'j' },
+  { 0, 0, 0, 0 }
+};
+
+int main(int argc, char* argv[])
+{
+  unsigned col;
+  int ch;
+  int i;
+
+  while ((ch = getopt_long(argc, argv, "cl:j:", long_options, 0)) != -1) {
+    switch (ch) {
+    case 'c': opt_csv = 1; break;
+    case 'l': opt_list = optarg; break;
+    case 'j':
+      if ((opt_jobs = strtoul(optarg, 0, 10)) == 0)
+	die(1, "Invalid number of jobs: %s", optarg);
+      break;
+    default:
+      die_usage();
+    }
+  }
+
+  if (argc - optind < 1 && opt_list == 0)
+    die_usage();
+
+  if (opt_jobs == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opt_jobs = (cpus > 0) ? cpus : 1;
+  }
+  if (!work_start(opt_jobs, 0))
+    die(1, "Could not start worker thread");
+
+  if (opt_csv) {
+    for (col = 0; col < COLUMNS; ++col)
+      printf(col ? ",%s" : "%s", column_name(col));
+    putchar('\n');
+  }
+  for (i = optind; i < argc; ++i)
+    add_file(argv[i], 0);
+  if (opt_list != 0)
+    read_list(opt_list);
+  flush_batch();
+
+  return failed;
+}
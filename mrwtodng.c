@@ -1,689 +1,1161 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "aio.h"
+#include "budget.h"
 #include "die.h"
-#include "jpeg-ls.h"
-#include "tiff.h"
-#include "mrw.h"
-#include "stream.h"
-#include "uint.h"
+#include "manifest.h"
+#include "md5.h"
+#include "mrwtodng.h"
+#include "work.h"
 
 const char program[] = "mrwtodng";
 const char usage[] =
 "Usage: mrwtodng [options] SOURCE.mrw DESTINATION.dng\n"
+"   or: mrwtodng [options] -o DIRECTORY SOURCE.mrw ...\n"
+"   or: mrwtodng [options] --estimate SOURCE.mrw ...\n"
+"   or: mrwtodng [options] --serve SOCKET\n"
+"   or: mrwtodng [options] -o DIRECTORY --watch DIRECTORY [SOURCE.mrw ...]\n"
 "Convert Minolta raw (MRW) files to digital negatives (DNG)\n"
+"A SOURCE or DESTINATION of - means standard input or output.\n"
 "\n"
 "  -c, --compress         Compress the raw image data (default).\n"
 "  -C, --no-compress      Do not compress the raw image data.\n"
+"  -p, --packed           Copy the raw data uncompressed in its packed form.\n"
+"  -P, --preview          Add a half-size JPEG preview of the raw image.\n"
+"  -R, --reduced=UNS      Add UNS reduced-resolution copies of the raw image.\n"
 "  -t, --tile             Break compressed data into tiles.\n"
 "  -T, --no-tile          Compress the entire data as one block.\n"
+"  -s, --strips           Compress the data as multiple strips.\n"
+"  -r, --rows-per-strip=UNS  The maximum height of all the strips.\n"
 "  -h, --tile-height=UNS  The maximum height of all the tiles.\n"
-"  -w, --tile-width=UNS   The maximum width of all the tiles.\n";
-
-static int opt_compress = 1;
-static int opt_tile = 1;
-static unsigned int opt_tile_height = 0;
-static unsigned int opt_tile_width = 0;
-
-#define PREVIEW 0
-
-static struct tiff_ifd mainifd;
-static struct tiff_ifd exififd;
-static struct tiff_ifd subifd1;
-static struct tiff_ifd iopifd;
-#if PREVIEW
-static struct tiff_ifd subifd2;
-#endif
-
-static struct mrw mrw;
-
-static uint32 tile_count;
-static struct stream* compressed_data;
-static struct tiff_tag* raw_offset_tag;
-static struct tiff_tag* raw_length_tag;
-static struct tiff_tag* iop_offset_tag;
-
-static const unsigned char* thumbnail_start;
-static uint32 thumbnail_length;
-static const struct tiff_tag* thumbnail_offset_tag;
-
-static void parse_ifd(const unsigned char* start,
-		      uint32 offset,
-		      void (*fn)(const unsigned char* start,
-				 enum tiff_tag_id tag,
-				 enum tiff_tag_type type,
-				 uint32 count,
-				 uint32 value));
-
-static void parse_prd(void)
-{
-  uint32 x;
-  uint32 y;
-  const unsigned char* data = mrw.prd.data;
-  
-  if (memcmp(data, "21810002", 8) == 0) {
-    tiff_ifd_add_ascii(&mainifd, UniqueCameraModel,
-		       "Konica Minolta Maxxum 7D");
-    tiff_ifd_add_ascii(&mainifd, LocalizedCameraModel,
-		       "Konica Minolta Maxxum 7D");
-  }
-  else
-    die(1, "Unknown camera model");
-
-  tiff_ifd_add_long(&subifd1, ImageWidth, 1, mrw.width);
-  tiff_ifd_add_long(&subifd1, ImageLength, 1, mrw.height);
-  tiff_ifd_add_long(&subifd1, ActiveArea, 4, 0, 0, mrw.height, mrw.width);
-  
-  y = uint16_get_msb(data + 12);
-  x = uint16_get_msb(data + 14);
-  tiff_ifd_add_rational(&subifd1, DefaultScale, 2, 1, 1, 1, 1);
-  tiff_ifd_add_rational(&subifd1, DefaultCropOrigin, 2,
-			(mrw.width - x) / 2, 1, (mrw.height - y) / 2, 1);
-  tiff_ifd_add_rational(&subifd1, DefaultCropSize, 2, x, 1, y, 1);
-
-  if (data[16] != 12)
-    die(1, "Invalid DataSize number");
-  if (data[17] != 12)
-    die(1, "Invalid PixelSize number");
-  if (data[18] != 0x59)
-    die(1, "Invalid StorageMethod number");
-
-  if (uint16_get_msb(data + 22) != 1)
-    die(1, "Invalid BayerPattern number");
-  tiff_ifd_add_short(&subifd1, CFARepeatPattern, 2, 2, 2);
-  tiff_ifd_add_byte(&subifd1, CFAPattern, 4, "\0\1\1\2");
-  tiff_ifd_add_byte(&subifd1, CFAPlaneColor, 3, "\0\1\2");
-  tiff_ifd_add_short(&subifd1, CFALayout, 1, 1);
-}
-
-static void parse_ttw_makernote(const unsigned char* start,
-				enum tiff_tag_id tag,
-				enum tiff_tag_type type,
-				uint32 count,
-				uint32 value)
-{
-  switch (tag) {
-  case MLTThumbnailOffset:
-    thumbnail_start = start + value;
-    break;
-  case MLTThumbnailLength:
-    thumbnail_length = value;
-    break;
-  default:
-    ;
-  }
-  (void)type;
-  (void)count;
-}
-
-/* DNGPrivateData is to contain:
-
-1) Six bytes containing the zero-terminated string "Adobe" (the DNG spec
-calls for the DNGPrivateData tag to start with an ASCII string
-identifying the creator/format).
-
-2) An ASCII string ("MakN" for a Makernote), presumably indicating what
-sort of data is being stored here. Note that this is not
-zero-terminated.
-
-3) A four-byte count (number of data bytes following); for a simple
-MakerNote copy this the length of the original MakerNote data, plus six
-additional bytes to store the next two data items.
-
-4) The byte-order indicator from the original file (the usual 'MM'/4D4D
-or 'II'/4949).
-
-5) The original file offset for the MakerNote tag data (stored according
-to the byte order given above).
-
-6) The contents of the MakerNote tag. This appears to be a simple
-byte-for-byte copy, with no modification.
-*/
-
-static void add_makernote(const unsigned char* start,
-			  uint32 offset,
-			  uint32 length)
-{
-  unsigned char tmpstr[20 + length
-		       + 8 + mrw.prd.length
-		       + 8 + mrw.wbg.length
-		       + 8 + mrw.rif.length
-		       + 4];
-  /* Stuff the original maker note into the DNG */
-  memcpy(tmpstr, "Adobe\0MakN\0\0\0\0\x4d\x4d\x00\x00\x00\x00", 20);
-  uint32_pack_msb(offset, tmpstr + 16);
-  uint32_pack_msb(length + 6, tmpstr + 10);
-  memcpy(tmpstr + 20, start, length);
-  length += 20;
-  /* Adobe RAW converter also adds other bits of the MRW here */
-  memcpy(tmpstr + length, "MRW \0\0\0\0\x4d\x4d\x00\x03", 12);
-  length += 12;
-  
-  uint32_pack_msb(8 + mrw.prd.length
-		  + 8 + mrw.wbg.length
-		  + 8 + mrw.rif.length
-		  + 4, tmpstr + length - 8);
-  memcpy(tmpstr + length, mrw.prd.data - 8, mrw.prd.length + 8);
-  length += mrw.prd.length + 8;
-  memcpy(tmpstr + length, mrw.wbg.data - 8, mrw.wbg.length + 8);
-  length += mrw.wbg.length + 8;
-  memcpy(tmpstr + length, mrw.rif.data - 8, mrw.rif.length + 8);
-  length += mrw.rif.length + 8;
-  tiff_ifd_add_byte(&mainifd, DNGPrivateData, length, tmpstr);
-}
-
-static struct tiff_tag* copy_tag(struct tiff_ifd* ifd,
-				 const unsigned char* start,
-				 enum tiff_tag_id tag,
-				 enum tiff_tag_type type,
-				 uint32 count,
-				 uint32 value)
-{
-  struct tiff_tag* newtag;
-  uint32 i;
-  
-  newtag = tiff_ifd_add(ifd, tag, type, count);
-    
-  switch (type) {
-  case ASCII:
-  case UNDEFINED:
-    if (count > 4)
-      memcpy(newtag->data, start + value, newtag->size);
-    else {
-      for (i = 0; i < count; ++i, value <<= 8)
-	newtag->data[i] = value >> 24;
+"  -w, --tile-width=UNS   The maximum width of all the tiles.\n"
+"  -A, --auto-tile        Choose the tile size by trial compression.\n"
+"  -n, --min-tiles=UNS    The minimum number of tiles --auto-tile may pick.\n"
+"  -e, --effort=LEVEL     Trade speed for size: fast, normal, or max.\n"
+"  -L, --layout=LAYOUT    Bayer row layout: fold, plain, or auto.\n"
+"  -a, --align=UNS        Start each tile or strip on a multiple of UNS bytes.\n"
+"  -o, --out=DIRECTORY    Convert all the sources into DIRECTORY.\n"
+"  -j, --jobs=UNS         The number of worker threads to run.\n"
+"  -m, --max-memory=SIZE  Limit the memory used by image data.\n"
+"  -E, --estimate         Report projected output sizes without writing.\n"
+"  -V, --verify           Decode each output and compare it with the source.\n"
+"  -M, --manifest=FILE    Skip sources that FILE records as already converted.\n"
+"  -S, --serve=SOCKET     Convert files named by requests on a local socket.\n"
+"  -W, --watch=DIRECTORY  Convert MRW files as they arrive in DIRECTORY.\n"
+"  -q, --queue-depth=UNS  The number of reads and writes to keep in flight.\n"
+"  -b, --pin              Pin each worker thread to one processor.\n"
+"  -N, --numa             Keep each file on the NUMA node of its workers.\n";
+
+/* The options that apply to each conversion.  Requests to the server
+ * start from the ones given on the command line. */
+struct settings
+{
+  struct mrwtodng_options options;
+  int layout;
+  int verify;
+};
+
+static struct settings settings;
+static int opt_estimate = 0;
+static const char* opt_out = 0;
+static const char* opt_serve = 0;
+static const char* opt_manifest = 0;
+static const char* opt_watch = 0;
+static unsigned int opt_jobs = 0;
+static unsigned long opt_max_memory = 0;
+static unsigned int opt_queue_depth = 16;
+static unsigned int opt_work_flags = 0;
+
+/* One file being converted.  Regular files are read in the background
+ * with io_uring if it is available, or else mapped, and anything else,
+ * such as a pipe on standard input, is read into memory. */
+struct job
+{
+  const struct settings* settings;
+  const char* source;
+  const char* destination;
+  int in_fd;
+  int regular;
+  int mapped;
+  /* The NUMA node the file is converted on. */
+  unsigned node;
+  const unsigned char* data;
+  unsigned long length;
+  struct aio_file in_io;
+  int out_fd;
+  int write_errno;
+  /* Set if the output is written in the background, at out_offset. */
+  int async;
+  unsigned long out_offset;
+  struct aio_file out_io;
+  /* The memory reserved from the budget beyond what the conversion
+   * itself returns. */
+  unsigned long memory;
+  /* The share reserved for the conversion itself. */
+  unsigned long reserved;
+  /* Set if the result is to be recorded in the manifest, along with
+   * what it recorded last time, if anything. */
+  int record;
+  /* Set if the names were allocated for this job. */
+  int owned;
+  const struct manifest_entry* previous;
+  struct timespec mtime;
+  char error[MRWTODNG_ERROR_SIZE];
+};
+
+/* Each file reserves its estimated peak memory from the budget before
+ * it is queued, and the library returns its share as it goes. */
+static struct budget budget;
+static struct work_group file_group;
+static int verify_failed;
+static struct manifest manifest;
+static unsigned char fingerprint[MD5_DIGEST_LENGTH];
+static int use_aio;
+
+/* Outputs written in the background are queued in pieces of this size,
+ * so that the copies held by queued writes stay bounded. */
+#define WRITE_CHUNK (1UL << 20)
+
+static void report_warning(void* arg, const char* message)
+{
+  warn(0, "%s", message);
+  (void)arg;
+}
+
+/* Record why a job failed, with the system error if sys is set. */
+static int job_error(struct job* job, int sys, const char* format, ...)
+{
+  const char* reason = sys ? strerror(errno) : 0;
+  va_list ap;
+  size_t len;
+
+  va_start(ap, format);
+  vsnprintf(job->error, sizeof job->error, format, ap);
+  va_end(ap);
+  if (reason != 0 && (len = strlen(job->error)) < sizeof job->error)
+    snprintf(job->error + len, sizeof job->error - len, ": %s", reason);
+  return 0;
+}
+
+static int pread_all(int fd, unsigned char* buf, size_t count, off_t offset)
+{
+  ssize_t n;
+
+  for (; count > 0; buf += n, count -= n, offset += n)
+    if ((n = pread(fd, buf, count, offset)) <= 0) {
+      if (n == 0)
+	errno = EIO;
+      else if (errno == EINTR) {
+	n = 0;
+	continue;
+      }
+      return 0;
     }
-    break;
-  case SHORT:
-  case SSHORT:
-    if (count == 1)
-      uint16_pack_lsb(value >> 16, newtag->data);
-    else if (count == 2) {
-      uint16_pack_lsb(value >> 16, newtag->data);
-      uint16_pack_lsb(value, newtag->data + 2);
+  return 1;
+}
+
+/* Read the header at once, since it is needed to reserve memory for the
+ * conversion, and queue the rest to be read in the background while the
+ * file waits its turn.  With --numa, the buffer is placed on the node
+ * the file will be converted on before anything is read into it. */
+static int read_source(struct job* job)
+{
+  unsigned long header;
+  unsigned char* data;
+  void* p;
+
+  if (opt_work_flags & WORK_NUMA) {
+    if (posix_memalign(&p, sysconf(_SC_PAGESIZE), job->length) != 0)
+      return job_error(job, 0, "Out of memory");
+    work_bind(p, job->length, job->node);
+    data = p;
+  }
+  else if ((data = malloc(job->length)) == 0)
+    return job_error(job, 0, "Out of memory");
+  job->data = data;
+  header = (job->length < 8) ? job->length : 8;
+  if (!pread_all(job->in_fd, data, header, 0))
+    return job_error(job, 1, "Could not read '%s'", job->source);
+  if (header == 8) {
+    if ((header = mrwtodng_header_length(data)) > job->length)
+      header = job->length;
+    if (!pread_all(job->in_fd, data + 8, header - 8, 8))
+      return job_error(job, 1, "Could not read '%s'", job->source);
+  }
+  aio_read(&job->in_io, job->in_fd, data + header,
+	   job->length - header, header);
+  return 1;
+}
+
+static int load_source(struct job* job)
+{
+  struct stat st;
+  unsigned char* data;
+  unsigned char* grown;
+  unsigned long size;
+  void* map;
+  ssize_t n;
+
+  if (strcmp(job->source, "-") == 0)
+    job->in_fd = 0;
+  else if ((job->in_fd = open(job->source, O_RDONLY)) < 0)
+    return job_error(job, 1, "Could not open '%s' for reading", job->source);
+  if (fstat(job->in_fd, &st) != 0)
+    return job_error(job, 1, "Could not read '%s'", job->source);
+  job->mtime = st.st_mtim;
+
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    job->regular = 1;
+    job->length = st.st_size;
+    if (use_aio)
+      return read_source(job);
+    map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, job->in_fd, 0);
+    if (map == MAP_FAILED)
+      return job_error(job, 1, "Could not read '%s'", job->source);
+    /* Have the kernel start reading it while it waits its turn. */
+    madvise(map, st.st_size, MADV_WILLNEED);
+    job->data = map;
+    job->mapped = 1;
+    return 1;
+  }
+
+  for (data = 0, size = 0, job->length = 0; ; job->length += n) {
+    if (job->length == size) {
+      size = size ? size * 2 : 1 << 20;
+      if ((grown = realloc(data, size)) == 0)
+	return job_error(job, 0, "Out of memory");
+      job->data = data = grown;
     }
-    else
-      for (i = 0; i < count; ++i)
-	uint16_pack_lsb(uint16_get_msb(start + value + i * 2),
-			newtag->data + i * 2);
-    break;
-  case RATIONAL:
-  case SRATIONAL:
-    for (i = 0; i < count; ++i) {
-      uint32_pack_lsb(uint32_get_msb(start + value + i * 8),
-		      newtag->data + i * 8);
-      uint32_pack_lsb(uint32_get_msb(start + value + i * 8 + 4),
-		      newtag->data + i * 8 + 4);
+    if ((n = read(job->in_fd, data + job->length, size - job->length)) == 0)
+      break;
+    if (n < 0) {
+      if (errno != EINTR)
+	return job_error(job, 1, "Could not read '%s'", job->source);
+      n = 0;
     }
-    break;
-  case LONG:
-    if (count == 1)
-      uint32_pack_lsb(value, newtag->data);
-    else
-      for (i = 0; i < count; ++i)
-	uint32_pack_lsb(uint32_get_msb(start + value + i * 4),
-			newtag->data + i * 4);
-    break;
-  default:
-    warn(0, "Unhandled SubEXIF type #%d", type);
   }
-  return newtag;
+  return 1;
 }
 
-static void parse_ttw_iop(const unsigned char* start,
-			  enum tiff_tag_id tag,
-			  enum tiff_tag_type type,
-			  uint32 count,
-			  uint32 value)
+/* Wait for the rest of a source being read in the background. */
+static int finish_load(struct job* job)
 {
-  copy_tag(&iopifd, start, tag, type, count, value);
+  if (!aio_wait(&job->in_io))
+    return job_error(job, 1, "Could not read '%s'", job->source);
+  return 1;
 }
 
-static void parse_ttw_subtag(const unsigned char* start,
-			     enum tiff_tag_id tag,
-			     enum tiff_tag_type type,
-			     uint32 count,
-			     uint32 value)
+/* Write all of a buffer to a file descriptor. */
+static ssize_t write_all(int fd, const unsigned char* buf, size_t count)
 {
-  switch (tag) {
-  case MakerNote:
-    parse_ifd(start, value, parse_ttw_makernote);
-    add_makernote(start + value, value, count);
-    break;
-  case InteroperabilityIFD:
-    iop_offset_tag = tiff_ifd_add_long(&exififd, tag, 1, 0);
-    parse_ifd(start, value, parse_ttw_iop);
-    break;
-  default:
-    copy_tag(&exififd, start, tag, type, count, value);
+  size_t done;
+  ssize_t n;
+
+  for (done = 0; done < count; done += n)
+    if ((n = write(fd, buf + done, count - done)) < 0) {
+      if (errno != EINTR)
+	return -1;
+      n = 0;
+    }
+  return done;
+}
+
+/* Copy part of a regular source file to the output.  The kernel is
+ * asked to copy between the files directly, first with copy_file_range
+ * and then with sendfile, and if neither works between these files the
+ * data is written from memory. */
+static int copy_source(const struct job* job, off_t offset, size_t left)
+{
+  int method;
+  ssize_t n;
+
+  for (method = 0; left > 0; left -= n) {
+    switch (method) {
+    case 0:
+      n = copy_file_range(job->in_fd, &offset, job->out_fd, 0, left, 0);
+      break;
+    case 1:
+      n = sendfile(job->out_fd, job->in_fd, &offset, left);
+      break;
+    default:
+      if ((n = write_all(job->out_fd, job->data + offset, left)) > 0)
+	offset += n;
+    }
+    if (n <= 0) {
+      if ((n == 0 || errno != EINTR) && ++method > 2)
+	return 0;
+      n = 0;
+    }
   }
+  return 1;
 }
 
-static void parse_ttw_tag(const unsigned char* start,
-			  enum tiff_tag_id tag,
-			  enum tiff_tag_type type,
-			  uint32 count,
-			  uint32 value)
+/* Queue a copy of the data to be written in the background. */
+static int write_async(struct job* job,
+		       const unsigned char* data,
+		       unsigned long length)
 {
-  switch (tag) {
-  case ImageWidth:
-  case ImageLength:
-  case Compression:
-    break;
-    
-  case DateTime:
-  case ImageDescription:
-  case Make:
-  case Model:
-  case Software:
-    tiff_ifd_add_ascii(&mainifd, tag, (const char*)start + value);
-    break;
-  case ExifIFD:
-    parse_ifd(start, value, parse_ttw_subtag);
-    break;
-  case Orientation:
-    tiff_ifd_add_short(&mainifd, tag, 1, value >> 16);
-    break;
-  case PrintIM:
-    tiff_ifd_add_undefined(&exififd, tag, count,
-			   (const char*)start + value);
-    break;
-  case XResolution:
-  case YResolution:
-  case ResolutionUnit:
-    break;
-  default:
-    warn(0, "Unhandled EXIF tag #%d", tag);
-  }
-  (void)type;
-}
-
-static void parse_ifd(const unsigned char* start,
-		      uint32 offset,
-		      void (*fn)(const unsigned char* start,
-				 enum tiff_tag_id tag,
-				 enum tiff_tag_type type,
-				 uint32 count,
-				 uint32 value))
-{
-  uint32 entries;
-  enum tiff_tag_id tag;
-  enum tiff_tag_type type;
-  uint32 count;
-  uint32 value;
-
-  for (entries = uint16_get_msb(start + offset), offset += 2;
-       entries > 0;
-       --entries, offset += 12) {
-    tag = uint16_get_msb(start + offset);
-    type = uint16_get_msb(start + offset + 2);
-    count = uint32_get_msb(start + offset + 4);
-    value = uint32_get_msb(start + offset + 8);
-
-    fn(start, tag, type, count, value);
-  }
-}
-
-static void parse_ttw(void)
-{
-  if (memcmp(mrw.ttw.data, "MM\0\052\0\0\0\010", 8) != 0)
-    die(1, "Invalid TTW block format");
-
-  parse_ifd(mrw.ttw.data, 8, parse_ttw_tag);
-
-  if (thumbnail_start != 0
-      && thumbnail_length > 0) {
-
-    tiff_ifd_add_long(&mainifd, ImageWidth, 1, 640);
-    tiff_ifd_add_long(&mainifd, ImageLength, 1, 480);
-    tiff_ifd_add_short(&mainifd, BitsPerSample, 3, 8, 8, 8);
-    tiff_ifd_add_short(&mainifd, Compression, 1, 7);
-    tiff_ifd_add_short(&mainifd, PhotometricInterpretation, 1, 6 /* 2 */);
-    thumbnail_offset_tag = tiff_ifd_add_long(&mainifd, StripOffset, 1, 0);
-    tiff_ifd_add_short(&mainifd, SamplesPerPixel, 1, 3);
-    tiff_ifd_add_long(&mainifd, RowsPerStrip, 1, 480);
-    tiff_ifd_add_long(&mainifd, StripByteCounts, 1, thumbnail_length);
-    tiff_ifd_add_short(&mainifd, PlanarConfiguration, 1, 1);
-    tiff_ifd_add_short(&mainifd, YCbCrSubSampling, 2, 2, 1);
-    tiff_ifd_add_rational(&mainifd, RefBlackWhite, 6,
-			  0,1, 255,1, 128,1, 255,1, 128,1, 255,1);
-
-    tiff_ifd_add_rational(&mainifd, YCbCrCoefficients, 3,
-			  299,1000, 587,1000, 114,1000);
-    tiff_ifd_add_short(&mainifd, YCbCrPositioning, 1, 2);
-  }
-}
-
-static void parse_wbg(void)
-{
-  double r;
-  double g;
-  double b;
-  r = uint16_get_msb(mrw.wbg.data + 4) * 1.0 / (64 << mrw.wbg.data[0]);
-  g = uint16_get_msb(mrw.wbg.data + 6) * 1.0 / (64 << mrw.wbg.data[1])
-    + uint16_get_msb(mrw.wbg.data + 8) * 1.0 / (64 << mrw.wbg.data[2]);
-  g /= 2.0;
-  b = uint16_get_msb(mrw.wbg.data + 10) * 1.0 / (64 << mrw.wbg.data[3]);
-
-  tiff_ifd_add_rational(&mainifd, AnalogBalance, 3,
-			1000000, 1000000,
-			1000000, 1000000,
-			1000000, 1000000);
-  tiff_ifd_add_rational(&mainifd, AsShotNeutral, 3,
-			(uint32)(1000000 / r), 1000000,
-			(uint32)(1000000 / g), 1000000,
-			(uint32)(1000000 / b), 1000000);
-}
-
-static void start_dng(const char* filename)
-{
-  uint16 s;
-
-  tzset();
-  s = -timezone / 60 / 60;
-
-  tiff_ifd_add_long(&mainifd, NewSubfileType, 1, 1);
-  tiff_ifd_add_sshort(&mainifd, TimeZoneOffset, 2, s, s);
-  tiff_ifd_add_byte(&mainifd, DNGVersion, 4, "\1\1\0\0");
-  tiff_ifd_add_byte(&mainifd, DNGBackwardVersion, 4, "\1\1\0\0");
-  tiff_ifd_add_ascii(&mainifd, OriginalRawFileName, filename);
-  /* FIXME: are these all really constant? */
-  tiff_ifd_add_srational(&mainifd, BaselineExposure, 1, -50,100);
-  tiff_ifd_add_rational(&mainifd, BaselineNoise, 1, 133,100);
-  tiff_ifd_add_rational(&mainifd, BaselineSharpness, 1, 133,100);
-  tiff_ifd_add_rational(&mainifd, LinearResponseLimit, 1, 100,100);
-  tiff_ifd_add_rational(&mainifd, ShadowScale, 1, 1,1);
-  tiff_ifd_add_short(&mainifd, CalibrationIlluminant1, 1, 17);
-  tiff_ifd_add_short(&mainifd, CalibrationIlluminant2, 1, 21);
-  tiff_ifd_add_srational(&mainifd, ColorMatrix1, 9,
-			 12036,10000, -4954,10000, -75,10000,
-			 -7019,10000, 14449,10000, 2811,10000,
-			 -513,10000, 635,10000, 6839,10000);
-  tiff_ifd_add_srational(&mainifd, ColorMatrix2, 9,
-			 10239,10000, -3104,10000, -1099,10000,
-			 -8037,10000, 15727,10000, 2451,10000,
-			 -927,10000, 925,10000, 6871,10000);
-  
-  tiff_ifd_add_long(&subifd1, NewSubfileType, 1, 0);
-  tiff_ifd_add_short(&subifd1, PhotometricInterpretation, 1, 32803);
-  tiff_ifd_add_short(&subifd1, BitsPerSample, 1, 16);
-  tiff_ifd_add_long(&subifd1, BayerGreenSplit, 1, 500);
-  tiff_ifd_add_short(&subifd1, PlanarConfiguration, 1, 1);
-  tiff_ifd_add_short(&subifd1, Compression, 1, opt_compress ? 7 : 1);
-  tiff_ifd_add_short(&subifd1, SamplesPerPixel, 1, 1);
-  tiff_ifd_add_rational(&subifd1, AntiAliasStrength, 1, 100, 100);
-  tiff_ifd_add_rational(&subifd1, BestQualityScale, 1, 1, 1);
-  tiff_ifd_add_short(&subifd1, BlackLevelRepeatDim, 2, 1, 1);
-  tiff_ifd_add_rational(&subifd1, BlackLevel, 1, 0, 256);
-  tiff_ifd_add_short(&subifd1, WhiteLevel, 1, 4095);
-
-#if PREVIEW
-  tiff_ifd_add_long(&subifd2, NewSubfileType, 1, 1);
-  tiff_ifd_add_short(&subifd2, PhotometricInterpretation, 1, 6);
-  tiff_ifd_add_short(&subifd2, PlanarConfiguration, 1, 1);
-  tiff_ifd_add_short(&subifd2, SamplesPerPixel, 1, 3);
-  tiff_ifd_add_short(&subifd2, BitsPerSample, 3, 8, 8, 8);
-  tiff_ifd_add_short(&subifd2, Compression, 1, 7);
-  tiff_ifd_add_rational(&subifd2, RefBlackWhite, 6,
-			0, 1, 255, 1, 128, 1, 255, 1, 128, 1, 255, 1);
-  tiff_ifd_add_rational(&subifd2, YCbCrCoefficients, 3,
-			299,1000, 587,1000, 114,1000);
-  tiff_ifd_add_short(&subifd2, YCbCrSubSampling, 2, 2, 2);
-  tiff_ifd_add_short(&subifd2, YCbCrPositioning, 1, 2);
-#endif
-}
-
-static void end_dng(void)
-{
-  uint32 end;
-  struct tiff_tag* sub_tag;
-  struct tiff_tag* exif_tag;
-  uint32 tile;
-
-  sub_tag = tiff_ifd_add(&mainifd, SubIFDs, LONG, 1 + !!PREVIEW);
-  exif_tag = tiff_ifd_add(&mainifd, ExifIFD, LONG, 1);
-
-  end = 8 + tiff_ifd_size(&mainifd);
-
-  uint32_pack_lsb(end, sub_tag->data);
-  end += tiff_ifd_size(&subifd1);
-#if PREVIEW
-  uint32_pack_lsb(end, sub_tag->data + 4);
-  end += tiff_ifd_size(&subifd2);
-#endif
-  uint32_pack_lsb(end, exif_tag->data);
-  end += tiff_ifd_size(&exififd);
-
-  if (iop_offset_tag != 0) {
-    uint32_pack_lsb(end, iop_offset_tag->data);
-    end += tiff_ifd_size(&iopifd);
-  }
-  
-  uint32_pack_lsb(end, thumbnail_offset_tag->data);
-  end += thumbnail_length;
-
-  if (tile_count > 1) {
-    for (tile = 0; tile < tile_count; ++tile) {
-      uint32_pack_lsb(end, raw_offset_tag->data + tile * 4);
-      end += uint32_get_lsb(raw_length_tag->data + tile * 4);
+  unsigned long offset;
+  unsigned long n;
+  unsigned char* buf;
+
+  for (offset = job->out_offset; length > 0;
+       data += n, length -= n, offset += n) {
+    n = (length < WRITE_CHUNK) ? length : WRITE_CHUNK;
+    if ((buf = malloc(n)) == 0) {
+      errno = ENOMEM;
+      return 0;
     }
+    memcpy(buf, data, n);
+    aio_write(&job->out_io, job->out_fd, buf, n, offset);
+  }
+  return 1;
+}
+
+/* The packed raw data is handed over pointing into the source, so that
+ * it can be copied without passing through this process. */
+static int write_output(void* arg,
+			const unsigned char* data,
+			unsigned long length)
+{
+  struct job* job = arg;
+  int ok;
+
+  if (job->regular && data >= job->data && length <= job->length
+      && (unsigned long)(data - job->data) <= job->length - length) {
+    /* The copy goes through the file position, which writes in the
+     * background leave alone. */
+    if (job->async)
+      lseek(job->out_fd, job->out_offset, SEEK_SET);
+    ok = copy_source(job, data - job->data, length);
   }
+  else if (job->async)
+    ok = write_async(job, data, length);
   else
-    uint32_pack_lsb(end, raw_offset_tag->data);
+    ok = write_all(job->out_fd, data, length) >= 0;
+  if (!ok)
+    job->write_errno = errno;
+  job->out_offset += length;
+  return ok;
+}
+
+/* Read the output back, decode it, and compare it with the raw image
+ * from the source. */
+static int verify_output(struct job* job)
+{
+  char error[MRWTODNG_ERROR_SIZE];
+  struct stat st;
+  void* map;
+  int fd;
+  int ok;
+
+  if ((fd = open(job->destination, O_RDONLY)) < 0)
+    return job_error(job, 1, "Could not open '%s' for reading",
+		     job->destination);
+  if (fstat(fd, &st) != 0
+      || (map = mmap(0, st.st_size, PROT_READ, MAP_SHARED,
+		     fd, 0)) == MAP_FAILED) {
+    job_error(job, 1, "Could not read '%s'", job->destination);
+    close(fd);
+    return 0;
+  }
+
+  if (!(ok = mrwtodng_verify(job->data, job->length, map, st.st_size, error)))
+    job_error(job, 0, "Verification of '%s' failed: %s",
+	      job->destination, error);
+
+  munmap(map, st.st_size);
+  close(fd);
+  return ok;
 }
 
-static uint32 compress_block(struct stream* out,
-			     uint32 xoffset,
-			     uint32 enc_width,
-			     uint32 out_width,
-			     uint32 yoffset,
-			     uint32 enc_height,
-			     uint32 out_height)
+static void estimate(const struct job* job)
 {
-  uint32 length;
-  
-  stream_init(out);
-  jpeg_ls_encode(out,
-		 mrw.raw + xoffset + yoffset * mrw.width,
-		 enc_height, out_height,
-		 enc_width / 2, out_width / 2,
-		 2,
-		 12,
-		 mrw.width);
-  if ((length = stream_length(out)) & 1) {
-    stream_putc(out, 0);
-    ++length;
+  char error[MRWTODNG_ERROR_SIZE];
+  struct mrwtodng_estimate* results;
+  unsigned count;
+  unsigned i;
+
+  if (!mrwtodng_estimate(&job->settings->options, job->source,
+			 job->data, job->length, &results, &count, error))
+    die(1, "Could not estimate '%s': %s", job->source, error);
+  flockfile(stdout);
+  for (i = 0; i < count; ++i)
+    printf("%s\t%s\t%s\t%s\t%lu\n", job->source, results[i].layout,
+	   results[i].predictor, results[i].tables, results[i].bytes);
+  funlockfile(stdout);
+  free(results);
+}
+
+/* Wait until the memory budget allows the whole conversion to proceed. */
+static void reserve(struct job* job)
+{
+  if (job->settings->verify)
+    job->memory += mrwtodng_verify_memory(job->data, job->length);
+  if (!job->mapped)
+    job->memory += job->length;
+  job->reserved = mrwtodng_memory(&job->settings->options,
+				  job->data, job->length);
+  budget_acquire(&budget, job->reserved + job->memory);
+}
+
+static int write_job(struct job* job)
+{
+  char error[MRWTODNG_ERROR_SIZE];
+  struct stat st;
+  off_t position;
+
+  if (strcmp(job->destination, "-") == 0)
+    job->out_fd = 1;
+  else if ((job->out_fd = open(job->destination,
+			       O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    /* The conversion never starts, so it cannot return its share. */
+    budget_release(&budget, job->reserved);
+    return job_error(job, 1, "Could not open '%s' for writing",
+		     job->destination);
   }
-  return length;
+  /* Writes in the background go to explicit offsets, so standard output
+   * and files opened for appending, whose position is shared or ignored,
+   * are written in order. */
+  job->async = use_aio && job->out_fd != 1
+    && fstat(job->out_fd, &st) == 0 && S_ISREG(st.st_mode)
+    && (fcntl(job->out_fd, F_GETFL) & O_APPEND) == 0
+    && (position = lseek(job->out_fd, 0, SEEK_CUR)) >= 0;
+  if (job->async)
+    job->out_offset = position;
+  if (!mrwtodng_convert(&job->settings->options, job->source,
+			job->data, job->length, write_output, job, error)) {
+    aio_wait(&job->out_io);
+    if ((errno = job->write_errno) != 0)
+      return job_error(job, 1, "Could not write '%s'", job->destination);
+    return job_error(job, 0, "Could not convert '%s': %s",
+		     job->source, error);
+  }
+  if (!aio_wait(&job->out_io))
+    return job_error(job, 1, "Could not write '%s'", job->destination);
+  if (close(job->out_fd) != 0) {
+    job->out_fd = -1;
+    return job_error(job, 1, "Could not write '%s'", job->destination);
+  }
+  job->out_fd = -1;
+  return 1;
 }
 
-inline uint32 minu(uint32 a, uint32 b)
+/* Remove what was written of an output that failed. */
+static void discard_output(struct job* job)
 {
-  return (a < b) ? a : b;
+  if (job->out_fd > 1) {
+    close(job->out_fd);
+    job->out_fd = -1;
+  }
+  if (strcmp(job->destination, "-") != 0)
+    unlink(job->destination);
 }
 
-static void calc_tiles(void)
+static void release_job(struct job* job)
 {
-  int tile_w;
-  int tile_h;
+  if (job->mapped)
+    munmap((void*)job->data, job->length);
+  else
+    free((void*)job->data);
+  if (job->in_fd > 0)
+    close(job->in_fd);
+  if (job->out_fd > 1)
+    close(job->out_fd);
+  budget_release(&budget, job->memory);
+  if (job->owned) {
+    free((char*)job->source);
+    free((char*)job->destination);
+  }
+}
 
-  if (opt_tile_width == 0) {
-    opt_tile_width = mrw.width / (mrw.width / 256) + (mrw.width % 256 != 0);
-    opt_tile_width += opt_tile_width & 1;
-    /* printf("calculated tile width = %u\n", opt_tile_width); */
+/* The digest of the options that affect the output in the selected
+ * mode.  Those that the mode ignores are left out, so that changing one
+ * does not convert everything again. */
+static void calc_fingerprint(const struct mrwtodng_options* options)
+{
+  struct mrwtodng_options used = *options;
+  const struct mrwtodng_options* o = &used;
+  struct md5_ctx ctx;
+  char buf[256];
+  int len;
+
+  if (used.compress) {
+    used.packed = 0;
+    if (!used.tile && !used.strips)
+      used.auto_tile = 0;
+    if (!used.tile)
+      used.tile_width = used.tile_height = 0;
+    if (!used.strips)
+      used.rows_per_strip = 0;
+  }
+  else {
+    used.tile = used.strips = used.auto_tile = 0;
+    used.rows_per_strip = used.tile_width = used.tile_height = 0;
   }
-  if (opt_tile_height == 0) {
-    opt_tile_height = mrw.height / (mrw.height / 256) + (mrw.height % 256 != 0);
-    opt_tile_height += opt_tile_height & 1;
-    /* printf("calculated tile height = %u\n", opt_tile_height); */
+  if (!used.auto_tile)
+    used.min_tiles = 0;
+  /* The reduced copies are compressed even when the image is not. */
+  if (!used.compress && used.reduced == 0) {
+    memset(&used.encoder, 0, sizeof used.encoder);
+    used.align = 0;
   }
 
-  tile_w = (mrw.width + opt_tile_width - 1) / opt_tile_width;
-  tile_h = (mrw.height + opt_tile_height - 1) / opt_tile_height;
-  tile_count = tile_w * tile_h;
+  len = snprintf(buf, sizeof buf,
+		 "compress=%d packed=%d preview=%d reduced=%u"
+		 " tile=%d strips=%d rows=%u width=%u height=%u"
+		 " auto=%d min=%u predictor=%d tables=%d layout=%d align=%u",
+		 o->compress, o->packed, o->preview, o->reduced,
+		 o->tile, o->strips, o->rows_per_strip,
+		 o->tile_width, o->tile_height, o->auto_tile, o->min_tiles,
+		 o->encoder.predictor, o->encoder.tables, o->encoder.layout,
+		 o->align);
+  md5_init(&ctx);
+  md5_update(&ctx, (const unsigned char*)buf, len);
+  md5_final(&ctx, fingerprint);
 }
 
-static void parse_raw(void)
+/* The last entry for a source that was converted into the same
+ * destination with the same options, if that output still exists. */
+static const struct manifest_entry* previous_entry(const char* source,
+						   const char* destination)
 {
-  uint32 x;
-  uint32 y;
-  int tile;
-  uint32 raw_size;
+  const struct manifest_entry* e;
+  struct stat st;
+
+  if ((e = manifest_find(&manifest, source)) == 0
+      || strcmp(e->destination, destination) != 0
+      || memcmp(e->fingerprint, fingerprint, sizeof fingerprint) != 0
+      || stat(destination, &st) != 0)
+    return 0;
+  return e;
+}
 
-  if (opt_compress) {
-    if (opt_tile) {
-      calc_tiles();
-      compressed_data = malloc(tile_count * sizeof *compressed_data);
+static void record(const struct job* job, const unsigned char* hash)
+{
+  struct manifest_entry e;
+
+  e.source = job->source;
+  e.destination = job->destination;
+  e.size = job->length;
+  e.mtime = job->mtime;
+  memcpy(e.hash, hash, sizeof e.hash);
+  memcpy(e.fingerprint, fingerprint, sizeof e.fingerprint);
+  if (!manifest_add(&manifest, &e))
+    warn(1, "Could not write '%s'", opt_manifest);
+}
 
-      tiff_ifd_add_long(&subifd1, TileWidth, 1, opt_tile_width);
-      tiff_ifd_add_long(&subifd1, TileHeight, 1, opt_tile_height);
-      raw_offset_tag = tiff_ifd_add(&subifd1, TileOffsets, LONG, tile_count);
-      raw_length_tag = tiff_ifd_add(&subifd1, TileByteCounts, LONG, tile_count);
+/* Sources are read ahead of their conversion, but only by as many files
+ * as the queue depth. */
+static pthread_mutex_t ahead_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ahead_cond = PTHREAD_COND_INITIALIZER;
+static unsigned ahead;
 
-      for (tile = 0, y = 0; y < mrw.height; y += opt_tile_height) {
-	for (x = 0; x < mrw.width; x += opt_tile_width, ++tile) {
-	  raw_size = compress_block(&compressed_data[tile],
-				    x,
-				    minu(mrw.width - x, opt_tile_width),
-				    opt_tile_width,
-				    y,
-				    minu(mrw.height - y, opt_tile_height),
-				    opt_tile_height);
-	  uint32_pack_lsb(raw_size, raw_length_tag->data + tile * 4);
-	}
-      }
+static void start_read_ahead(void)
+{
+  pthread_mutex_lock(&ahead_lock);
+  while (ahead >= opt_queue_depth)
+    pthread_cond_wait(&ahead_cond, &ahead_lock);
+  ++ahead;
+  pthread_mutex_unlock(&ahead_lock);
+}
+
+static void end_read_ahead(void)
+{
+  pthread_mutex_lock(&ahead_lock);
+  --ahead;
+  pthread_cond_signal(&ahead_cond);
+  pthread_mutex_unlock(&ahead_lock);
+}
+
+static void convert(void* arg)
+{
+  unsigned char hash[MD5_DIGEST_LENGTH];
+  struct job* job = arg;
+  struct md5_ctx ctx;
+
+  end_read_ahead();
+  if (!finish_load(job)) {
+    if (opt_watch == 0)
+      die(1, "%s", job->error);
+    warn(0, "%s", job->error);
+    budget_release(&budget, job->reserved);
+  }
+  else if (opt_estimate)
+    estimate(job);
+  else {
+    /* A source whose time changed but whose contents did not is only
+     * recorded again. */
+    if (job->record) {
+      md5_init(&ctx);
+      md5_update(&ctx, job->data, job->length);
+      md5_final(&ctx, hash);
     }
+    if (job->previous != 0 && job->previous->size == job->length
+	&& memcmp(job->previous->hash, hash, sizeof hash) == 0)
+      budget_release(&budget, job->reserved);
     else {
-      tile_count = 1;
-      compressed_data = malloc(sizeof *compressed_data);
-      raw_size = compress_block(compressed_data,
-				0, mrw.width, mrw.width,
-				0, mrw.height, mrw.height);
-
-      raw_offset_tag = tiff_ifd_add_long(&subifd1, StripOffset, 1, 0);
-      tiff_ifd_add_long(&subifd1, RowsPerStrip, 1, mrw.height);
-      tiff_ifd_add_long(&subifd1, StripByteCounts, 1, raw_size);
+      /* A file that cannot be converted does not stop a watch. */
+      if (!write_job(job)) {
+	if (opt_watch == 0)
+	  die(1, "%s", job->error);
+	warn(0, "%s", job->error);
+	discard_output(job);
+	job->record = 0;
+      }
+      else if (job->settings->verify && !verify_output(job)) {
+	warn(0, "%s", job->error);
+	verify_failed = 1;
+	job->record = 0;
+      }
     }
+    if (job->record)
+      record(job, hash);
   }
-  else {
-    raw_size = mrw.width * mrw.height * 2;
-
-    tile_count = 1;
-    raw_offset_tag = tiff_ifd_add_long(&subifd1, StripOffset, 1, 0);
-    tiff_ifd_add_long(&subifd1, RowsPerStrip, 1, mrw.height);
-    tiff_ifd_add_long(&subifd1, StripByteCounts, 1, raw_size);
-  }
+  release_job(job);
+  free(job);
 }
 
-static void parse_file(void)
+/* Load the source, reserve its memory, and then queue it.  Sources that
+ * the manifest shows are unchanged since their output was written are
+ * skipped without being read. */
+static void submit(const char* source, const char* destination, int owned)
 {
-  parse_prd();
-  parse_ttw();
-  parse_wbg();
-  /* The data in the RIF block is duplicated by the EXIF data in the TTW
-   * block, which is copied in parse_ttw above. */
-  parse_raw();
+  static unsigned next_node;
+  const struct manifest_entry* previous = 0;
+  struct job* job;
+  struct stat st;
+
+  if (opt_manifest != 0 && strcmp(source, "-") != 0
+      && strcmp(destination, "-") != 0
+      && (previous = previous_entry(source, destination)) != 0
+      && stat(source, &st) == 0
+      && (unsigned long)st.st_size == previous->size
+      && st.st_mtim.tv_sec == previous->mtime.tv_sec
+      && st.st_mtim.tv_nsec == previous->mtime.tv_nsec) {
+    if (owned) {
+      free((char*)source);
+      free((char*)destination);
+    }
+    return;
+  }
+
+  if ((job = calloc(1, sizeof *job)) == 0)
+    die(1, "Out of memory");
+  job->settings = &settings;
+  job->source = source;
+  job->destination = destination;
+  job->out_fd = -1;
+  job->record = opt_manifest != 0 && strcmp(source, "-") != 0
+    && strcmp(destination, "-") != 0;
+  job->previous = previous;
+  job->owned = owned;
+  /* Files are dealt out to the nodes in turn. */
+  job->node = next_node++ % work_nodes();
+  start_read_ahead();
+  if (!load_source(job)) {
+    if (opt_watch == 0)
+      die(1, "%s", job->error);
+    warn(0, "%s", job->error);
+    end_read_ahead();
+    release_job(job);
+    free(job);
+    return;
+  }
+  reserve(job);
+  work_submit_node(&file_group, convert, job, job->node);
 }
 
-static void write_thumbnail(FILE* out)
+/* Generate DIRECTORY/BASENAME.dng from the source name. */
+static char* output_name(const char* source)
 {
-  /* The embeded thumbnail appears to have a garbled JPEG SOI marker. */
-  fwrite("\xff\xd8", 1, 2, out);
-  fwrite(thumbnail_start + 2, 1, thumbnail_length - 2, out);
+  const char* base;
+  const char* ext;
+  char* name;
+  size_t dirlen;
+  size_t baselen;
+
+  base = (base = strrchr(source, '/')) == 0 ? source : base + 1;
+  if ((ext = strrchr(base, '.')) == 0 || ext == base)
+    ext = base + strlen(base);
+  dirlen = strlen(opt_out);
+  baselen = ext - base;
+  if ((name = malloc(dirlen + 1 + baselen + 5)) == 0)
+    die(1, "Out of memory");
+  memcpy(name, opt_out, dirlen);
+  name[dirlen] = '/';
+  memcpy(name + dirlen + 1, base, baselen);
+  strcpy(name + dirlen + 1 + baselen, ".dng");
+  return name;
 }
 
-static void write_image(FILE* out)
+static unsigned long parse_size(const char* s)
 {
-  const struct stream_buffer* b;
-  uint32 tile;
-  
-  if (opt_compress) {
-    for (tile = 0; tile < tile_count; ++tile) {
-      for (b = compressed_data[tile].head; b != 0; b = b->next)
-	fwrite(b->data, 1, b->count, out);
-    }
+  char* end;
+  unsigned long size;
+
+  size = strtoul(s, &end, 10);
+  switch (*end) {
+  case 'g': case 'G':
+    size <<= 10;
+    /* fall through */
+  case 'm': case 'M':
+    size <<= 10;
+    /* fall through */
+  case 'k': case 'K':
+    size <<= 10;
+    ++end;
   }
-  else
-    fwrite(mrw.raw, 2, mrw.width * mrw.height, out);
+  if (*end != 0 || end == s)
+    die(1, "Invalid size: %s", s);
+  return size;
 }
 
+static const char short_options[] =
+  "cCpPR:tTsr:w:h:An:e:L:a:o:j:m:EVS:M:W:q:bN";
 static const struct option long_options[] = {
-  { "compress", no_argument, &opt_compress, 1 },
-  { "no-compress", no_argument, &opt_compress, 0 },
-  { "tile", no_argument, &opt_tile, 1 },
-  { "no-tile", no_argument, &opt_tile, 0 },
+  { "compress", no_argument, 0, 'c' },
+  { "no-compress", no_argument, 0, 'C' },
+  { "packed", no_argument, 0, 'p' },
+  { "preview", no_argument, 0, 'P' },
+  { "reduced", required_argument, 0, 'R' },
+  { "tile", no_argument, 0, 't' },
+  { "no-tile", no_argument, 0, 'T' },
+  { "strips", no_argument, 0, 's' },
+  { "rows-per-strip", required_argument, 0, 'r' },
   { "tile-height", required_argument, 0, 'h' },
   { "tile-width", required_argument, 0, 'w' },
+  { "auto-tile", no_argument, 0, 'A' },
+  { "min-tiles", required_argument, 0, 'n' },
+  { "effort", required_argument, 0, 'e' },
+  { "layout", required_argument, 0, 'L' },
+  { "align", required_argument, 0, 'a' },
+  { "out", required_argument, 0, 'o' },
+  { "jobs", required_argument, 0, 'j' },
+  { "max-memory", required_argument, 0, 'm' },
+  { "estimate", no_argument, 0, 'E' },
+  { "verify", no_argument, 0, 'V' },
+  { "serve", required_argument, 0, 'S' },
+  { "manifest", required_argument, 0, 'M' },
+  { "watch", required_argument, 0, 'W' },
+  { "queue-depth", required_argument, 0, 'q' },
+  { "pin", no_argument, 0, 'b' },
+  { "numa", no_argument, 0, 'N' },
   { 0, 0, 0, 0 }
 };
 
-int main(int argc, char* argv[])
+/* Apply one of the options that control a conversion.  Returns 0, the
+ * format of a message about an invalid argument, or an empty string if
+ * the option is not one of them. */
+static const char* parse_option(struct settings* s, int ch, const char* arg)
 {
-  FILE* in;
-  FILE* out;
+  struct mrwtodng_options* o = &s->options;
+
+  switch (ch) {
+  case 0: break;
+  case 'c': o->compress = 1; break;
+  case 'C': o->compress = 0; o->packed = 0; break;
+  case 'p': o->compress = 0; o->packed = 1; break;
+  case 'P': o->preview = 1; break;
+  case 'R': o->reduced = strtoul(arg, 0, 10); break;
+  case 't': o->tile = 1; o->strips = 0; break;
+  case 'T': o->tile = 0; o->strips = 0; break;
+  case 's': o->tile = 0; o->strips = 1; break;
+  case 'r': return mrwtodng_dimension(o, MRWTODNG_ROWS_PER_STRIP, arg);
+  case 'h': return mrwtodng_dimension(o, MRWTODNG_TILE_HEIGHT, arg);
+  case 'w': return mrwtodng_dimension(o, MRWTODNG_TILE_WIDTH, arg);
+  case 'A': o->auto_tile = 1; break;
+  case 'n':
+    o->min_tiles = strtoul(arg, 0, 10);
+    o->auto_tile = 1;
+    break;
+  case 'e':
+    if (!mrwtodng_effort(o, arg))
+      return "Invalid effort level: %s";
+    break;
+  case 'L':
+    if ((s->layout = mrwtodng_layout(arg)) < 0)
+      return "Invalid layout: %s";
+    break;
+  case 'a':
+    if ((o->align = strtoul(arg, 0, 10)) == 0)
+      return "Invalid alignment: %s";
+    break;
+  case 'V': s->verify = 1; break;
+  default:
+    return "";
+  }
+  /* An explicit layout overrides the one implied by the effort level. */
+  if (s->layout >= 0)
+    o->encoder.layout = s->layout;
+  return 0;
+}
+
+/*****************************************************************************/
+/* The server.  Each connection gets a thread that reads requests one
+ * line at a time and answers each in turn once its file is done, while
+ * the tiles of all the files share the worker threads started at
+ * startup.  A request holds the arguments of one conversion as they
+ * would appear on the command line, separated by tabs: options that
+ * control the conversion, then the source and destination.  The reply
+ * is a line of "ok", the seconds spent waiting for memory and the
+ * seconds spent converting, or "error" and a message, separated by
+ * tabs. */
+
+#define MAX_REQUEST_ARGS 64
+
+/* getopt keeps its state in globals. */
+static pthread_mutex_t getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int parse_request(struct job* job, struct settings* s, char* line)
+{
+  char* argv[MAX_REQUEST_ARGS + 1];
+  const char* format;
+  const char* arg = 0;
+  int argc;
   int ch;
 
-  while ((ch = getopt_long(argc, argv, "cCtTw:h:", long_options, 0)) != -1) {
+  argv[0] = (char*)program;
+  for (argc = 1; line != 0; ++argc) {
+    if (argc == MAX_REQUEST_ARGS)
+      return job_error(job, 0, "Too many arguments");
+    argv[argc] = line;
+    if ((line = strchr(line, '\t')) != 0)
+      *line++ = 0;
+  }
+  argv[argc] = 0;
+
+  *s = settings;
+  format = 0;
+  pthread_mutex_lock(&getopt_lock);
+  optind = 0;
+  while (format == 0
+	 && (ch = getopt_long(argc, argv, short_options,
+			      long_options, 0)) != -1)
+    format = parse_option(s, ch, arg = optarg);
+  if ((argc -= optind) == 2) {
+    job->source = argv[optind];
+    job->destination = argv[optind + 1];
+  }
+  pthread_mutex_unlock(&getopt_lock);
+
+  if (format != 0)
+    return (*format == 0)
+      ? job_error(job, 0, "Unsupported option")
+      : job_error(job, 0, format, arg);
+  if (argc != 2)
+    return job_error(job, 0, "Expected a source and a destination");
+  if (strcmp(job->source, "-") == 0 || strcmp(job->destination, "-") == 0)
+    return job_error(job, 0, "Standard input and output cannot be used");
+  /* Relative names would be taken from the server's directory, not the
+   * client's. */
+  if (job->source[0] != '/' || job->destination[0] != '/')
+    return job_error(job, 0, "Source and destination must be absolute");
+  return 1;
+}
+
+static double elapsed(const struct timespec* from, const struct timespec* to)
+{
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void serve_request(int fd, char* line)
+{
+  char reply[MRWTODNG_ERROR_SIZE + 16];
+  struct timespec received;
+  struct timespec started;
+  struct timespec finished;
+  struct settings s;
+  struct job job;
+  int len;
+  int ok;
+
+  clock_gettime(CLOCK_MONOTONIC, &received);
+  memset(&job, 0, sizeof job);
+  job.settings = &s;
+  job.in_fd = -1;
+  job.out_fd = -1;
+  if ((ok = parse_request(&job, &s, line) && load_source(&job)
+       && finish_load(&job))) {
+    reserve(&job);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (!(ok = write_job(&job)))
+      discard_output(&job);
+    else if (s.verify)
+      ok = verify_output(&job);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+  }
+  release_job(&job);
+
+  if (ok)
+    len = snprintf(reply, sizeof reply, "ok\t%.3f\t%.3f\n",
+		   elapsed(&received, &started), elapsed(&started, &finished));
+  else
+    len = snprintf(reply, sizeof reply, "error\t%s\n", job.error);
+  write_all(fd, (const unsigned char*)reply, len);
+}
+
+static void* serve_client(void* arg)
+{
+  int fd = (long)arg;
+  char* line;
+  size_t size;
+  ssize_t len;
+  FILE* in;
+
+  if ((in = fdopen(fd, "r")) == 0) {
+    close(fd);
+    return 0;
+  }
+  for (line = 0, size = 0; (len = getline(&line, &size, in)) > 0; ) {
+    if (line[len - 1] == '\n')
+      line[--len] = 0;
+    if (len > 0)
+      serve_request(fd, line);
+  }
+  free(line);
+  fclose(in);
+  return 0;
+}
+
+/* Only processes running as the same user as the server may use it,
+ * since it writes and removes whatever files they name. */
+static int trusted_peer(int fd)
+{
+  struct ucred cred;
+  socklen_t len = sizeof cred;
+
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0
+    && cred.uid == getuid();
+}
+
+static void serve(const char* path)
+{
+  struct sockaddr_un addr;
+  pthread_attr_t attr;
+  pthread_t thread;
+  struct stat st;
+  mode_t mask;
+  int listener;
+  int fd;
+
+  if (strlen(path) >= sizeof addr.sun_path)
+    die(1, "Socket name is too long: %s", path);
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  /* A socket left behind by an earlier server is replaced. */
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    die(-1, "Could not listen on '%s'", path);
+  mask = umask(077);
+  if (bind(listener, (struct sockaddr*)&addr, sizeof addr) != 0
+      || listen(listener, SOMAXCONN) != 0)
+    die(-1, "Could not listen on '%s'", path);
+  umask(mask);
+
+  /* A client that goes away before its reply must not stop the server,
+   * and bad options in requests are reported to the client. */
+  signal(SIGPIPE, SIG_IGN);
+  opterr = 0;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (;;) {
+    if ((fd = accept(listener, 0, 0)) < 0) {
+      if (errno != EINTR && errno != ECONNABORTED)
+	warn(1, "Could not accept a connection");
+      continue;
+    }
+    if (!trusted_peer(fd)) {
+      close(fd);
+      continue;
+    }
+    if (pthread_create(&thread, &attr, serve_client, (void*)(long)fd) != 0) {
+      warn(0, "Could not start a thread for a connection");
+      close(fd);
+    }
+  }
+}
+
+/*****************************************************************************/
+static int is_mrw(const char* name)
+{
+  const char* ext;
+
+  return (ext = strrchr(name, '.')) != 0 && ext != name
+    && strcasecmp(ext, ".mrw") == 0;
+}
+
+/* Start watching DIRECTORY before any of the files already in it are
+ * converted, so that none can slip in between. */
+static int start_watch(const char* directory)
+{
+  int fd;
+
+  if ((fd = inotify_init1(IN_CLOEXEC)) < 0
+      || inotify_add_watch(fd, directory,
+			   IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0)
+    die(-1, "Could not watch '%s'", directory);
+  return fd;
+}
+
+/* Convert each MRW file that is written into DIRECTORY or moved into
+ * it, until killed.  A file is picked up when its writer closes it, so
+ * copies in progress are never read. */
+static void watch(const char* directory, int fd)
+{
+  char buf[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event* event;
+  size_t dirlen;
+  char* source;
+  char* p;
+  ssize_t n;
+
+  dirlen = strlen(directory);
+
+  for (;;) {
+    if ((n = read(fd, buf, sizeof buf)) < 0) {
+      if (errno == EINTR)
+	continue;
+      die(-1, "Could not watch '%s'", directory);
+    }
+    for (p = buf; p < buf + n; p += sizeof *event + event->len) {
+      event = (const struct inotify_event*)p;
+      if (event->mask & IN_Q_OVERFLOW)
+	warn(0, "Files arrived in '%s' too quickly, and some were missed",
+	     directory);
+      if (event->mask & IN_IGNORED)
+	die(1, "'%s' can no longer be watched", directory);
+      if (event->len == 0 || (event->mask & IN_ISDIR)
+	  || !is_mrw(event->name))
+	continue;
+      if ((source = malloc(dirlen + 1 + strlen(event->name) + 1)) == 0)
+	die(1, "Out of memory");
+      sprintf(source, "%s/%s", directory, event->name);
+      submit(source, output_name(source), 1);
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  const char* format;
+  int watch_fd = -1;
+  int ch;
+  int i;
+
+  mrwtodng_defaults(&settings.options);
+  settings.options.budget = &budget;
+  settings.options.warning = report_warning;
+  settings.layout = -1;
+  while ((ch = getopt_long(argc, argv, short_options,
+			   long_options, 0)) != -1) {
     switch (ch) {
-    case 0: break;
-    case 'c': opt_compress = 1; break;
-    case 'C': opt_compress = 0; break;
-    case 't': opt_tile = 1; break;
-    case 'T': opt_tile = 0; break;
-    case 'h':
-      if ((opt_tile_height = strtoul(optarg, 0, 10)) < 16)
-	die(1, "Invalid tile height: %s", optarg);
+    case 'o': opt_out = optarg; break;
+    case 'j':
+      if ((opt_jobs = strtoul(optarg, 0, 10)) == 0)
+	die(1, "Invalid number of jobs: %s", optarg);
       break;
-    case 'w':
-      if ((opt_tile_width = strtoul(optarg, 0, 10)) < 16)
-	die(1, "Invalid tile width: %s", optarg);
-      if (opt_tile_width % 2 != 0)
-	die(1, "Tile width must be even: %s", optarg);
+    case 'm': opt_max_memory = parse_size(optarg); break;
+    case 'E': opt_estimate = 1; break;
+    case 'S': opt_serve = optarg; break;
+    case 'M': opt_manifest = optarg; break;
+    case 'W': opt_watch = optarg; break;
+    case 'q':
+      if ((opt_queue_depth = strtoul(optarg, 0, 10)) == 0)
+	die(1, "Invalid queue depth: %s", optarg);
       break;
+    case 'b': opt_work_flags |= WORK_PIN; break;
+    case 'N': opt_work_flags |= WORK_NUMA; break;
     default:
-      die_usage();
+      if ((format = parse_option(&settings, ch, optarg)) != 0) {
+	if (*format == 0)
+	  die_usage();
+	die(1, format, optarg);
+      }
     }
   }
 
-  if (argc - optind != 2)
+  if (settings.verify && opt_out == 0 && !opt_estimate && argc - optind == 2
+      && strcmp(argv[optind + 1], "-") == 0)
+    die(1, "Output written to standard output cannot be verified");
+  if (settings.options.reduced > MRWTODNG_MAX_REDUCED)
+    die(1, "At most %d reduced-resolution copies are supported",
+	MRWTODNG_MAX_REDUCED);
+  if (opt_serve != 0
+      ? argc != optind || opt_out != 0 || opt_estimate || opt_watch != 0
+      : opt_watch != 0
+      ? opt_out == 0 || opt_estimate
+      : (opt_out != 0 || opt_estimate)
+      ? argc - optind < 1
+      : argc - optind != 2)
+    die_usage();
+  if (opt_manifest != 0 && (opt_serve != 0 || opt_estimate))
     die_usage();
-  
-  if ((in = fopen(argv[optind], "rb")) == 0)
-    die(-1, "Could not open '%s' for reading", argv[optind]);
+  /* Estimates are always of compressed output, and nothing is written
+   * to verify.  They only cover the raw data, not the preview. */
+  if (opt_estimate) {
+    settings.options.compress = 1;
+    settings.verify = 0;
+    settings.options.preview = 0;
+    settings.options.reduced = 0;
+  }
 
-  if (!mrw_load(&mrw, in))
-    die(1, "Error while loading MRW file");
-  fclose(in);
+  if (opt_jobs == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opt_jobs = (cpus > 0) ? cpus : 1;
+  }
 
-  start_dng(argv[optind]);
-  parse_file();
-  end_dng();
-
-  if ((out = fopen(argv[optind + 1], "wb")) == 0)
-    die(-1, "Could not open '%s' for writing", argv[optind + 1]);
-  tiff_start(out, 8);
-  tiff_write_ifd(out, &mainifd);
-  tiff_write_ifd(out, &subifd1);
-#if PREVIEW
-  tiff_write_ifd(out, &subifd2);
-#endif
-  tiff_write_ifd(out, &exififd);
-  if (iop_offset_tag != 0)
-    tiff_write_ifd(out, &iopifd);
-  write_thumbnail(out);
-  write_image(out);
-
-  if (fclose(out) != 0)
-    die(-1, "Could not write output");
+  if (opt_manifest != 0) {
+    if (!manifest_open(&manifest, opt_manifest))
+      die(-1, "Could not open '%s'", opt_manifest);
+    calc_fingerprint(&settings.options);
+  }
 
-  return 0;
-  (void)argc;
+  budget_init(&budget, opt_max_memory);
+  if (!work_start(opt_jobs, opt_work_flags))
+    die(1, "Could not start worker thread");
+  use_aio = aio_start(opt_queue_depth);
+
+  if (opt_watch != 0)
+    watch_fd = start_watch(opt_watch);
+  if (opt_serve != 0)
+    serve(opt_serve);
+  else if (opt_estimate)
+    for (i = optind; i < argc; ++i)
+      submit(argv[i], 0, 0);
+  else if (opt_out == 0)
+    submit(argv[optind], argv[optind + 1], 0);
+  else
+    for (i = optind; i < argc; ++i) {
+      if (strcmp(argv[i], "-") == 0)
+	die(1, "Standard input cannot be converted into a directory");
+      submit(argv[i], output_name(argv[i]), 0);
+    }
+  if (opt_watch != 0)
+    watch(opt_watch, watch_fd);
+  work_wait(&file_group);
+
+  if (opt_manifest != 0 && !manifest_close(&manifest))
+    die(-1, "Could not write '%s'", opt_manifest);
+  return verify_failed;
 }
@@ -0,0 +1,145 @@
+#ifndef MRWTODNG__H__
+#define MRWTODNG__H__
+
+#include "jpeg-ls.h"
+
+/* Convert Minolta MRW raw images held in memory into DNG files.  Every
+ * conversion keeps all of its state to itself, so any number of them
+ * may run at once from different threads.  The tiles of each image are
+ * compressed on the shared work queue; without any threads started by
+ * work_start, they are all run by the thread doing the conversion.
+ *
+ * Functions that can fail return 0 and, if error is not null, leave a
+ * message in it of at most MRWTODNG_ERROR_SIZE bytes. */
+
+#define MRWTODNG_ERROR_SIZE 256
+#define MRWTODNG_MAX_REDUCED 3
+
+struct budget;
+
+struct mrwtodng_options
+{
+  int compress;			/* Compress the raw image data */
+  int packed;			/* Otherwise, keep it packed in 12 bits */
+  int preview;			/* Add a half-size JPEG preview */
+  unsigned reduced;		/* Reduced-resolution copies to add */
+  int tile;			/* Compress in tiles, */
+  int strips;			/* or in strips, or else as one block */
+  unsigned rows_per_strip;	/* 0 for the default */
+  unsigned tile_width;		/* 0 for the default */
+  unsigned tile_height;		/* 0 for the default */
+  int auto_tile;		/* Choose the tile size by trial */
+  unsigned min_tiles;		/* The fewest tiles auto_tile may pick */
+  struct jpeg_ls_options encoder;
+  unsigned align;		/* Tile and strip offset alignment */
+
+  /* If not null, the memory the conversion uses is accounted for in
+   * this budget.  The caller acquires mrwtodng_memory bytes from it
+   * before converting, and the conversion has released all of them
+   * by the time it returns. */
+  struct budget* budget;
+
+  /* Called with messages about data that is skipped, if not null. */
+  void (*warning)(void* arg, const char* message);
+  void* warning_arg;
+};
+
+/* Called with the output in order.  Returns 0 to abandon the
+ * conversion.  Packed raw data is passed in a single call that points
+ * into the source buffer. */
+typedef int (*mrwtodng_writer)(void* arg,
+			       const unsigned char* data,
+			       unsigned long length);
+
+/* One line of the report made by mrwtodng_estimate. */
+struct mrwtodng_estimate
+{
+  char layout[32];		/* "uncompressed", "tiles=WxH", ... */
+  const char* predictor;	/* "1", "search", or "-" */
+  const char* tables;		/* "multi", "single", "auto", or "-" */
+  unsigned long bytes;
+};
+
+extern void mrwtodng_defaults(struct mrwtodng_options* options);
+
+/* Set the encoder options for an effort level of "fast", "normal", or
+ * "max".  Returns 0 if the level is not one of them. */
+extern int mrwtodng_effort(struct mrwtodng_options* options,
+			   const char* level);
+
+/* The JPEG-LS row layout named "fold", "plain", or "auto", or -1. */
+extern int mrwtodng_layout(const char* name);
+
+enum mrwtodng_dimension
+{
+  MRWTODNG_ROWS_PER_STRIP,	/* Also selects strips */
+  MRWTODNG_TILE_WIDTH,
+  MRWTODNG_TILE_HEIGHT
+};
+
+/* Set a tile or strip dimension from its text.  Returns 0, or the
+ * format of a message about an invalid value, with one %s for it. */
+extern const char* mrwtodng_dimension(struct mrwtodng_options* options,
+				      enum mrwtodng_dimension which,
+				      const char* value);
+
+/* The tile size the options give an image of the given dimensions
+ * before any auto_tile search.  Returns the number of tiles or strips,
+ * which is 0 without compression. */
+extern unsigned mrwtodng_tiles(const struct mrwtodng_options* options,
+			       unsigned width,
+			       unsigned height,
+			       unsigned* tile_width,
+			       unsigned* tile_height);
+
+/* The length of the header at the start of an MRW file, given its
+ * first 8 bytes.  This is all that mrwtodng_memory and
+ * mrwtodng_verify_memory look at, so the rest of the file may still be
+ * being read while they are called. */
+extern unsigned long mrwtodng_header_length(const unsigned char* mrw);
+
+extern unsigned long mrwtodng_memory(const struct mrwtodng_options* options,
+				     const unsigned char* mrw,
+				     unsigned long length);
+
+/* The name is recorded as the original raw file name. */
+extern int mrwtodng_convert(const struct mrwtodng_options* options,
+			    const char* name,
+			    const unsigned char* mrw,
+			    unsigned long length,
+			    mrwtodng_writer write,
+			    void* arg,
+			    char* error);
+
+/* The same, with the output collected into a buffer allocated with
+ * malloc. */
+extern int mrwtodng_convert_buffer(const struct mrwtodng_options* options,
+				   const char* name,
+				   const unsigned char* mrw,
+				   unsigned long length,
+				   unsigned char** dng,
+				   unsigned long* dng_length,
+				   char* error);
+
+/* Project the output size for each option set instead of converting.
+ * Only compressed raw data without a preview or reduced copies can be
+ * estimated.  The results are allocated with malloc. */
+extern int mrwtodng_estimate(const struct mrwtodng_options* options,
+			     const char* name,
+			     const unsigned char* mrw,
+			     unsigned long length,
+			     struct mrwtodng_estimate** results,
+			     unsigned* count,
+			     char* error);
+
+/* Decode the raw image of a DNG and compare it with the MRW file.  This
+ * uses mrwtodng_verify_memory bytes. */
+extern int mrwtodng_verify(const unsigned char* mrw,
+			   unsigned long mrw_length,
+			   const unsigned char* dng,
+			   unsigned long dng_length,
+			   char* error);
+extern unsigned long mrwtodng_verify_memory(const unsigned char* mrw,
+					    unsigned long length);
+
+#endif
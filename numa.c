@@ -0,0 +1,85 @@
+#define _GNU_SOURCE
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "numa.h"
+
+/* Read a list such as "0-3,8-11" from a sysfs file into a set. */
+static int read_list(const char* path, cpu_set_t* set)
+{
+  char buf[4096];
+  unsigned long first;
+  unsigned long last;
+  char* p;
+  FILE* in;
+  int ok;
+
+  CPU_ZERO(set);
+  if ((in = fopen(path, "r")) == 0)
+    return 0;
+  ok = fgets(buf, sizeof buf, in) != 0;
+  fclose(in);
+  for (p = buf; ok && *p != 0 && *p != '\n'; ) {
+    first = last = strtoul(p, &p, 10);
+    if (*p == '-')
+      last = strtoul(p + 1, &p, 10);
+    for (; first <= last && first < CPU_SETSIZE; ++first)
+      CPU_SET(first, set);
+    if (*p == ',')
+      ++p;
+    else if (*p != 0 && *p != '\n')
+      ok = 0;
+  }
+  return ok;
+}
+
+/* Find the nodes that hold any of the processors this process may run
+ * on, and those processors on each.  Returns the number of nodes, and
+ * if the topology cannot be read, treats the machine as a single node
+ * numbered 0. */
+unsigned numa_load(cpu_set_t* cpus, unsigned* ids, unsigned max)
+{
+  char path[64];
+  cpu_set_t allowed;
+  cpu_set_t online;
+  unsigned count;
+  unsigned id;
+
+  if (sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+    CPU_ZERO(&allowed);
+  count = 0;
+  if (read_list("/sys/devices/system/node/online", &online))
+    for (id = 0; id < CPU_SETSIZE && count < max; ++id) {
+      if (!CPU_ISSET(id, &online))
+	continue;
+      snprintf(path, sizeof path, "/sys/devices/system/node/node%u/cpulist",
+	       id);
+      if (!read_list(path, &cpus[count]))
+	continue;
+      CPU_AND(&cpus[count], &cpus[count], &allowed);
+      if (CPU_COUNT(&cpus[count]) > 0)
+	ids[count++] = id;
+    }
+  if (count == 0) {
+    cpus[0] = allowed;
+    ids[0] = 0;
+    count = 1;
+  }
+  return count;
+}
+
+/* Prefer the node for the pages of a range that are not yet touched.
+ * The range must start on a page boundary. */
+int numa_bind(void* addr, unsigned long length, unsigned id)
+{
+  unsigned long mask;
+
+  if (id >= 8 * sizeof mask)
+    return 0;
+  mask = 1UL << id;
+  return syscall(__NR_mbind, addr, length, MPOL_PREFERRED,
+		 &mask, 8 * sizeof mask + 1, 0) == 0;
+}
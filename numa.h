@@ -0,0 +1,15 @@
+#ifndef NUMA__H__
+#define NUMA__H__
+
+#include <sched.h>
+
+/* The NUMA nodes of the machine, read from sysfs, and the placement of
+ * memory on them with the mbind system call.  Files that include this
+ * need _GNU_SOURCE for cpu_set_t. */
+
+#define NUMA_MAX_NODES 64
+
+extern unsigned numa_load(cpu_set_t* cpus, unsigned* ids, unsigned max);
+extern int numa_bind(void* addr, unsigned long length, unsigned id);
+
+#endif
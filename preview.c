@@ -0,0 +1,278 @@
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "preview.h"
+#include "work.h"
+
+/* Rows of the preview rendered by each job. */
+#define BAND_ROWS 64
+
+/* Fixed point precision of the color conversion coefficients. */
+#define MATRIX_SHIFT 12
+
+#define TONE_SIZE 4096
+
+struct render
+{
+  const struct preview* p;
+  int32_t balance[3];
+  int32_t matrix[9];
+  unsigned char tone[TONE_SIZE];
+  unsigned char* rgb;
+};
+
+struct band_job
+{
+  const struct render* r;
+  uint32 row;
+};
+
+/* sRGB primaries to CIE XYZ (D65). */
+static const double xyz_srgb[9] = {
+  0.412453, 0.357580, 0.180423,
+  0.212671, 0.715160, 0.072169,
+  0.019334, 0.119193, 0.950227,
+};
+
+static int invert3(const double m[9], double out[9])
+{
+  double det;
+  int i;
+
+  out[0] = m[4] * m[8] - m[5] * m[7];
+  out[1] = m[2] * m[7] - m[1] * m[8];
+  out[2] = m[1] * m[5] - m[2] * m[4];
+  out[3] = m[5] * m[6] - m[3] * m[8];
+  out[4] = m[0] * m[8] - m[2] * m[6];
+  out[5] = m[2] * m[3] - m[0] * m[5];
+  out[6] = m[3] * m[7] - m[4] * m[6];
+  out[7] = m[1] * m[6] - m[0] * m[7];
+  out[8] = m[0] * m[4] - m[1] * m[3];
+  if ((det = m[0] * out[0] + m[1] * out[3] + m[2] * out[6]) == 0)
+    return 0;
+  for (i = 0; i < 9; ++i)
+    out[i] /= det;
+  return 1;
+}
+
+/* The camera to sRGB matrix, built the same way as dcraw does: the
+ * sRGB to camera matrix is normalized so that white maps to white, and
+ * then inverted.  The white balance multipliers also scale the raw
+ * range onto the tone curve. */
+static int build_matrix(struct render* r)
+{
+  const struct preview* p = r->p;
+  double camera_srgb[9];
+  double srgb_camera[9];
+  double sum;
+  int i;
+  int j;
+  int k;
+
+  for (i = 0; i < 3; ++i) {
+    for (sum = 0, j = 0; j < 3; ++j) {
+      camera_srgb[i * 3 + j] = 0;
+      for (k = 0; k < 3; ++k)
+	camera_srgb[i * 3 + j] += p->xyz_to_camera[i * 3 + k]
+	  * xyz_srgb[k * 3 + j];
+      sum += camera_srgb[i * 3 + j];
+    }
+    for (j = 0; j < 3; ++j)
+      camera_srgb[i * 3 + j] /= sum;
+  }
+  if (!invert3(camera_srgb, srgb_camera))
+    return 0;
+
+  for (i = 0; i < 9; ++i)
+    r->matrix[i] = lrint(srgb_camera[i] * (1 << MATRIX_SHIFT));
+  for (i = 0; i < 3; ++i)
+    r->balance[i] = lrint(p->balance[i] * ((TONE_SIZE - 1) << 16) / p->white);
+  return 1;
+}
+
+/* The sRGB transfer curve from linear values scaled to the white
+ * level. */
+static void build_tone(struct render* r)
+{
+  double v;
+  int i;
+
+  for (i = 0; i < TONE_SIZE; ++i) {
+    v = (double)i / (TONE_SIZE - 1);
+    v = (v <= 0.0031308) ? v * 12.92 : 1.055 * pow(v, 1 / 2.4) - 0.055;
+    r->tone[i] = lrint(v * 255);
+  }
+}
+
+static inline int32_t clamp_tone(int32_t v)
+{
+  return (v < 0) ? 0 : (v >= TONE_SIZE) ? TONE_SIZE - 1 : v;
+}
+
+/* The white balanced channels are clipped before the color matrix so
+ * that saturated areas stay white.  The inner loop has no branches
+ * except the clamps, so the compiler can vectorize the arithmetic. */
+static void render_band(void* arg)
+{
+  const struct band_job* job = arg;
+  const struct render* r = job->r;
+  const struct preview* p = r->p;
+  const int32_t* m = r->matrix;
+  const int32_t* wb = r->balance;
+  const uint32 end = (job->row + BAND_ROWS < p->height)
+    ? job->row + BAND_ROWS : p->height;
+  const uint16* top;
+  const uint16* bottom;
+  unsigned char* out;
+  int32_t cr;
+  int32_t cg;
+  int32_t cb;
+  uint32 row;
+  uint32 col;
+
+  for (row = job->row; row < end; ++row) {
+    top = p->raw + (p->y + row * 2) * p->row_width + p->x;
+    bottom = top + p->row_width;
+    out = r->rgb + row * p->width * 3;
+    for (col = 0; col < p->width; ++col, top += 2, bottom += 2, out += 3) {
+      cr = clamp_tone((top[0] * wb[0]) >> 16);
+      cg = clamp_tone(((top[1] + bottom[0]) * wb[1]) >> 17);
+      cb = clamp_tone((bottom[1] * wb[2]) >> 16);
+      out[0] = r->tone[clamp_tone((m[0] * cr + m[1] * cg + m[2] * cb)
+				  >> MATRIX_SHIFT)];
+      out[1] = r->tone[clamp_tone((m[3] * cr + m[4] * cg + m[5] * cb)
+				  >> MATRIX_SHIFT)];
+      out[2] = r->tone[clamp_tone((m[6] * cr + m[7] * cg + m[8] * cb)
+				  >> MATRIX_SHIFT)];
+    }
+  }
+}
+
+/*****************************************************************************
+ * libjpeg glue: the compressed data goes straight into a stream, and
+ * errors jump back out of compress_rgb.
+ *****************************************************************************/
+struct stream_destination
+{
+  struct jpeg_destination_mgr pub;
+  struct stream* stream;
+};
+
+static void stream_dest_init(j_compress_ptr cinfo)
+{
+  struct stream_destination* dest = (struct stream_destination*)cinfo->dest;
+  struct stream_buffer* b = dest->stream->tail;
+
+  dest->pub.next_output_byte = b->data + b->count;
+  dest->pub.free_in_buffer = STREAM_BUFSIZE - b->count;
+}
+
+static boolean stream_dest_empty(j_compress_ptr cinfo)
+{
+  struct stream_destination* dest = (struct stream_destination*)cinfo->dest;
+
+  dest->stream->tail->count = STREAM_BUFSIZE;
+  if (!stream_add_buffer(dest->stream))
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  stream_dest_init(cinfo);
+  return TRUE;
+}
+
+static void stream_dest_term(j_compress_ptr cinfo)
+{
+  struct stream_destination* dest = (struct stream_destination*)cinfo->dest;
+
+  dest->stream->tail->count = STREAM_BUFSIZE - dest->pub.free_in_buffer;
+}
+
+struct error_manager
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+static void jpeg_fail(j_common_ptr cinfo)
+{
+  longjmp(((struct error_manager*)cinfo->err)->jump, 1);
+}
+
+static int compress_rgb(const struct preview* p,
+			unsigned char* rgb,
+			struct stream* out)
+{
+  struct jpeg_compress_struct cinfo;
+  struct error_manager err;
+  struct stream_destination dest;
+  JSAMPROW row;
+
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = jpeg_fail;
+  if (setjmp(err.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    return 0;
+  }
+  jpeg_create_compress(&cinfo);
+
+  dest.pub.init_destination = stream_dest_init;
+  dest.pub.empty_output_buffer = stream_dest_empty;
+  dest.pub.term_destination = stream_dest_term;
+  dest.stream = out;
+  cinfo.dest = &dest.pub;
+
+  cinfo.image_width = p->width;
+  cinfo.image_height = p->height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, p->quality, TRUE);
+  cinfo.optimize_coding = TRUE;
+  cinfo.write_JFIF_header = FALSE;
+
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    row = rgb + cinfo.next_scanline * p->width * 3;
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  return 1;
+}
+
+/*****************************************************************************/
+int preview_encode(const struct preview* p, struct stream* out)
+{
+  struct work_group group = { 0 };
+  struct render r;
+  struct band_job* jobs;
+  uint32 bands;
+  uint32 band;
+  int ok;
+
+  r.p = p;
+  if (!build_matrix(&r))
+    return 0;
+  build_tone(&r);
+
+  bands = (p->height + BAND_ROWS - 1) / BAND_ROWS;
+  if ((r.rgb = malloc(p->width * p->height * 3)) == 0)
+    return 0;
+  if ((jobs = malloc(bands * sizeof *jobs)) == 0) {
+    free(r.rgb);
+    return 0;
+  }
+  for (band = 0; band < bands; ++band) {
+    jobs[band].r = &r;
+    jobs[band].row = band * BAND_ROWS;
+    work_submit(&group, render_band, &jobs[band]);
+  }
+  work_wait(&group);
+  free(jobs);
+
+  ok = stream_init(out) && compress_rgb(p, r.rgb, out);
+  free(r.rgb);
+  return ok;
+}
@@ -0,0 +1,26 @@
+#ifndef PREVIEW__H__
+#define PREVIEW__H__
+
+#include "stream.h"
+#include "uint.h"
+
+/* A half-size sRGB preview rendered from an RGGB Bayer image by
+ * binning each 2x2 block of the CFA into one pixel. */
+struct preview
+{
+  const uint16* raw;
+  uint32 row_width;		/* Samples per row of the raw image */
+  uint32 x;			/* Top left corner of the area, both even */
+  uint32 y;
+  uint32 width;			/* Size of the preview in pixels */
+  uint32 height;
+  uint32 white;			/* The raw white level */
+  double xyz_to_camera[9];	/* The D65 color matrix */
+  double balance[3];		/* White balance multipliers */
+  int quality;			/* JPEG quality, 1-100 */
+};
+
+/* Returns 0 if the preview could not be rendered or compressed. */
+extern int preview_encode(const struct preview* p, struct stream* out);
+
+#endif
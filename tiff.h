@@ -86,9 +86,38 @@ struct tiff_tag* tiff_ifd_add_srational(struct tiff_ifd* ifd,
 
 uint32 tiff_ifd_size(const struct tiff_ifd*);
 void tiff_ifd_sort(struct tiff_ifd*);
+void tiff_ifd_free(struct tiff_ifd*);
+
+/* A tag read from an existing file.  The data points into the file. */
+struct tiff_entry
+{
+  enum tiff_tag_type type;
+  uint32 count;
+  const unsigned char* data;
+  int msb;
+};
+
+uint32 tiff_read_header(const unsigned char* data, uint32 length);
+int tiff_read_entry(const unsigned char* data,
+		    uint32 length,
+		    uint32 ifd,
+		    uint32 index,
+		    enum tiff_tag_id* id,
+		    struct tiff_entry* entry);
+int tiff_read_tag(const unsigned char* data,
+		  uint32 length,
+		  uint32 ifd,
+		  enum tiff_tag_id id,
+		  struct tiff_entry* entry);
+uint32 tiff_entry_value(const struct tiff_entry* entry, uint32 index);
+double tiff_entry_real(const struct tiff_entry* entry, uint32 index);
+uint32 tiff_read_value(const unsigned char* data,
+		       uint32 length,
+		       uint32 ifd,
+		       enum tiff_tag_id id,
+		       uint32 dflt);
 
 void tiff_start(FILE*, uint32);
-uint32 tiff_write_ifd(FILE*, struct tiff_ifd*);
-void tiff_end(FILE*, uint32);
+uint32 tiff_write_ifd(FILE*, struct tiff_ifd*, uint32);
 
 #endif
@@ -44,7 +44,7 @@ struct tiff_tag* tiff_ifd_add(struct tiff_ifd* ifd,
   tag->type = type;
   tag->count = count;
   tag->size = ((count * tiff_type_size[type]) + 1) & ~1UL;
-  tag->data = malloc(tag->size);
+  tag->data = calloc(1, tag->size);
   tag->offset = 0;
 
   return tag;
@@ -278,6 +278,20 @@ void tiff_ifd_sort(struct tiff_ifd* ifd)
   ifd->tags = tiff_tag_sort(ifd->tags);
 }
 
+void tiff_ifd_free(struct tiff_ifd* ifd)
+{
+  struct tiff_tag* tag;
+  struct tiff_tag* next;
+
+  for (tag = ifd->tags; tag != 0; tag = next) {
+    next = tag->next;
+    free(tag->data);
+    free(tag);
+  }
+  ifd->tags = 0;
+  ifd->count = 0;
+}
+
 uint32 tiff_ifd_size(const struct tiff_ifd* ifd)
 {
   uint32 total;
@@ -298,15 +312,15 @@ void tiff_start(FILE* out, uint32 offset)
   fwrite(header, 1, 8, out);
 }
 
-uint32 tiff_write_ifd(FILE* out, struct tiff_ifd* ifd)
+/* Write the IFD at the given file offset, which is tracked by the
+ * caller so that the output need not be seekable.  Returns the offset
+ * following the IFD and its padding. */
+uint32 tiff_write_ifd(FILE* out, struct tiff_ifd* ifd, uint32 start)
 {
   struct tiff_tag* tag;
-  uint32 start;
   uint32 offset;
   unsigned char buf[12];
 
-  start = ftell(out);
-
   tiff_ifd_sort(ifd);
   offset = start + 2 + 12 * ifd->count + 4;
 
@@ -337,21 +351,10 @@ uint32 tiff_write_ifd(FILE* out, struct tiff_ifd* ifd)
       fwrite(tag->data, 1, tag->size, out);
   }
 
-  if (offset != (uint32)ftell(out))
-    die(1, "Internal write error");
-
   if (offset % 4 != 0) {
     memset(buf, 0, 4);
     fwrite(buf, 1, 4 - (offset % 4), out);
   }
   
-  return start;
-}
-
-void tiff_end(FILE* out, uint32 offset)
-{
-  unsigned char buf[4];
-  uint32_pack_lsb(offset, buf);
-  fseek(out, 4, SEEK_SET);
-  fwrite(buf, 1, 4, out);
+  return round_long(offset);
 }
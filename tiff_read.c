@@ -0,0 +1,145 @@
+#include "tiff.h"
+
+/* Just enough TIFF parsing to read back the files this program writes,
+ * which are always little-endian, the metadata of other DNG files in
+ * either byte order, and the big-endian TIFF data in the TTW block of
+ * an MRW file.  The byte order is taken from the first byte of the
+ * data.  Every offset is checked against the length of the data, so
+ * damaged files are reported rather than read out of bounds. */
+
+static uint16 get16(int msb, const unsigned char* p)
+{
+  return msb ? uint16_get_msb(p) : uint16_get_lsb(p);
+}
+
+static uint32 get32(int msb, const unsigned char* p)
+{
+  return msb ? uint32_get_msb(p) : uint32_get_lsb(p);
+}
+
+uint32 tiff_read_header(const unsigned char* data, uint32 length)
+{
+  int msb;
+
+  if (length < 8 || data[0] != data[1]
+      || (data[0] != 'I' && data[0] != 'M'))
+    return 0;
+  msb = data[0] == 'M';
+  if (get16(msb, data + 2) != 42)
+    return 0;
+  return get32(msb, data + 4);
+}
+
+/* Read the entry at the given index of an IFD.  Returns 0 past the
+ * last entry or if the entry is damaged. */
+int tiff_read_entry(const unsigned char* data,
+		    uint32 length,
+		    uint32 ifd,
+		    uint32 index,
+		    enum tiff_tag_id* id,
+		    struct tiff_entry* entry)
+{
+  uint32 offset;
+  uint32 size;
+  const unsigned char* ptr;
+  int msb;
+
+  if (ifd == 0 || length < 2 || ifd > length - 2)
+    return 0;
+  msb = data[0] == 'M';
+  if (index >= get16(msb, data + ifd)
+      || index >= (length - ifd - 2) / 12)
+    return 0;
+
+  ptr = data + ifd + 2 + index * 12;
+  *id = get16(msb, ptr);
+  entry->type = get16(msb, ptr + 2);
+  entry->count = get32(msb, ptr + 4);
+  entry->msb = msb;
+  if (entry->type < BYTE || entry->type > DOUBLE
+      || entry->count > length / tiff_type_size[entry->type])
+    return 0;
+  size = entry->count * tiff_type_size[entry->type];
+  if (size <= 4)
+    entry->data = ptr + 8;
+  else {
+    offset = get32(msb, ptr + 8);
+    if (offset > length || size > length - offset)
+      return 0;
+    entry->data = data + offset;
+  }
+  return 1;
+}
+
+int tiff_read_tag(const unsigned char* data,
+		  uint32 length,
+		  uint32 ifd,
+		  enum tiff_tag_id id,
+		  struct tiff_entry* entry)
+{
+  enum tiff_tag_id found;
+  uint32 index;
+
+  for (index = 0;
+       tiff_read_entry(data, length, ifd, index, &found, entry);
+       ++index)
+    if (found == id)
+      return 1;
+  return 0;
+}
+
+uint32 tiff_entry_value(const struct tiff_entry* entry, uint32 index)
+{
+  switch (entry->type) {
+  case BYTE:
+  case UNDEFINED:
+    return entry->data[index];
+  case SHORT:
+    return get16(entry->msb, entry->data + index * 2);
+  case LONG:
+    return get32(entry->msb, entry->data + index * 4);
+  default:
+    return 0;
+  }
+}
+
+/* Any numeric value, including the signed and rational ones. */
+double tiff_entry_real(const struct tiff_entry* entry, uint32 index)
+{
+  const unsigned char* p;
+  uint32 den;
+
+  switch (entry->type) {
+  case SBYTE:
+    return (signed char)entry->data[index];
+  case SSHORT:
+    return (int16_t)get16(entry->msb, entry->data + index * 2);
+  case SLONG:
+    return (int32_t)get32(entry->msb, entry->data + index * 4);
+  case RATIONAL:
+  case SRATIONAL:
+    p = entry->data + index * 8;
+    if ((den = get32(entry->msb, p + 4)) == 0)
+      return 0;
+    if (entry->type == RATIONAL)
+      return (double)get32(entry->msb, p) / den;
+    return (double)(int32_t)get32(entry->msb, p) / (int32_t)den;
+  default:
+    return tiff_entry_value(entry, index);
+  }
+}
+
+/* The value of a tag holding a single integer, or dflt if it is
+ * missing. */
+uint32 tiff_read_value(const unsigned char* data,
+		       uint32 length,
+		       uint32 ifd,
+		       enum tiff_tag_id id,
+		       uint32 dflt)
+{
+  struct tiff_entry entry;
+
+  if (!tiff_read_tag(data, length, ifd, id, &entry) || entry.count < 1)
+    return dflt;
+  return tiff_entry_value(&entry, 0);
+}
@@ -114,3 +114,5 @@ TIFF_TAG(AsShotICCProfile, 50831),
 TIFF_TAG(AsShotPreProfileMatrix, 50832),
 TIFF_TAG(CurrentICCProfile, 50833),
 TIFF_TAG(CurrentPreProfileMatrix, 50834),
+TIFF_TAG(PreviewColorSpace, 50970),
+TIFF_TAG(RawImageDigest, 50972),
@@ -29,6 +29,16 @@ static inline uint32 uint32_get_msb(const unsigned char* c)
   return v;
 }
 
+static inline uint16 uint16_get_lsb(const unsigned char* c)
+{
+  uint16 v;
+  memcpy(&v, c, 2);
+#if __BYTE_ORDER == __BIG_ENDIAN
+  v = bswap_16(v);
+#endif
+  return v;
+}
+
 static inline uint32 uint32_get_lsb(const unsigned char* c)
 {
   uint32 v;
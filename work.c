@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "numa.h"
+#include "work.h"
+
+/* A work-stealing scheduler.  Each worker thread has its own deque of
+ * jobs: the jobs it submits go on the bottom, it takes its own work
+ * from the bottom (newest first), and idle threads steal from the top
+ * (oldest first).  Jobs submitted by any other thread, such as the
+ * files queued by the main thread, go on a shared queue that is taken
+ * in order.  A thread looking for work tries its own deque, then the
+ * others', and only then the shared queue, so the tiles of files that
+ * have started spread across every core before another file begins.
+ *
+ * Jobs are grouped so that a caller can wait for just the jobs it
+ * submitted.  A thread waiting on a group runs other jobs rather than
+ * sleeping, which keeps nested waits (files waiting on their own tiles)
+ * from starving the pool.  A worker that is already inside a job takes
+ * only stolen jobs while it waits, never a new file from the shared
+ * queue, so a file is not held up behind a whole other file.  With no
+ * threads started at all, every job runs in the thread that waits for
+ * it.
+ *
+ * With WORK_NUMA, the workers are spread across the NUMA nodes and
+ * confined to their node's processors, and each node has its own
+ * shared queue.  Workers look for work on their own node first: their
+ * own deque, the deques of the other workers on the node, and the
+ * node's shared queue.  Only then do they take files queued for other
+ * nodes, and last of all tiles from workers on other nodes.  Since the
+ * memory a job allocates is placed on the node of the thread that
+ * first touches it, the raw image and tiles of a file mostly stay on
+ * one node.  This is only a preference: an idle worker still takes work
+ * queued for another node rather than wait, and the job runs there
+ * with its memory wherever it was placed. */
+
+struct work_item
+{
+  void (*fn)(void* arg);
+  void* arg;
+  struct work_group* group;
+  struct work_item* prev;
+  struct work_item* next;
+};
+
+struct work_deque
+{
+  pthread_mutex_t lock;
+  struct work_item* top;
+  struct work_item* bottom;
+};
+
+struct work_worker
+{
+  struct work_deque deque;
+  unsigned node;
+};
+
+static struct work_worker* workers;
+static unsigned worker_count;
+static struct work_deque shared_queue = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+static struct work_deque* shared = &shared_queue;
+static unsigned nodes = 1;
+static unsigned node_ids[NUMA_MAX_NODES];
+
+/* Sleeping threads wait for the epoch to change, which it does
+ * whenever a job is submitted or a group finishes. */
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_changed = PTHREAD_COND_INITIALIZER;
+static unsigned long epoch;
+static unsigned sleepers;
+
+/* The deque of the worker running in this thread, if any, its node,
+ * and how many jobs the thread is inside. */
+static __thread struct work_deque* local;
+static __thread unsigned self;
+static __thread unsigned home;
+static __thread unsigned depth;
+
+static void push_bottom(struct work_deque* d, struct work_item* item)
+{
+  pthread_mutex_lock(&d->lock);
+  item->next = 0;
+  if ((item->prev = d->bottom) != 0)
+    d->bottom->next = item;
+  else
+    d->top = item;
+  d->bottom = item;
+  pthread_mutex_unlock(&d->lock);
+}
+
+static struct work_item* pop_bottom(struct work_deque* d)
+{
+  struct work_item* item;
+
+  pthread_mutex_lock(&d->lock);
+  if ((item = d->bottom) != 0) {
+    if ((d->bottom = item->prev) != 0)
+      d->bottom->next = 0;
+    else
+      d->top = 0;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return item;
+}
+
+static struct work_item* pop_top(struct work_deque* d)
+{
+  struct work_item* item;
+
+  pthread_mutex_lock(&d->lock);
+  if ((item = d->top) != 0) {
+    if ((d->top = item->next) != 0)
+      d->top->prev = 0;
+    else
+      d->bottom = 0;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return item;
+}
+
+/* Steal from the workers on the node, or on every other node. */
+static struct work_item* steal(unsigned n, int same_node)
+{
+  struct work_worker* w;
+  struct work_item* item;
+  unsigned i;
+
+  for (i = 1; i <= n; ++i) {
+    w = &workers[(self + i) % n];
+    if ((w->node == home) == same_node && (item = pop_top(&w->deque)) != 0)
+      return item;
+  }
+  return 0;
+}
+
+static struct work_item* find_work(void)
+{
+  struct work_item* item;
+  unsigned n;
+  unsigned i;
+
+  if (local != 0 && (item = pop_bottom(local)) != 0)
+    return item;
+  n = __atomic_load_n(&worker_count, __ATOMIC_ACQUIRE);
+  if ((item = steal(n, 1)) != 0)
+    return item;
+  if (depth == 0 || local == 0)
+    for (i = 0; i < nodes; ++i)
+      if ((item = pop_top(&shared[(home + i) % nodes])) != 0)
+	return item;
+  return steal(n, 0);
+}
+
+static void notify(void)
+{
+  pthread_mutex_lock(&work_lock);
+  ++epoch;
+  if (sleepers > 0)
+    pthread_cond_broadcast(&work_changed);
+  pthread_mutex_unlock(&work_lock);
+}
+
+static void work_run(struct work_item* item)
+{
+  struct work_group* group = item->group;
+
+  ++depth;
+  item->fn(item->arg);
+  --depth;
+  free(item);
+  if (__sync_sub_and_fetch(&group->pending, 1) == 0)
+    notify();
+}
+
+/* Sleep until the epoch moves on from e, or the group (if any) is
+ * done. */
+static void work_sleep(unsigned long e, struct work_group* group)
+{
+  pthread_mutex_lock(&work_lock);
+  ++sleepers;
+  while (epoch == e && (group == 0 || group->pending > 0))
+    pthread_cond_wait(&work_changed, &work_lock);
+  --sleepers;
+  pthread_mutex_unlock(&work_lock);
+}
+
+static void* work_thread(void* arg)
+{
+  struct work_item* item;
+  unsigned long e;
+
+  self = (unsigned long)arg;
+  local = &workers[self].deque;
+  home = workers[self].node;
+  for (;;) {
+    e = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+    if ((item = find_work()) != 0)
+      work_run(item);
+    else
+      work_sleep(e, 0);
+  }
+  return 0;
+}
+
+/* The cpu'th processor in a set, counting around. */
+static int nth_cpu(const cpu_set_t* set, unsigned cpu)
+{
+  int i;
+
+  cpu %= CPU_COUNT(set);
+  for (i = 0; i < CPU_SETSIZE; ++i)
+    if (CPU_ISSET(i, set) && cpu-- == 0)
+      break;
+  return i;
+}
+
+/* Workers are dealt out to the nodes in turn, and with WORK_PIN, to
+ * the processors of each node in turn.  Returns 0 if any of the
+ * threads could not be started. */
+int work_start(unsigned threads, unsigned flags)
+{
+  cpu_set_t cpus[NUMA_MAX_NODES];
+  unsigned next[NUMA_MAX_NODES];
+  pthread_attr_t attr;
+  pthread_t thread;
+  cpu_set_t set;
+  unsigned node;
+  unsigned i;
+
+  if (threads == 0)
+    return 1;
+  if (flags != 0) {
+    i = numa_load(cpus, node_ids, NUMA_MAX_NODES);
+    if (flags & WORK_NUMA)
+      nodes = i;
+    else
+      while (i-- > 1)
+	CPU_OR(&cpus[0], &cpus[0], &cpus[i]);
+  }
+  if ((workers = calloc(threads, sizeof *workers)) == 0)
+    return 0;
+  if (nodes > 1) {
+    if ((shared = calloc(nodes, sizeof *shared)) == 0)
+      return 0;
+    for (i = 0; i < nodes; ++i)
+      pthread_mutex_init(&shared[i].lock, 0);
+  }
+  for (i = 0; i < nodes; ++i)
+    next[i] = 0;
+
+  /* Workers only steal from deques that exist, so the count grows as
+   * each is started. */
+  for (i = 0; i < threads; ++i) {
+    pthread_mutex_init(&workers[i].deque.lock, 0);
+    workers[i].node = node = i % nodes;
+    pthread_attr_init(&attr);
+    if (flags == 0 || CPU_COUNT(&cpus[node]) == 0)
+      ;
+    else if (flags & WORK_PIN) {
+      CPU_ZERO(&set);
+      CPU_SET(nth_cpu(&cpus[node], next[node]++), &set);
+      pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+    }
+    else if (flags & WORK_NUMA)
+      pthread_attr_setaffinity_np(&attr, sizeof cpus[node], &cpus[node]);
+    if (pthread_create(&thread, &attr, work_thread,
+		       (void*)(unsigned long)i) != 0)
+      return 0;
+    pthread_attr_destroy(&attr);
+    __atomic_store_n(&worker_count, i + 1, __ATOMIC_RELEASE);
+  }
+  return 1;
+}
+
+/* The number of nodes that jobs can be queued for. */
+unsigned work_nodes(void)
+{
+  return nodes;
+}
+
+/* Place the untouched pages of a range, which must start on a page
+ * boundary, on a node. */
+int work_bind(void* addr, unsigned long length, unsigned node)
+{
+  return node < nodes && numa_bind(addr, length, node_ids[node]);
+}
+
+static void queue(struct work_deque* d,
+		  struct work_group* group,
+		  void (*fn)(void* arg),
+		  void* arg)
+{
+  struct work_item* item;
+
+  /* Without memory to queue the job, it is run at once instead. */
+  if ((item = malloc(sizeof *item)) == 0) {
+    fn(arg);
+    return;
+  }
+  item->fn = fn;
+  item->arg = arg;
+  item->group = group;
+
+  __sync_add_and_fetch(&group->pending, 1);
+  push_bottom(d, item);
+  notify();
+}
+
+void work_submit(struct work_group* group,
+		 void (*fn)(void* arg),
+		 void* arg)
+{
+  queue(local != 0 ? local : &shared[home], group, fn, arg);
+}
+
+/* Queue a job, such as a whole file, to be started on a node. */
+void work_submit_node(struct work_group* group,
+		      void (*fn)(void* arg),
+		      void* arg,
+		      unsigned node)
+{
+  queue(&shared[node % nodes], group, fn, arg);
+}
+
+void work_wait(struct work_group* group)
+{
+  struct work_item* item;
+  unsigned long e;
+
+  while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+    e = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+    if ((item = find_work()) != 0)
+      work_run(item);
+    else
+      work_sleep(e, group);
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef WORK__H__
+#define WORK__H__
+
+struct work_group
+{
+  unsigned long pending;
+};
+
+#define WORK_PIN 1		/* Pin each thread to one processor */
+#define WORK_NUMA 2		/* Keep jobs on the NUMA node they start on */
+
+extern int work_start(unsigned threads, unsigned flags);
+extern void work_submit(struct work_group* group,
+			void (*fn)(void* arg),
+			void* arg);
+extern void work_submit_node(struct work_group* group,
+			     void (*fn)(void* arg),
+			     void* arg,
+			     unsigned node);
+extern void work_wait(struct work_group* group);
+extern unsigned work_nodes(void);
+extern int work_bind(void* addr, unsigned long length, unsigned node);
+
+#endif